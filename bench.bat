@@ -0,0 +1,5 @@
+@echo off
+
+rem Build and run the benchmarks
+cl src\main.c /Febuild\bench.exe -nologo -W4 -FC -Z7 -O2 -GS- -Gs99999 -DR0GU3_BENCHMARK -link -incremental:no -opt:ref -nodefaultlib -entry:main kernel32.lib -stack:100000,100000
+build\bench.exe
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Build the headless renderer and its benchmarks (no window, no display needed)
+mkdir -p build
+cc src/main.c -o build/headless -std=gnu11 -O2 -DR0GU3_HEADLESS -lpthread -ldl
+cc src/main.c -o build/headless_bench -std=gnu11 -O2 -DR0GU3_HEADLESS -DR0GU3_BENCHMARK -lpthread -ldl
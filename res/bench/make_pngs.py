@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#
+# Writes the PNGs the decoding benchmark is compared on, next to this
+# script:
+#
+#     python3 res/bench/make_pngs.py
+#     build/headless_bench --png res/bench/tiles.png \
+#         --png res/bench/noise.png --png res/bench/gradient.png
+#
+# All three are 8-bit RGBA with the rows cycling through the five filter
+# types, compressed with zlib at the level given below. The pixels only
+# depend on this script; the compressed bytes can differ slightly between
+# zlib versions.
+
+import os
+import struct
+import zlib
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+def filter_row(filter_type, row, prev):
+    out = bytearray([filter_type])
+    for i in range(len(row)):
+        a = row[i - 4] if i >= 4 else 0
+        b = prev[i]
+        c = prev[i - 4] if i >= 4 else 0
+        predictor = (0, a, b, (a + b) // 2, paeth(a, b, c))[filter_type]
+        out.append((row[i] - predictor) & 0xff)
+    return out
+
+def chunk(chunk_type, data):
+    crc = zlib.crc32(chunk_type + data) & 0xffffffff
+    return struct.pack(">I", len(data)) + chunk_type + data + struct.pack(">I", crc)
+
+def write_png(path, width, height, pixel, level):
+    raw = bytearray()
+    prev = bytearray(width*4)
+    for y in range(height):
+        row = bytearray()
+        for x in range(width):
+            row += bytes(pixel(x, y))
+        raw += filter_row(y % 5, row, prev)
+        prev = row
+
+    header = struct.pack(">IIBBBBB", width, height, 8, 6, 0, 0, 0)
+    with open(path, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n")
+        f.write(chunk(b"IHDR", header))
+        f.write(chunk(b"IDAT", zlib.compress(bytes(raw), level)))
+        f.write(chunk(b"IEND", b""))
+
+# Same xorshift as BenchRandom in main.c
+state = 0x2545f491
+def random_u32():
+    global state
+    state ^= (state << 13) & 0xffffffff
+    state ^= state >> 17
+    state ^= (state << 5) & 0xffffffff
+    return state
+
+noise = [random_u32().to_bytes(4, "little") for _ in range(512*512)]
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# Flat 32x32 blocks: long matches, few literals
+write_png(os.path.join(here, "tiles.png"), 512, 512,
+    lambda x, y: ((x//32*37) & 0xff, (y//32*53) & 0xff, ((x ^ y)//16*29) & 0xff, 0xff), 9)
+
+# Incompressible: nearly all literals
+write_png(os.path.join(here, "noise.png"), 512, 512,
+    lambda x, y: noise[y*512 + x], 1)
+
+# Smooth ramps: short matches and small filtered deltas
+write_png(os.path.join(here, "gradient.png"), 1024, 1024,
+    lambda x, y: (x//4, y//4, (x + y)//8 & 0xff, 0xff), 6)
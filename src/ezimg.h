@@ -8,13 +8,18 @@ Usage:
 #include "ezimg.h"
 
 unsigned int width, height;
-uncomp_img_size = ezimg_bmp_size(comp_image, comp_image_size);
+uncomp_img_size = ezimg_bmp_size(comp_image, comp_image_size, EZIMG_FORMAT_BGRA);
 uncomp_img = malloc(uncomp_img_size);
 ezimg_bmp_load(
     comp_image, comp_image_size,
     uncomp_img, uncomp_img_size,
+    EZIMG_FORMAT_BGRA,
     &width, &height);
 
+The pixels are at the start of uncomp_img, ezimg_pitch(format, width)
+bytes per row, top row first. The size functions ask for a bit more than
+that, the decoders use the rest as working memory.
+
 Supported formats:
 [x] BMP
 [x] PNG
@@ -37,24 +42,105 @@ enum
     EZIMG_NOT_SUPPORTED
 };
 
-unsigned int ezimg_bmp_size(void *in, unsigned int in_size);
+/* Output pixel formats. The 4 bytes per pixel ones are named after the
+   order of the bytes in memory, so BGRA is 0xAARRGGBB as a little endian
+   32-bit integer */
+enum
+{
+    EZIMG_FORMAT_BGRA,
+    EZIMG_FORMAT_RGBA,
+    EZIMG_FORMAT_ARGB,
+    EZIMG_FORMAT_BGRA_PREMULTIPLIED, /* color channels scaled by alpha */
+    EZIMG_FORMAT_ALPHA8, /* 1 byte per pixel, the alpha */
+    EZIMG_FORMAT_LUMA8, /* 1 byte per pixel, the luma (BT.601 weights) */
+    EZIMG_FORMAT_MASK1 /* 1 bit per pixel, most significant bit first, set
+                          where the pixel is opaque and bright (alpha and
+                          luma >= 128), e.g. a font's glyphs */
+};
+
+/* Bytes per row of an image width pixels wide, 0 if format is unknown */
+unsigned int ezimg_pitch(int format, unsigned int width);
+
+unsigned int ezimg_bmp_size(void *in, unsigned int in_size, int format);
 int ezimg_bmp_load(
     void *in, unsigned int in_size,
     void *out, unsigned int out_size,
+    int format,
     unsigned int *width, unsigned int *height);
 
-unsigned int ezimg_png_size(void *in, unsigned int in_size);
+unsigned int ezimg_png_size(void *in, unsigned int in_size, int format);
 int ezimg_png_load(
     void *in, unsigned int in_size,
     void *out, unsigned int out_size,
+    int format,
+    unsigned int *width, unsigned int *height);
+
+/*
+ Push decoding, for PNGs that come in pieces: ezimg_png_init, then
+ ezimg_png_feed with every piece as it arrives (any size, down to a byte)
+ and ezimg_png_finish at the end. Rows are decoded as soon as their data
+ is in, into the pixels at the start of out like ezimg_png_load does, or
+ with a callback they are handed over one at a time and not kept. Then out
+ only needs one row and the working memory, a little over 100K for most
+ widths, whatever the height of the image.
+
+ ezimg_png_decoder_size says how big out has to be (which should be
+ aligned like malloc returns), from the start of the file (24 bytes will
+ do). The decoder lives at the end of out.
+ */
+typedef struct ezimg_png_decoder ezimg_png_decoder;
+
+/* row is in the format given to ezimg_png_init and only valid during the
+   call */
+typedef void ezimg_png_row_callback(
+    void *user, void *row,
+    unsigned int y, unsigned int width);
+
+unsigned int ezimg_png_decoder_size(
+    void *in, unsigned int in_size,
+    int format, int use_callback);
+
+/* Returns 0 if out_size is too small for even the decoder */
+ezimg_png_decoder *ezimg_png_init(
+    void *out, unsigned int out_size,
+    int format,
+    ezimg_png_row_callback *callback, void *user);
+
+/* Return EZIMG_OK while everything is fine, the first error otherwise */
+int ezimg_png_feed(ezimg_png_decoder *decoder, void *in, unsigned int in_size);
+int ezimg_png_finish(
+    ezimg_png_decoder *decoder,
     unsigned int *width, unsigned int *height);
 
+enum
+{
+    EZIMG_UNFILTER_AUTO,
+    EZIMG_UNFILTER_SCALAR,
+    EZIMG_UNFILTER_SSE2
+};
+
+/* Picks the kernels PNG rows are unfiltered with, AUTO (the default) picks
+   the fastest the CPU has. Returns 0 if the CPU can't run them. */
+int ezimg_png_set_unfilter(int unfilter);
+
 #ifdef EZIMG_IMPLEMENTATION
 #ifndef EZIMG_IMPLEMENTED
 #define EZIMG_IMPLEMENTED
 
 #define EZIMG_ABS(x) (((x)<0)?(-(x)):(x))
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EZIMG_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define EZIMG_SSE2 0
+#endif
+
 int
 ezimg_least_significant_set_bit(unsigned int value)
 {
@@ -190,6 +276,110 @@ ezimg_read_i32(ezimg_stream *stream)
     return(value);
 }
 
+unsigned int
+ezimg_pitch(int format, unsigned int width)
+{
+    if( format == EZIMG_FORMAT_BGRA ||
+        format == EZIMG_FORMAT_RGBA ||
+        format == EZIMG_FORMAT_ARGB ||
+        format == EZIMG_FORMAT_BGRA_PREMULTIPLIED)
+    {
+        return(width*4);
+    }
+    else if(format == EZIMG_FORMAT_ALPHA8 ||
+            format == EZIMG_FORMAT_LUMA8)
+    {
+        return(width);
+    }
+    else if(format == EZIMG_FORMAT_MASK1)
+    {
+        return((width + 7)/8);
+    }
+
+    return(0);
+}
+
+/* Exact round(x*y/255) for x, y in 0..255 */
+unsigned char
+ezimg_mul_div_255(unsigned int x, unsigned int y)
+{
+    unsigned int t = x*y + 128;
+    return((unsigned char)((t + (t >> 8)) >> 8));
+}
+
+/* Writes a row of width RGB (bpp 3) or RGBA (bpp 4) pixels to dst in
+   format, this is the only place the decoders write their output */
+void
+ezimg_convert_row(
+    unsigned char *dst, unsigned char *src,
+    unsigned int width, unsigned int bpp, int format)
+{
+#define CONVERT(STORE)\
+    for(x = 0;\
+        x < width;\
+        ++x)\
+    {\
+        r = src[0];\
+        g = src[1];\
+        b = src[2];\
+        a = (bpp == 4) ? src[3] : 0xff;\
+        src += bpp;\
+        STORE\
+    }
+#define LUMA(r, g, b) ((77*(unsigned int)(r) + 150*(unsigned int)(g) + 29*(unsigned int)(b) + 128) >> 8)
+
+    unsigned int x;
+    unsigned char r, g, b, a;
+
+    if(format == EZIMG_FORMAT_BGRA)
+    {
+        CONVERT(dst[0] = b; dst[1] = g; dst[2] = r; dst[3] = a; dst += 4;)
+    }
+    else if(format == EZIMG_FORMAT_RGBA)
+    {
+        CONVERT(dst[0] = r; dst[1] = g; dst[2] = b; dst[3] = a; dst += 4;)
+    }
+    else if(format == EZIMG_FORMAT_ARGB)
+    {
+        CONVERT(dst[0] = a; dst[1] = r; dst[2] = g; dst[3] = b; dst += 4;)
+    }
+    else if(format == EZIMG_FORMAT_BGRA_PREMULTIPLIED)
+    {
+        CONVERT(
+            dst[0] = ezimg_mul_div_255(b, a);
+            dst[1] = ezimg_mul_div_255(g, a);
+            dst[2] = ezimg_mul_div_255(r, a);
+            dst[3] = a;
+            dst += 4;)
+    }
+    else if(format == EZIMG_FORMAT_ALPHA8)
+    {
+        CONVERT(*dst++ = a;)
+    }
+    else if(format == EZIMG_FORMAT_LUMA8)
+    {
+        CONVERT(*dst++ = (unsigned char)LUMA(r, g, b);)
+    }
+    else if(format == EZIMG_FORMAT_MASK1)
+    {
+        for(x = 0;
+            x < (width + 7)/8;
+            ++x)
+        {
+            dst[x] = 0;
+        }
+
+        CONVERT(
+            if(a >= 128 && LUMA(r, g, b) >= 128)
+            {
+                dst[x >> 3] |= (unsigned char)(0x80 >> (x & 7));
+            })
+    }
+
+#undef LUMA
+#undef CONVERT
+}
+
 int
 ezimg_bmp_check_signature(unsigned char sign1, unsigned sign2)
 {
@@ -200,12 +390,36 @@ ezimg_bmp_check_signature(unsigned char sign1, unsigned sign2)
     return(0);
 }
 
+void
+ezimg_bmp_mirror_row(unsigned char *row, unsigned int width)
+{
+    unsigned char *l, *r, t;
+    unsigned int i;
+
+    l = row;
+    r = row + (width - 1)*4;
+    while(l < r)
+    {
+        for(i = 0;
+            i < 4;
+            ++i)
+        {
+            t = l[i];
+            l[i] = r[i];
+            r[i] = t;
+        }
+
+        l += 4;
+        r -= 4;
+    }
+}
+
 unsigned int
-ezimg_bmp_size(void *in, unsigned int in_size)
+ezimg_bmp_size(void *in, unsigned int in_size, int format)
 {
     unsigned char sign1, sign2;
     int width, height;
-    unsigned int abs_width, abs_height;
+    unsigned int abs_width, abs_height, pitch;
     ezimg_stream stream = {0};
 
     if(in_size < 54)
@@ -231,18 +445,33 @@ ezimg_bmp_size(void *in, unsigned int in_size)
     abs_width = (unsigned int)EZIMG_ABS(width);
     abs_height = (unsigned int)EZIMG_ABS(height);
 
-    return(abs_width*abs_height*4);
+    pitch = ezimg_pitch(format, abs_width);
+    if(!pitch)
+    {
+        return(0);
+    }
+
+    /* NOTE: Rows are decoded to RGBA after the pixels, then converted */
+    return(pitch*abs_height + abs_width*4);
 }
 
 int
 ezimg_bmp_load(
     void *in, unsigned int in_size,
     void *out, unsigned int out_size,
+    int format,
     unsigned int *width, unsigned int *height)
 {
-#define XY2OFF(X, Y) (((Y)*absw + (X))*4)
-#define YX2OFF(Y, X) (((Y)*absw + (X))*4)
 #define PADDING(V, P) ((V)%(P)==0)?(0):((P)-((V)%(P)))
+#define EMIT_ROW(Y)\
+    if(w < 0)\
+    {\
+        ezimg_bmp_mirror_row(row, absw);\
+    }\
+    ezimg_convert_row(\
+        (unsigned char *)out + ((h > 0) ? (absh - 1 - (Y)) : (Y))*pitch,\
+        row, absw, 4, format);\
+    outp = row;
     unsigned char sign1, sign2;
     int w, h;
     unsigned int absw, absh;
@@ -252,7 +481,8 @@ ezimg_bmp_load(
     unsigned int planes, bit_count, compression;
     unsigned int palette_offset;
     unsigned char *data, *palette;
-    unsigned char *outp;
+    unsigned char *outp, *row;
+    unsigned int pitch;
     unsigned char r, g, b, a;
     unsigned int rmask, gmask, bmask, amask;
     unsigned int rlssb, glssb, blssb, alssb;
@@ -282,7 +512,13 @@ ezimg_bmp_load(
     absw = (unsigned int)EZIMG_ABS(w);
     absh = (unsigned int)EZIMG_ABS(h);
 
-    if(out_size < absw*absh*4)
+    pitch = ezimg_pitch(format, absw);
+    if(!pitch)
+    {
+        return(EZIMG_NOT_SUPPORTED);
+    }
+
+    if(out_size < pitch*absh + absw*4)
     {
         return(EZIMG_NOT_ENOUGH_SPACE);
     }
@@ -329,7 +565,11 @@ ezimg_bmp_load(
     data_size = in_size - data_offset;
     ezimg_init_stream(&stream, data, data_size);
 
-    outp = (unsigned char *)out;
+    /* NOTE: Every row is decoded to RGBA here and then converted to where
+       it goes, bottom-up images are flipped and negative widths mirrored
+       on the way */
+    row = (unsigned char *)out + pitch*absh;
+    outp = row;
     if(compression == 0 && bit_count == 4)
     {
         if(absw % 2 == 0)
@@ -366,10 +606,10 @@ ezimg_bmp_load(
                 r = *(palette + i*4 + 2);
                 a = *(palette + i*4 + 3);
 
-                *outp++ = 0xff;
                 *outp++ = r;
                 *outp++ = g;
                 *outp++ = b;
+                *outp++ = 0xff;
             }
 
             for(x = 0;
@@ -378,6 +618,8 @@ ezimg_bmp_load(
             {
                 ezimg_read_u8(&stream);
             }
+
+            EMIT_ROW(y)
         }
     }
     else if(compression == 0 && bit_count == 8)
@@ -397,10 +639,10 @@ ezimg_bmp_load(
                 r = *(palette + i*4 + 2);
                 a = *(palette + i*4 + 3);
 
-                *outp++ = 0xff;
                 *outp++ = r;
                 *outp++ = g;
                 *outp++ = b;
+                *outp++ = 0xff;
             }
 
             for(x = 0;
@@ -409,6 +651,8 @@ ezimg_bmp_load(
             {
                 ezimg_read_u8(&stream);
             }
+
+            EMIT_ROW(y)
         }
     }
     else if(compression == 0 && bit_count == 24)
@@ -426,10 +670,10 @@ ezimg_bmp_load(
                 g = ezimg_read_u8(&stream);
                 r = ezimg_read_u8(&stream);
 
-                *outp++ = 0xff;
                 *outp++ = r;
                 *outp++ = g;
                 *outp++ = b;
+                *outp++ = 0xff;
             }
 
             for(x = 0;
@@ -438,6 +682,8 @@ ezimg_bmp_load(
             {
                 ezimg_read_u8(&stream);
             }
+
+            EMIT_ROW(y)
         }
     }
     else if(compression == 0 && bit_count == 32)
@@ -455,11 +701,13 @@ ezimg_bmp_load(
                 r = ezimg_read_u8(&stream);
                 a = ezimg_read_u8(&stream);
 
-                *outp++ = 0xff;
                 *outp++ = r;
                 *outp++ = g;
                 *outp++ = b;
+                *outp++ = 0xff;
             }
+
+            EMIT_ROW(y)
         }
     }
     else if(compression == 3 && bit_count == 32)
@@ -488,11 +736,13 @@ ezimg_bmp_load(
                 b = (unsigned char)(((pixel & bmask) >> blssb) & 0xff);
                 a = (unsigned char)(((pixel & amask) >> alssb) & 0xff);
 
-                *outp++ = 0xff;
                 *outp++ = r;
                 *outp++ = g;
                 *outp++ = b;
+                *outp++ = 0xff;
             }
+
+            EMIT_ROW(y)
         }
     }
     else
@@ -500,76 +750,6 @@ ezimg_bmp_load(
         return(EZIMG_NOT_SUPPORTED);
     }
 
-    if(h > 0)
-    {
-        unsigned int half_height = absh / 2;
-        unsigned int r1, r2;
-
-        outp = (unsigned char *)out;
-        for(y = 0;
-            y < half_height;
-            ++y)
-        {
-            r1 = y;
-            r2 = absh - 1 - y;
-
-            for(x = 0;
-                x < absw;
-                ++x)
-            {
-                a = *(outp + YX2OFF(r2, x) + 0);
-                r = *(outp + YX2OFF(r2, x) + 1);
-                g = *(outp + YX2OFF(r2, x) + 2);
-                b = *(outp + YX2OFF(r2, x) + 3);
-
-                *(outp + YX2OFF(r2, x) + 0) = *(outp + YX2OFF(r1, x) + 0);
-                *(outp + YX2OFF(r2, x) + 1) = *(outp + YX2OFF(r1, x) + 1);
-                *(outp + YX2OFF(r2, x) + 2) = *(outp + YX2OFF(r1, x) + 2);
-                *(outp + YX2OFF(r2, x) + 3) = *(outp + YX2OFF(r1, x) + 3);
-
-                *(outp + YX2OFF(r1, x) + 0) = a;
-                *(outp + YX2OFF(r1, x) + 1) = r;
-                *(outp + YX2OFF(r1, x) + 2) = g;
-                *(outp + YX2OFF(r1, x) + 3) = b;
-            }
-        }
-    }
-
-    if(w < 0)
-    {
-        unsigned int half_width = absw / 2;
-
-        for(y = 0;
-            y < absh;
-            ++y)
-        {
-            for(x = 0;
-                x < half_width;
-                ++x)
-            {
-                unsigned int c1, c2;
-
-                c1 = x;
-                c2 = absw - 1 - x;
-
-                a = *(outp + XY2OFF(c2, y) + 0);
-                r = *(outp + XY2OFF(c2, y) + 1);
-                g = *(outp + XY2OFF(c2, y) + 2);
-                b = *(outp + XY2OFF(c2, y) + 3);
-
-                *(outp + XY2OFF(c2, y) + 0) = *(outp + XY2OFF(c1, y) + 0);
-                *(outp + XY2OFF(c2, y) + 1) = *(outp + XY2OFF(c1, y) + 1);
-                *(outp + XY2OFF(c2, y) + 2) = *(outp + XY2OFF(c1, y) + 2);
-                *(outp + XY2OFF(c2, y) + 3) = *(outp + XY2OFF(c1, y) + 3);
-
-                *(outp + XY2OFF(c1, y) + 0) = a;
-                *(outp + XY2OFF(c1, y) + 1) = r;
-                *(outp + XY2OFF(c1, y) + 2) = g;
-                *(outp + XY2OFF(c1, y) + 3) = b;
-            }
-        }
-    }
-
     if(width)
     {
         *width = absw;
@@ -582,9 +762,8 @@ ezimg_bmp_load(
 
     return(EZIMG_OK);
 
+#undef EMIT_ROW
 #undef PADDING
-#undef YX2OFF
-#undef XY2OFF
 }
 
 int
@@ -600,23 +779,33 @@ ezimg_png_check_signature(unsigned char sign[])
     return(0);
 }
 
-unsigned int
-ezimg_png_decomp_data_max_size(unsigned int width, unsigned int height)
-{
-    return((width*height*4) + (1*height));
-}
+/*
+ PNGs are decoded a row at a time (see ezimg_png_inflate), with the
+ working memory for it after the pixels in the output buffer
+ */
+#define EZIMG_WINDOW_SIZE 32768
+#define EZIMG_MATCH_MAX 258
+
+/* The window and the row being assembled, plus a match and another window
+   of slack so that they only have to slide back to the start once every
+   32K of output */
+#define EZIMG_INFLATE_BUFFER_SIZE(stride) (2*EZIMG_WINDOW_SIZE + (stride) + EZIMG_MATCH_MAX)
+#define EZIMG_PNG_WORK_SIZE(width) (2*(width)*4 + EZIMG_INFLATE_BUFFER_SIZE(1 + (width)*4))
 
 #define EZIMG_CHUNK_START 0x49484452
 #define EZIMG_CHUNK_END 0x49454e44
 #define EZIMG_CHUNK_IDAT 0x49444154
 
-unsigned int
-ezimg_png_size(void *in, unsigned int in_size)
+/* Reads the size of the image from the start of the file */
+int
+ezimg_png_dimensions(
+    void *in, unsigned int in_size,
+    unsigned int *width, unsigned int *height)
 {
     unsigned char signature[8] = {0};
     ezimg_stream stream = {0};
-    unsigned int width, height, i;
-    unsigned int len, type;
+    unsigned int i;
+    unsigned int type;
 
     ezimg_init_stream_big(&stream, in, in_size);
 
@@ -637,7 +826,7 @@ ezimg_png_size(void *in, unsigned int in_size)
         return(0);
     }
 
-    len = ezimg_read_u32(&stream);
+    ezimg_read_u32(&stream);
     type = ezimg_read_u32(&stream);
 
     if(type != EZIMG_CHUNK_START)
@@ -645,123 +834,181 @@ ezimg_png_size(void *in, unsigned int in_size)
         return(0);
     }
 
-    width = ezimg_read_u32(&stream);
-    height = ezimg_read_u32(&stream);
+    *width = ezimg_read_u32(&stream);
+    *height = ezimg_read_u32(&stream);
 
-    return(ezimg_png_decomp_data_max_size(width, height));
+    return(1);
 }
 
-#define EZIMG_CHUNK_MAX_ENTRIES 50
+unsigned int
+ezimg_png_size(void *in, unsigned int in_size, int format)
+{
+    unsigned int width, height;
+
+    if( !ezimg_png_dimensions(in, in_size, &width, &height) ||
+        !ezimg_pitch(format, width))
+    {
+        return(0);
+    }
+
+    return(ezimg_pitch(format, width)*height + EZIMG_PNG_WORK_SIZE(width));
+}
 
+/*
+ The compressed stream keeps the next bits of the IDAT data in a 64-bit
+ accumulator, lowest bit first as deflate packs them. Peeking and
+ consuming up to 32 bits takes constant time, and the data is only looked
+ at by ezimg_crefill: it loads 8 bytes at once while the current chunk
+ has that many left and goes byte by byte near its end. The chunks are
+ read in place, walking from one to the next in the file when the
+ current one runs out (see ezimg_cnext_chunk), so there can be any number
+ of them. Past the end of the data the stream reads as zeros.
+ */
 typedef struct
 ezimg_cstream
 {
-    unsigned char *chunks[EZIMG_CHUNK_MAX_ENTRIES];
-    unsigned int lens[EZIMG_CHUNK_MAX_ENTRIES];
+    unsigned char *ptr;
+    unsigned char *ptr_end;
 
-    unsigned int num_chunks;
-    unsigned int current_chunk;
-    unsigned int current_pos;
+    /* The chunk after the current one and the end of the file, next is 0
+       when there are no more chunks */
+    unsigned char *next;
+    unsigned char *file_end;
 
-    unsigned char buff;
-    unsigned char mask;
+    unsigned long long bits;
+    unsigned int bit_count;
     int end;
 } ezimg_cstream;
 
-unsigned char
-ezimg_cread_u8(ezimg_cstream *stream)
+/* Moves to the data of the next IDAT chunk. IDAT chunks have to follow
+   each other, so the data ends at the first chunk that is not one. */
+int
+ezimg_cnext_chunk(ezimg_cstream *stream)
 {
-    unsigned char byte_read;
+    ezimg_stream chunk_stream = {0};
+    unsigned int len, type;
 
-    if(stream->end)
+    while(stream->next && stream->file_end - stream->next >= 8)
     {
-        return(0);
-    }
+        ezimg_init_stream_big(
+            &chunk_stream, stream->next,
+            (unsigned int)(stream->file_end - stream->next));
+        len = ezimg_read_u32(&chunk_stream);
+        type = ezimg_read_u32(&chunk_stream);
 
-    if(stream->current_chunk >= stream->num_chunks)
-    {
-        stream->end = 1;
-        return(0);
+        if(type != EZIMG_CHUNK_IDAT || len > (unsigned int)(stream->file_end - chunk_stream.ptr))
+        {
+            break;
+        }
+
+        stream->ptr = chunk_stream.ptr;
+        stream->ptr_end = chunk_stream.ptr + len;
+        stream->next = (stream->file_end - stream->ptr_end >= 4) ? stream->ptr_end + 4 : 0;
+
+        if(len > 0)
+        {
+            return(1);
+        }
     }
 
-    if(stream->current_pos >= stream->lens[stream->current_chunk])
+    stream->next = 0;
+    return(0);
+}
+
+/* Tops the accumulator up to at least 57 bits, unless the data ran out */
+void
+ezimg_crefill(ezimg_cstream *stream)
+{
+    unsigned char *p;
+    unsigned int bytes, i;
+    unsigned long long value;
+
+    if(stream->ptr_end - stream->ptr >= 8)
     {
-        stream->current_chunk += 1;
-        stream->current_pos = 0;
+        p = stream->ptr;
+        value = 0;
+        for(i = 0;
+            i < 8;
+            ++i)
+        {
+            value |= (unsigned long long)p[i] << (i*8);
+        }
+
+        bytes = (63 - stream->bit_count) >> 3;
+        stream->bits |= (value & ((1ull << (bytes*8)) - 1)) << stream->bit_count;
+        stream->bit_count += bytes*8;
+        stream->ptr += bytes;
+        return;
     }
 
-    if(stream->current_chunk >= stream->num_chunks)
+    while(stream->bit_count <= 56 && !stream->end)
     {
-        stream->end = 1;
-        return(0);
+        if(stream->ptr == stream->ptr_end && !ezimg_cnext_chunk(stream))
+        {
+            stream->end = 1;
+        }
+        else
+        {
+            stream->bits |= (unsigned long long)*stream->ptr++ << stream->bit_count;
+            stream->bit_count += 8;
+        }
     }
-
-    byte_read = *(stream->chunks[stream->current_chunk] + stream->current_pos);
-    stream->current_pos += 1;
-
-    return(byte_read);
 }
 
+/* first_chunk is the start (length) of the first IDAT chunk, file_end
+   the end of the file */
 void
 ezimg_init_cstream(
     ezimg_cstream *stream,
-    unsigned int num_chunks)
+    unsigned char *first_chunk,
+    unsigned char *file_end)
 {
-    stream->num_chunks = num_chunks;
-    stream->current_chunk = 0;
-    stream->current_pos = 0;
+    stream->ptr = first_chunk;
+    stream->ptr_end = first_chunk;
+    stream->next = first_chunk;
+    stream->file_end = file_end;
 
     stream->end = 0;
-    stream->mask = 1;
-    stream->buff = ezimg_cread_u8(stream);
+    stream->bits = 0;
+    stream->bit_count = 0;
+    ezimg_crefill(stream);
 }
 
-unsigned char
-ezimg_next_bit(ezimg_cstream *stream)
+/* Returns the next count (up to 32) bits without consuming them */
+unsigned int
+ezimg_cpeek_bits(ezimg_cstream *stream, unsigned int count)
 {
-    unsigned char bit = 0;
-
-    if(stream->end)
+    if(stream->bit_count < count)
     {
-        return(0);
+        ezimg_crefill(stream);
     }
 
-    bit = (stream->buff & stream->mask) ? 1 : 0;
-    stream->mask <<= 1;
-    if(stream->mask == 0)
-    {
-        stream->mask = 1;
-        stream->buff = ezimg_cread_u8(stream);
-    }
+    return((unsigned int)(stream->bits & ((1ull << count) - 1)));
+}
 
-    return(bit);
+void
+ezimg_cconsume_bits(ezimg_cstream *stream, unsigned int count)
+{
+    stream->bits >>= count;
+    stream->bit_count = (count < stream->bit_count) ? stream->bit_count - count : 0;
 }
 
 unsigned int
 ezimg_cread_bits(ezimg_cstream *stream, unsigned int count)
 {
-    unsigned int bits_val, i, bit;
+    unsigned int bits_val;
 
-    bits_val = 0;
-    for(i = 0;
-        i < count;
-        ++i)
-    {
-        bit = (unsigned int)ezimg_next_bit(stream);
-        bits_val |= (bit << i);
-    }
+    bits_val = ezimg_cpeek_bits(stream, count);
+    ezimg_cconsume_bits(stream, count);
 
     return(bits_val);
 }
 
+/* Skips to the next byte boundary */
 void
 ezimg_cflush(ezimg_cstream *stream)
 {
-    if(stream->mask != 1)
-    {
-        stream->mask = 1;
-        stream->buff = ezimg_cread_u8(stream);
-    }
+    ezimg_cconsume_bits(stream, stream->bit_count & 7);
 }
 
 /**
@@ -855,19 +1102,35 @@ ezimg_deflate_dist(int code, ezimg_cstream *stream)
 
 #define EZIMG_HTABLE_MAX_ENTRIES 290
 
-typedef struct
-ezimg_huff_entry
-{
-    unsigned int code;
-    unsigned int len;
-} ezimg_huff_entry;
+/*
+ Huffman codes are decoded with lookup tables indexed by the next bits of
+ the stream (deflate packs codes starting from their most significant bit,
+ so the index is the code bit-reversed).
+
+ The primary table has 1 << EZIMG_HUFF_FAST_BITS entries. A code of up to
+ EZIMG_HUFF_FAST_BITS bits fills every entry that starts with it. Longer
+ codes go to a secondary table for their first EZIMG_HUFF_FAST_BITS bits,
+ indexed by the bits after those, and the primary entry links to it.
+
+ Every entry is symbol << 16 | flags | code length, or for a link
+ offset << 16 | EZIMG_HUFF_SUBTABLE | index bits of the secondary table.
+ A length of 0 means no code starts with those bits.
+ */
+#define EZIMG_HUFF_FAST_BITS 9
+#define EZIMG_HUFF_MAX_LEN 15
+#define EZIMG_HUFF_SUBTABLE 0x20
+#define EZIMG_HUFF_LEN_MASK 0x1f
+
+/* Room for the secondary tables of any complete code of up to 290 symbols
+   (852 entries for 9 primary bits, see zlib's enough.c) */
+#define EZIMG_HUFF_TABLE_SIZE 1024
 
 typedef struct
 ezimg_huff
 {
     unsigned int max_len;
     unsigned int count;
-    ezimg_huff_entry entries[EZIMG_HTABLE_MAX_ENTRIES];
+    unsigned int table[EZIMG_HUFF_TABLE_SIZE];
 } ezimg_huff;
 
 void
@@ -876,47 +1139,60 @@ ezimg_reset_huff(ezimg_huff *huff)
     unsigned int i;
 
     for(i = 0;
-        i < EZIMG_HTABLE_MAX_ENTRIES;
+        i < (1 << EZIMG_HUFF_FAST_BITS);
         ++i)
     {
-        huff->entries[i].code = 0;
-        huff->entries[i].len = 0;
+        huff->table[i] = 0;
     }
 
     huff->count = 0;
+    huff->max_len = 0;
 }
 
 int
 ezimg_huff_decode(ezimg_huff *huff, ezimg_cstream *chunk_stream)
 {
-    int result;
-    unsigned int code, len;
-    int i;
+    unsigned int bits, entry, len;
 
-    result = -1;
-    code = ezimg_cread_bits(chunk_stream, 1) & 0xff;
-    len = 1;
-    while(len <= huff->max_len)
+    bits = ezimg_cpeek_bits(chunk_stream, EZIMG_HUFF_FAST_BITS);
+    entry = huff->table[bits];
+
+    /* NOTE: Past the end of the data the stream reads as zeros forever,
+       which could decode as literals forever */
+    if(!chunk_stream->bit_count)
     {
-        for(i = 0;
-            i < (int)huff->count;
-            ++i)
-        {
-            if(huff->entries[i].len == len &&  huff->entries[i].code == code)
-            {
-                result = i;
-                break;
-            }
-        }
+        return(-1);
+    }
 
-        if(result >= 0 || len >= huff->max_len)
-        {
-            break;
-        }
+    if(entry & EZIMG_HUFF_SUBTABLE)
+    {
+        len = entry & EZIMG_HUFF_LEN_MASK;
+        bits = ezimg_cpeek_bits(chunk_stream, EZIMG_HUFF_FAST_BITS + len);
+        entry = huff->table[(entry >> 16) + (bits >> EZIMG_HUFF_FAST_BITS)];
+    }
+
+    len = entry & EZIMG_HUFF_LEN_MASK;
+    if(len == 0)
+    {
+        return(-1);
+    }
+
+    ezimg_cconsume_bits(chunk_stream, len);
+    return((int)(entry >> 16));
+}
+
+unsigned int
+ezimg_reverse_bits(unsigned int value, unsigned int count)
+{
+    unsigned int result, i;
 
-        code <<=  1;
-        code |= (ezimg_cread_bits(chunk_stream, 1) & 0xff);
-        len += 1;
+    result = 0;
+    for(i = 0;
+        i < count;
+        ++i)
+    {
+        result = (result << 1) | (value & 1);
+        value >>= 1;
     }
 
     return(result);
@@ -978,9 +1254,16 @@ ezimg_compute_htable(
             return(0);
         }
 
-        while(rep_count > 0)
+        /* NOTE: A repeat may not run past the lengths of this table, that
+           would write past the end of htable */
+        if(rep_count > hcount - i)
         {
-            htable[i++] = rep_val;
+            return(0);
+        }
+
+        while(rep_count > 0)
+        {
+            htable[i++] = rep_val;
             rep_count -= 1;
         }
     }
@@ -999,11 +1282,13 @@ ezimg_compute_huff(
     unsigned int hcount,
     ezimg_huff *huff)
 {
-#define MAX_CODE_LEN 16
-    unsigned int codes[MAX_CODE_LEN] = {0};
-    unsigned int len_count[MAX_CODE_LEN] = {0};
-    unsigned int code, max_len, code_len;
-    unsigned int i;
+    unsigned int codes[EZIMG_HUFF_MAX_LEN + 1] = {0};
+    unsigned int next_code[EZIMG_HUFF_MAX_LEN + 1] = {0};
+    unsigned int len_count[EZIMG_HUFF_MAX_LEN + 1] = {0};
+    unsigned char sub_len[1 << EZIMG_HUFF_FAST_BITS] = {0};
+    unsigned int code, max_len, code_len, table_size;
+    unsigned int i, j;
+    int left;
 
     if(hcount >= EZIMG_HTABLE_MAX_ENTRIES)
     {
@@ -1016,7 +1301,7 @@ ezimg_compute_huff(
         ++i)
     {
         code_len = htable[i];
-        if(code_len >= EZIMG_HTABLE_MAX_ENTRIES)
+        if(code_len > EZIMG_HUFF_MAX_LEN)
         {
             return(0);
         }
@@ -1029,9 +1314,17 @@ ezimg_compute_huff(
         }
     }
 
-    if(max_len > MAX_CODE_LEN)
+    /* More codes of some length than there is room for */
+    left = 1;
+    for(i = 1;
+        i <= max_len;
+        ++i)
     {
-        return(0);
+        left = (left << 1) - (int)len_count[i];
+        if(left < 0)
+        {
+            return(0);
+        }
     }
 
     code = 0;
@@ -1043,539 +1336,1067 @@ ezimg_compute_huff(
     {
         code = (code + len_count[i - 1]) << 1;
         codes[i] = code;
+        next_code[i] = code;
     }
 
     ezimg_reset_huff(huff);
 
     huff->count = hcount;
     huff->max_len = max_len;
+
+    /* The longest code under every primary entry sizes its secondary
+       table */
     for(i = 0;
         i < hcount;
         ++i)
     {
         code_len = htable[i];
-        huff->entries[i].len = code_len;
+        if(code_len > EZIMG_HUFF_FAST_BITS)
+        {
+            code = ezimg_reverse_bits(next_code[code_len], code_len);
+            code &= (1 << EZIMG_HUFF_FAST_BITS) - 1;
+            if(code_len - EZIMG_HUFF_FAST_BITS > sub_len[code])
+            {
+                sub_len[code] = (unsigned char)(code_len - EZIMG_HUFF_FAST_BITS);
+            }
+            next_code[code_len] += 1;
+        }
+    }
+
+    table_size = 1 << EZIMG_HUFF_FAST_BITS;
+    for(i = 0;
+        i < (1 << EZIMG_HUFF_FAST_BITS);
+        ++i)
+    {
+        if(sub_len[i])
+        {
+            if(table_size + (1u << sub_len[i]) > EZIMG_HUFF_TABLE_SIZE)
+            {
+                return(0);
+            }
+
+            huff->table[i] = (table_size << 16) | EZIMG_HUFF_SUBTABLE | sub_len[i];
+            for(j = 0;
+                j < (1u << sub_len[i]);
+                ++j)
+            {
+                huff->table[table_size + j] = 0;
+            }
+            table_size += 1 << sub_len[i];
+        }
+    }
+
+    for(i = 0;
+        i < hcount;
+        ++i)
+    {
+        unsigned int entry, step, end;
+
+        code_len = htable[i];
         if(code_len == 0)
         {
-            huff->entries[i].code = 0;
+            continue;
+        }
+
+        code = ezimg_reverse_bits(codes[code_len], code_len);
+        codes[code_len] += 1;
+        entry = (i << 16) | code_len;
+
+        if(code_len <= EZIMG_HUFF_FAST_BITS)
+        {
+            step = 1 << code_len;
+            end = 1 << EZIMG_HUFF_FAST_BITS;
+            for(j = code;
+                j < end;
+                j += step)
+            {
+                huff->table[j] = entry;
+            }
         }
         else
         {
-            huff->entries[i].code = codes[code_len];
+            unsigned int link;
+
+            link = huff->table[code & ((1 << EZIMG_HUFF_FAST_BITS) - 1)];
+            step = 1 << (code_len - EZIMG_HUFF_FAST_BITS);
+            end = 1 << (link & EZIMG_HUFF_LEN_MASK);
+            for(j = code >> EZIMG_HUFF_FAST_BITS;
+                j < end;
+                j += step)
+            {
+                huff->table[(link >> 16) + j] = entry;
+            }
         }
-        codes[code_len] += 1;
     }
 
     return(1);
+}
+
+/*
+ PNG unfiltering goes a row at a time through a table of row kernels,
+ scalar or SSE2, picked from what the CPU supports the first time a PNG is
+ loaded (or with ezimg_png_set_unfilter). Both produce the same bytes.
+
+ A kernel reconstructs len bytes into dst from the filtered bytes in src
+ and the reconstructed previous row prev, with pixels of bpp (3 or 4)
+ bytes. src is the inflate buffer, dst and prev are the two scanlines
+ after the pixels, so none of them overlap. A kernel must not store past
+ dst + len, nor read past src + len or prev + len.
+ */
 
-#undef MAX_CODE_LEN
+typedef void ezimg_unfilter_row(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp);
+
+typedef struct
+ezimg_unfilter_kernels
+{
+    char *name;
+    ezimg_unfilter_row *none;
+    ezimg_unfilter_row *sub;
+    ezimg_unfilter_row *up;
+    ezimg_unfilter_row *avg;
+    ezimg_unfilter_row *paeth;
+} ezimg_unfilter_kernels;
+
+void
+ezimg_unfilter_none_scalar(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
+
+    (void)prev;
+    (void)bpp;
+
+    for(i = 0;
+        i < len;
+        ++i)
+    {
+        dst[i] = src[i];
+    }
 }
 
-unsigned char *
-ezimg_decompress_idat(
-    ezimg_cstream *chunk_stream,
-    unsigned int width,
-    unsigned int height,
-    unsigned char *buff,
-    unsigned int buff_size)
+void
+ezimg_unfilter_sub_scalar(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
 {
-#define HLIT_MAX 288
-#define HDIST_MAX 32
-#define HCLEN_MAX 20
-#define HCLEN_ORD_MAX 19
+    unsigned int i;
 
-#define EMIT(b)\
-    if(outp >= outp_end)\
-    {\
-        return(0);\
-    }\
-    *outp++ = (unsigned char)(b);
+    (void)prev;
 
-    unsigned int decomp_data_max_size;
-    unsigned char *decomp_data;
+    for(i = 0;
+        i < len;
+        ++i)
+    {
+        dst[i] = (unsigned char)(src[i] + ((i >= bpp) ? dst[i - bpp] : 0));
+    }
+}
 
-    unsigned int comp_method, comp_info, fdict;
-    unsigned int is_last, btype;
+void
+ezimg_unfilter_up_scalar(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
 
-    unsigned char *outp, *outp_end;
+    (void)bpp;
 
-    decomp_data_max_size = ezimg_png_decomp_data_max_size(width, height);
-    if(buff_size < decomp_data_max_size)
+    for(i = 0;
+        i < len;
+        ++i)
     {
-        return(0);
+        dst[i] = (unsigned char)(src[i] + prev[i]);
     }
+}
 
-    decomp_data = buff;
-#endif
-    outp = decomp_data;
-    outp_end = outp + decomp_data_max_size;
+void
+ezimg_unfilter_avg_scalar(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i, a;
 
-    if(!decomp_data)
+    for(i = 0;
+        i < len;
+        ++i)
     {
-        return(0);
+        a = (i >= bpp) ? dst[i - bpp] : 0;
+        dst[i] = (unsigned char)(src[i] + ((a + prev[i]) >> 1));
     }
+}
 
-    comp_method = ezimg_cread_bits(chunk_stream, 4);
-    comp_info = ezimg_cread_bits(chunk_stream, 4);
+/* The first row has no previous row, which makes it all zeros */
+void
+ezimg_unfilter_avg_first(
+    unsigned char *dst, unsigned char *src,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
 
-    ezimg_cread_bits(chunk_stream, 5);
-    fdict = ezimg_cread_bits(chunk_stream, 1);
-    ezimg_cread_bits(chunk_stream, 2);
+    for(i = 0;
+        i < len;
+        ++i)
+    {
+        dst[i] = (unsigned char)(src[i] + ((i >= bpp) ? (dst[i - bpp] >> 1) : 0));
+    }
+}
+
+void
+ezimg_unfilter_paeth_scalar(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
+    int a, b, c, p, pa, pb, pc;
+    unsigned char pr;
 
-    if(comp_method != 8 || comp_info > 7 || fdict != 0)
+    for(i = 0;
+        i < len;
+        ++i)
     {
-        return(0);
+        a = (i >= bpp) ? dst[i - bpp] : 0;
+        b = prev[i];
+        c = (i >= bpp) ? prev[i - bpp] : 0;
+
+        p = a + b - c;
+        pa = EZIMG_ABS(p - a);
+        pb = EZIMG_ABS(p - b);
+        pc = EZIMG_ABS(p - c);
+
+        if((pa <= pb) && (pa <= pc)) pr = (unsigned char)a;
+        else if(pb <= pc) pr = (unsigned char)b;
+        else pr = (unsigned char)c;
+
+        dst[i] = (unsigned char)(src[i] + pr);
     }
+}
 
-    is_last = 0;
-    while(!is_last)
+#if EZIMG_SSE2
+
+/* Pixels of 3 bytes are moved as 3 bytes, a 4th could belong to the next
+   pixel of dst, which is still unread src */
+__m128i
+ezimg_load_pixel(unsigned char *p, unsigned int bpp)
+{
+    unsigned int value;
+
+    value = (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16);
+    if(bpp == 4)
     {
-        int to_decode = 0;
-        ezimg_huff lit_len_huff = {0};
-        ezimg_huff dist_huff = {0};
+        value |= (unsigned int)p[3] << 24;
+    }
 
-        is_last = ezimg_cread_bits(chunk_stream, 1);
-        btype = ezimg_cread_bits(chunk_stream, 2);
+    return(_mm_cvtsi32_si128((int)value));
+}
 
-        if(btype == 0)
-        {
-            /* Uncompressed block */
-            unsigned int b0len;
-            unsigned int b0nlen;
+void
+ezimg_store_pixel(unsigned char *p, __m128i pixel, unsigned int bpp)
+{
+    unsigned int value;
 
-            to_decode = 0;
-            ezimg_cflush(chunk_stream);
-            b0len = ezimg_cread_bits(chunk_stream, 16);
-            b0nlen = ezimg_cread_bits(chunk_stream, 16);
+    value = (unsigned int)_mm_cvtsi128_si32(pixel);
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    if(bpp == 4)
+    {
+        p[3] = (unsigned char)(value >> 24);
+    }
+}
 
-            if(~b0len != b0nlen)
-            {
-                return(0);
-            }
+void
+ezimg_unfilter_none_sse2(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
 
-            while(b0len > 0)
-            {
-                EMIT(ezimg_cread_bits(chunk_stream, 8));
-                --b0len;
-            }
+    for(i = 0;
+        i + 16 <= len;
+        i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((__m128i *)(src + i)));
+    }
+
+    ezimg_unfilter_none_scalar(dst + i, src + i, prev, len - i, bpp);
+}
+
+/* Every 16 bytes get a prefix sum at a stride of one pixel in two shifted
+   adds, plus the last pixel of the previous 16 broadcast to every pixel */
+void
+ezimg_unfilter_sub_sse2(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
+    __m128i x, a;
+
+    (void)prev;
+
+    a = _mm_setzero_si128();
+    i = 0;
+    if(bpp == 4)
+    {
+        for(;
+            i + 16 <= len;
+            i += 16)
+        {
+            x = _mm_loadu_si128((__m128i *)(src + i));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            _mm_storeu_si128((__m128i *)(dst + i), x);
+            a = _mm_shuffle_epi32(x, 0xff);
         }
-        else if(btype == 1)
+    }
+    else if(bpp == 3)
+    {
+        /* NOTE: 4 pixels (12 bytes) at a time, the other 4 bytes of every
+           load are ignored */
+        for(;
+            i + 16 <= len;
+            i += 12)
         {
-            /* Block compressed with fixed Huffman tables */
-            unsigned int hlit_table[HLIT_MAX] = {0};
-            unsigned int hdist_table[HDIST_MAX] = {0};
+            x = _mm_loadu_si128((__m128i *)(src + i));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+            x = _mm_add_epi8(x, a);
+            _mm_storel_epi64((__m128i *)(dst + i), x);
+            ezimg_store_pixel(dst + i + 8, _mm_srli_si128(x, 8), 4);
+
+            a = _mm_and_si128(_mm_srli_si128(x, 9), _mm_cvtsi32_si128(0xffffff));
+            a = _mm_or_si128(a, _mm_slli_si128(a, 3));
+            a = _mm_or_si128(a, _mm_slli_si128(a, 6));
+        }
+    }
 
-            unsigned int i;
+    /* The scalar kernel picks dst[i - bpp] up from what was just stored */
+    for(;
+        i < len;
+        ++i)
+    {
+        dst[i] = (unsigned char)(src[i] + ((i >= bpp) ? dst[i - bpp] : 0));
+    }
+}
 
-            to_decode = 1;
+void
+ezimg_unfilter_up_sse2(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
 
-            for(i = 0;
-                i <= 143;
-                ++i)
-            {
-                hlit_table[i] = 8;
-            }
+    for(i = 0;
+        i + 16 <= len;
+        i += 16)
+    {
+        _mm_storeu_si128(
+            (__m128i *)(dst + i),
+            _mm_add_epi8(
+                _mm_loadu_si128((__m128i *)(src + i)),
+                _mm_loadu_si128((__m128i *)(prev + i))));
+    }
 
-            for(i = 144;
-                i <= 255;
-                ++i)
-            {
-                hlit_table[i] = 9;
-            }
+    ezimg_unfilter_up_scalar(dst + i, src + i, prev + i, len - i, bpp);
+}
 
-            for(i = 256;
-                i <= 279;
-                ++i)
-            {
-                hlit_table[i] = 7;
-            }
+/* One pixel at a time since each depends on the one before. pavgb rounds
+   up, so the low bit of a ^ b is taken back off. */
+void
+ezimg_unfilter_avg_sse2(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
+    __m128i a, b, avg, one;
 
-            for(i = 280;
-                i < HLIT_MAX;
-                ++i)
-            {
-                hlit_table[i] = 8;
-            }
+    one = _mm_set1_epi8(1);
+    a = _mm_setzero_si128();
+    for(i = 0;
+        i + bpp <= len;
+        i += bpp)
+    {
+        b = ezimg_load_pixel(prev + i, bpp);
+        avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(ezimg_load_pixel(src + i, bpp), avg);
+        ezimg_store_pixel(dst + i, a, bpp);
+    }
+}
 
-            for(i = 0;
-                i < HDIST_MAX;
-                ++i)
-            {
-                hdist_table[i] = 5;
-            }
+/* Branchless Paeth on 16-bit lanes: with p = a + b - c the distances are
+   pa = |b - c|, pb = |a - c| and pc = |pa + pb| before taking the absolute
+   values. Ties go to a, then b, like the scalar kernel. */
+void
+ezimg_unfilter_paeth_sse2(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp)
+{
+    unsigned int i;
+    __m128i zero, a, b, c, d, pa, pb, pc, smallest, nearest, mask;
 
-            if(!ezimg_compute_huff(hlit_table, HLIT_MAX, &lit_len_huff))
-            {
-                return(0);
-            }
+    zero = _mm_setzero_si128();
+    a = zero;
+    c = zero;
+    for(i = 0;
+        i + bpp <= len;
+        i += bpp)
+    {
+        b = _mm_unpacklo_epi8(ezimg_load_pixel(prev + i, bpp), zero);
 
-            if(!ezimg_compute_huff(hdist_table, HDIST_MAX, &dist_huff))
-            {
-                return(0);
-            }
-        }
-        else if(btype == 2)
-        {
-            /* Block compressed with dynamic Huffman tables */
+        pa = _mm_sub_epi16(b, c);
+        pb = _mm_sub_epi16(a, c);
+        pc = _mm_add_epi16(pa, pb);
 
-            unsigned int hlit, hdist, hclen;
-            unsigned int hclen_ord[HCLEN_ORD_MAX] = {
-                16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15
-            };
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
 
-            unsigned int hclen_table[HCLEN_MAX] = {0};
-            unsigned int hlit_table[HLIT_MAX] = {0};
-            unsigned int hdist_table[HDIST_MAX] = {0};
+        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
 
-            ezimg_huff clen_huff;
+        mask = _mm_cmpeq_epi16(smallest, pb);
+        nearest = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, c));
+        mask = _mm_cmpeq_epi16(smallest, pa);
+        nearest = _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, nearest));
 
-            unsigned int i;
+        d = _mm_add_epi8(ezimg_load_pixel(src + i, bpp), _mm_packus_epi16(nearest, nearest));
+        ezimg_store_pixel(dst + i, d, bpp);
 
-            to_decode = 1;
+        c = b;
+        a = _mm_unpacklo_epi8(d, zero);
+    }
+}
 
-            hlit = ezimg_cread_bits(chunk_stream, 5);
-            hdist = ezimg_cread_bits(chunk_stream, 5);
-            hclen = ezimg_cread_bits(chunk_stream, 4);
+#endif
 
-            if(hclen > HCLEN_ORD_MAX)
-            {
-                return(0);
-            }
+enum
+{
+    EZIMG_UNFILTER_SCALAR_INDEX,
+#if EZIMG_SSE2
+    EZIMG_UNFILTER_SSE2_INDEX,
+#endif
+    EZIMG_UNFILTER_KERNEL_COUNT
+};
 
-            hlit += 257;
-            hdist += 1;
-            hclen += 4;
+ezimg_unfilter_kernels ezimg_unfilter_kernel_table[EZIMG_UNFILTER_KERNEL_COUNT] = {
+    {
+        "scalar",
+        ezimg_unfilter_none_scalar, ezimg_unfilter_sub_scalar, ezimg_unfilter_up_scalar,
+        ezimg_unfilter_avg_scalar, ezimg_unfilter_paeth_scalar
+    },
+#if EZIMG_SSE2
+    {
+        "sse2",
+        ezimg_unfilter_none_sse2, ezimg_unfilter_sub_sse2, ezimg_unfilter_up_sse2,
+        ezimg_unfilter_avg_sse2, ezimg_unfilter_paeth_sse2
+    },
+#endif
+};
 
-            for(i = 0;
-                i < hclen;
-                ++i)
-            {
-                hclen_table[hclen_ord[i]] = ezimg_cread_bits(chunk_stream, 3);
-            }
+ezimg_unfilter_kernels *ezimg_unfilter;
 
-            if(!ezimg_compute_huff(hclen_table, HCLEN_MAX, &clen_huff))
-            {
-                return(0);
-            }
+int
+ezimg_cpu_has_sse2(void)
+{
+#if EZIMG_SSE2
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 1);
+    return((regs[3] & (1 << 26)) != 0);
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return(0);
+    }
+    return((edx & (1 << 26)) != 0);
+#endif
+#else
+    return(0);
+#endif
+}
 
-            if(!ezimg_compute_htable(
-                chunk_stream, &clen_huff,
-                hlit_table, hlit, HLIT_MAX))
-            {
-                return(0);
-            }
+int
+ezimg_png_set_unfilter(int unfilter)
+{
+    if(unfilter == EZIMG_UNFILTER_AUTO)
+    {
+        unfilter = ezimg_cpu_has_sse2() ? EZIMG_UNFILTER_SSE2 : EZIMG_UNFILTER_SCALAR;
+    }
 
-            if(!ezimg_compute_huff(hlit_table, hlit, &lit_len_huff))
-            {
-                return(0);
-            }
+    if(unfilter == EZIMG_UNFILTER_SCALAR)
+    {
+        ezimg_unfilter = &ezimg_unfilter_kernel_table[EZIMG_UNFILTER_SCALAR_INDEX];
+        return(1);
+    }
 
-            if(!ezimg_compute_htable(
-                chunk_stream, &clen_huff,
-                hdist_table, hdist, HDIST_MAX))
-            {
-                return(0);
-            }
+#if EZIMG_SSE2
+    if(unfilter == EZIMG_UNFILTER_SSE2 && ezimg_cpu_has_sse2())
+    {
+        ezimg_unfilter = &ezimg_unfilter_kernel_table[EZIMG_UNFILTER_SSE2_INDEX];
+        return(1);
+    }
+#endif
 
-            if(!ezimg_compute_huff(hdist_table, hdist, &dist_huff))
-            {
-                return(0);
-            }
+    return(0);
+}
+
+/* Reconstructs one row of len bytes into dst, prev is 0 for the first
+   row. Returns 0 for an unknown filter type. */
+int
+ezimg_png_unfilter_row(
+    unsigned char *dst, unsigned char *src, unsigned char *prev,
+    unsigned int len, unsigned int bpp, unsigned int filter)
+{
+    if(!ezimg_unfilter)
+    {
+        ezimg_png_set_unfilter(EZIMG_UNFILTER_AUTO);
+    }
+
+    /* NOTE: Above the first row everything is 0, so Up is a copy and
+       Paeth always predicts the left pixel, like Sub */
+    if(!prev)
+    {
+        if(filter == 2) filter = 0;
+        if(filter == 4) filter = 1;
+    }
+
+    if(filter == 0)
+    {
+        ezimg_unfilter->none(dst, src, prev, len, bpp);
+    }
+    else if(filter == 1)
+    {
+        ezimg_unfilter->sub(dst, src, prev, len, bpp);
+    }
+    else if(filter == 2)
+    {
+        ezimg_unfilter->up(dst, src, prev, len, bpp);
+    }
+    else if(filter == 3)
+    {
+        if(prev)
+        {
+            ezimg_unfilter->avg(dst, src, prev, len, bpp);
         }
         else
         {
-            return(0);
+            ezimg_unfilter_avg_first(dst, src, len, bpp);
         }
+    }
+    else if(filter == 4)
+    {
+        ezimg_unfilter->paeth(dst, src, prev, len, bpp);
+    }
+    else
+    {
+        return(0);
+    }
 
-        if(to_decode)
-        {
-            int lit_len;
+    return(1);
+}
 
-            lit_len = ezimg_huff_decode(&lit_len_huff, chunk_stream);
-            while(lit_len != 256)
-            {
-                if(lit_len < 0)
-                {
-                    return(0);
-                }
-                else if(lit_len < 256)
-                {
-                    unsigned int value;
-                    value = (unsigned int)lit_len;
-                    EMIT(value);
-                }
-                else if(lit_len > 256)
-                {
-                    int len, dist;
-                    unsigned char *backp;
+/*
+ PNGs are decoded a row at a time. Inflate writes into a buffer holding
+ the last 32K of its output (the deflate window) and the row it is
+ putting together. Every time a row is complete it is unfiltered into one
+ of two row buffers, against the previous row in the other, and written
+ out in the caller's format right away (see ezimg_convert_row).
+
+ All of this working memory goes after the pixels in the output buffer,
+ which is why ezimg_png_size asks for EZIMG_PNG_WORK_SIZE(width) bytes
+ more than the image takes.
+ */
 
-                    len = ezimg_deflate_len(lit_len, chunk_stream);
-                    dist = ezimg_huff_decode(&dist_huff, chunk_stream);
-                    if(dist < 0)
-                    {
-                        return(0);
-                    }
+typedef struct
+ezimg_png_rows
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int bpp;
+    unsigned int len;
 
-                    dist = ezimg_deflate_dist(dist, chunk_stream);
-                    if(dist < 0 || len <= 0)
-                    {
-                        return(0);
-                    }
+    unsigned int y;
+    unsigned char *prev;
+    unsigned char *curr;
 
-                    backp = outp - dist;
-                    if(backp < decomp_data)
-                    {
-                        return(0);
-                    }
+    unsigned char *out;
+    unsigned int pitch;
+    int format;
 
-                    while(len > 0)
-                    {
-                        EMIT(*backp);
-                        ++backp;
-                        len -= 1;
-                    }
-                }
-            
-                lit_len = ezimg_huff_decode(&lit_len_huff, chunk_stream);
-            }
-        }
+    /* With a callback every row goes to the start of out and is handed
+       over from there */
+    ezimg_png_row_callback *callback;
+    void *user;
+} ezimg_png_rows;
+
+/* src is a filtered row, starting with its filter type byte */
+int
+ezimg_png_emit_row(ezimg_png_rows *rows, unsigned char *src)
+{
+    unsigned char *swap, *dst;
+
+    if(!ezimg_png_unfilter_row(
+        rows->curr, src + 1, rows->y ? rows->prev : 0,
+        rows->len, rows->bpp, src[0]))
+    {
+        return(0);
     }
 
-    return(decomp_data);
+    dst = rows->callback ? rows->out : rows->out + rows->y*rows->pitch;
+    ezimg_convert_row(
+        dst, rows->curr,
+        rows->width, rows->bpp, rows->format);
 
-#undef EMIT
+    if(rows->callback)
+    {
+        rows->callback(rows->user, dst, rows->y, rows->width);
+    }
 
-#undef HCLEN_ORD_MAX
-#undef HLIT_MAX
-#undef HDIST_MAX
-#undef HCLEN_MAX
+    swap = rows->prev;
+    rows->prev = rows->curr;
+    rows->curr = swap;
+    rows->y += 1;
+
+    return(1);
 }
 
-unsigned char
-ezimg_png_filter1(
-    unsigned char *src,
-    unsigned char *a, 
-    unsigned int channel)
+/* Moves the window and the row being assembled back to the start of the
+   buffer, returns where output continues */
+unsigned char *
+ezimg_inflate_slide(unsigned char *buff, unsigned char *outp, unsigned char **row_start)
 {
-    unsigned char result = 0;
+    unsigned char *keep;
+    unsigned int i, count;
 
-    result = (unsigned char)src[channel] + (unsigned char)a[channel];
+    keep = (outp - buff > EZIMG_WINDOW_SIZE) ? outp - EZIMG_WINDOW_SIZE : buff;
+    if(*row_start < keep)
+    {
+        keep = *row_start;
+    }
 
-    return(result);
+    count = (unsigned int)(outp - keep);
+    for(i = 0;
+        i < count;
+        ++i)
+    {
+        buff[i] = keep[i];
+    }
+
+    *row_start -= keep - buff;
+    return(buff + count);
 }
 
-unsigned char
-ezimg_png_filter2(
-    unsigned char *src,
-    unsigned char *b,
-    unsigned int channel)
+/* Where ezimg_png_inflate is in the zlib stream */
+enum
 {
-    unsigned char result = 0;
+    EZIMG_INFLATE_HEADER,
+    EZIMG_INFLATE_BLOCK,
+    EZIMG_INFLATE_STORED,
+    EZIMG_INFLATE_CODES,
+    EZIMG_INFLATE_DONE
+};
 
-    result = (unsigned char)src[channel] + (unsigned char)b[channel];
+/* More than any one step of ezimg_png_inflate reads: a symbol with its
+   extra bits, up to 258 stored bytes, or a dynamic block header (under
+   600 bytes) */
+#define EZIMG_INFLATE_STEP_MAX 1024
 
-    return(result);
+/* Everything ezimg_png_inflate needs to stop between two steps and carry
+   on when there is more data */
+typedef struct
+ezimg_inflate
+{
+    int state;
+    unsigned int is_last;
+    unsigned int stored_left;
+
+    ezimg_huff lit_len_huff;
+    ezimg_huff dist_huff;
+
+    unsigned int stride;
+    unsigned char *buff;
+    unsigned char *outp;
+    unsigned char *row_start;
+} ezimg_inflate;
+
+/* buff has to hold EZIMG_INFLATE_BUFFER_SIZE(stride) bytes */
+void
+ezimg_init_inflate(ezimg_inflate *inflate, unsigned char *buff, unsigned int stride)
+{
+    inflate->state = EZIMG_INFLATE_HEADER;
+    inflate->is_last = 0;
+    inflate->stored_left = 0;
+    inflate->stride = stride;
+    inflate->buff = buff;
+    inflate->outp = buff;
+    inflate->row_start = buff;
 }
 
-unsigned char
-ezimg_png_filter3(
-    unsigned char *src,
-    unsigned char *a, 
-    unsigned char *b,
-    unsigned int channel)
+/* Bytes of data the stream has left before it would have to look for
+   the next chunk */
+unsigned int
+ezimg_cavailable(ezimg_cstream *stream)
 {
-    unsigned char result = 0;
-    unsigned int avg;
+    return(stream->bit_count/8 + (unsigned int)(stream->ptr_end - stream->ptr));
+}
 
-    avg = (((unsigned int)a[channel] + (unsigned int)b[channel]) / 2);
-    result = (unsigned char)src[channel] + (unsigned char)avg;
+/* Inflates the zlib stream of the IDAT chunks and hands every row to
+   ezimg_png_emit_row as soon as it is complete. Unless final is set (the
+   stream holds all the data there is) it stops when less than
+   EZIMG_INFLATE_STEP_MAX bytes are left, to be called again once there
+   are more. Returns 0 on errors, inflate->state is EZIMG_INFLATE_DONE
+   once the whole stream is done. */
+int
+ezimg_png_inflate(
+    ezimg_inflate *inflate,
+    ezimg_cstream *chunk_stream,
+    ezimg_png_rows *rows,
+    int final)
+{
+#define HLIT_MAX 288
+#define HDIST_MAX 32
+#define HCLEN_MAX 20
+#define HCLEN_ORD_MAX 19
 
-    return(result);
-}
+#define MORE() (final || ezimg_cavailable(chunk_stream) >= EZIMG_INFLATE_STEP_MAX)
 
-unsigned char
-ezimg_png_filter4(
-    unsigned char *src,
-    unsigned char *a, 
-    unsigned char *b,
-    unsigned char *c,
-    unsigned int channel)
-{
-    unsigned char result = 0;
-    int p, pa, pb, pc;
-    unsigned char pr;
+/* Makes sure a whole match fits */
+#define ROOM()\
+    if(outp + EZIMG_MATCH_MAX > buff_end)\
+    {\
+        outp = ezimg_inflate_slide(buff, outp, &row_start);\
+    }
 
-    p = (int)a[channel] + (int)b[channel] - (int)c[channel];
-    pa = p - (int)a[channel];
-    pb = p - (int)b[channel];
-    pc = p - (int)c[channel];
+/* Hands the completed rows over, output past the last row is dropped */
+#define ROWS()\
+    while((unsigned int)(outp - row_start) >= stride)\
+    {\
+        if(rows->y >= rows->height)\
+        {\
+            row_start = outp;\
+        }\
+        else if(!ezimg_png_emit_row(rows, row_start))\
+        {\
+            return(0);\
+        }\
+        else\
+        {\
+            row_start += stride;\
+        }\
+    }
+
+    unsigned int stride;
+    unsigned char *buff, *outp, *buff_end, *row_start;
+
+    stride = inflate->stride;
+    buff = inflate->buff;
+    buff_end = buff + EZIMG_INFLATE_BUFFER_SIZE(stride);
+    outp = inflate->outp;
+    row_start = inflate->row_start;
+
+    while(inflate->state != EZIMG_INFLATE_DONE && MORE())
+    {
+        if(inflate->state == EZIMG_INFLATE_HEADER)
+        {
+            unsigned int comp_method, comp_info, fdict;
 
-    if(pa < 0) pa = -pa;
-    if(pb < 0) pb = -pb;
-    if(pc < 0) pc = -pc;
+            comp_method = ezimg_cread_bits(chunk_stream, 4);
+            comp_info = ezimg_cread_bits(chunk_stream, 4);
 
-    pr = 0;
-    if((pa <= pb) && (pa <= pc)) pr = a[channel];
-    else if(pb <= pc) pr = b[channel];
-    else pr = c[channel];
+            ezimg_cread_bits(chunk_stream, 5);
+            fdict = ezimg_cread_bits(chunk_stream, 1);
+            ezimg_cread_bits(chunk_stream, 2);
 
-    result = (unsigned char)src[channel] + (unsigned char)pr;
-    return(result);
-}
+            if(comp_method != 8 || comp_info > 7 || fdict != 0)
+            {
+                return(0);
+            }
 
-int
-ezimg_png_filter(
-    unsigned char *decomp_data,
-    unsigned int width,
-    unsigned int height)
-{
-    unsigned char *src, *dst, *prev_row, *curr_row;
-    unsigned int x, y;
-    unsigned char filter; 
-    unsigned int a_pixel;
-    unsigned char *b_pixel;
-    unsigned int c_pixel;
-    unsigned char zero_pixel[4] = {0};
-    unsigned int prev_row_advance;
-
-    prev_row = (unsigned char *)&(zero_pixel[0]);
-    src = decomp_data;
-    dst = decomp_data;
-
-    prev_row_advance = 0;
-    for(y = 0;
-        y < height;
-        ++y)
-    {
-        filter = *src++;
-        curr_row = dst;
-
-        if(y == 7)
+            inflate->state = EZIMG_INFLATE_BLOCK;
+        }
+        else if(inflate->state == EZIMG_INFLATE_BLOCK && inflate->is_last)
         {
-            curr_row = 0;
-            curr_row = dst;
+            inflate->state = EZIMG_INFLATE_DONE;
         }
-
-        if(filter == 0)
+        else if(inflate->state == EZIMG_INFLATE_BLOCK)
         {
-            for(x = 0;
-                x < width;
-                ++x)
+            unsigned int btype;
+
+            inflate->is_last = ezimg_cread_bits(chunk_stream, 1);
+            btype = ezimg_cread_bits(chunk_stream, 2);
+
+            if(btype == 0)
             {
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
+                /* Uncompressed block */
+                unsigned int b0len;
+                unsigned int b0nlen;
+
+                ezimg_cflush(chunk_stream);
+                b0len = ezimg_cread_bits(chunk_stream, 16);
+                b0nlen = ezimg_cread_bits(chunk_stream, 16);
+
+                if((~b0len & 0xffff) != b0nlen)
+                {
+                    return(0);
+                }
+
+                inflate->stored_left = b0len;
+                inflate->state = EZIMG_INFLATE_STORED;
             }
-        }
-        else if(filter == 1)
-        {
-            a_pixel = 0;
-            for(x = 0;
-                x < width;
-                ++x)
+            else if(btype == 1)
+            {
+                /* Block compressed with fixed Huffman tables */
+                unsigned int hlit_table[HLIT_MAX] = {0};
+                unsigned int hdist_table[HDIST_MAX] = {0};
+
+                unsigned int i;
+
+                for(i = 0;
+                    i <= 143;
+                    ++i)
+                {
+                    hlit_table[i] = 8;
+                }
+
+                for(i = 144;
+                    i <= 255;
+                    ++i)
+                {
+                    hlit_table[i] = 9;
+                }
+
+                for(i = 256;
+                    i <= 279;
+                    ++i)
+                {
+                    hlit_table[i] = 7;
+                }
+
+                for(i = 280;
+                    i < HLIT_MAX;
+                    ++i)
+                {
+                    hlit_table[i] = 8;
+                }
+
+                for(i = 0;
+                    i < HDIST_MAX;
+                    ++i)
+                {
+                    hdist_table[i] = 5;
+                }
+
+                if(!ezimg_compute_huff(hlit_table, HLIT_MAX, &inflate->lit_len_huff))
+                {
+                    return(0);
+                }
+
+                if(!ezimg_compute_huff(hdist_table, HDIST_MAX, &inflate->dist_huff))
+                {
+                    return(0);
+                }
+
+                inflate->state = EZIMG_INFLATE_CODES;
+            }
+            else if(btype == 2)
             {
-                dst[0] = ezimg_png_filter1(src, (unsigned char *)&a_pixel, 0);
-                dst[1] = ezimg_png_filter1(src, (unsigned char *)&a_pixel, 1);
-                dst[2] = ezimg_png_filter1(src, (unsigned char *)&a_pixel, 2);
-                dst[3] = ezimg_png_filter1(src, (unsigned char *)&a_pixel, 3);
+                /* Block compressed with dynamic Huffman tables */
+
+                unsigned int hlit, hdist, hclen;
+                unsigned int hclen_ord[HCLEN_ORD_MAX] = {
+                    16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15
+                };
 
-                a_pixel = (*((unsigned int *)dst) & 0xffffffff);
+                unsigned int hclen_table[HCLEN_MAX] = {0};
+                unsigned int hlit_table[HLIT_MAX] = {0};
+                unsigned int hdist_table[HDIST_MAX] = {0};
 
-                dst += 4;
-                src += 4;
+                ezimg_huff clen_huff;
+
+                unsigned int i;
+
+                hlit = ezimg_cread_bits(chunk_stream, 5);
+                hdist = ezimg_cread_bits(chunk_stream, 5);
+                hclen = ezimg_cread_bits(chunk_stream, 4);
+
+                if(hclen > HCLEN_ORD_MAX)
+                {
+                    return(0);
+                }
+
+                hlit += 257;
+                hdist += 1;
+                hclen += 4;
+
+                for(i = 0;
+                    i < hclen;
+                    ++i)
+                {
+                    hclen_table[hclen_ord[i]] = ezimg_cread_bits(chunk_stream, 3);
+                }
+
+                if(!ezimg_compute_huff(hclen_table, HCLEN_MAX, &clen_huff))
+                {
+                    return(0);
+                }
+
+                if(!ezimg_compute_htable(
+                    chunk_stream, &clen_huff,
+                    hlit_table, hlit, HLIT_MAX))
+                {
+                    return(0);
+                }
+
+                if(!ezimg_compute_huff(hlit_table, hlit, &inflate->lit_len_huff))
+                {
+                    return(0);
+                }
+
+                if(!ezimg_compute_htable(
+                    chunk_stream, &clen_huff,
+                    hdist_table, hdist, HDIST_MAX))
+                {
+                    return(0);
+                }
+
+                if(!ezimg_compute_huff(hdist_table, hdist, &inflate->dist_huff))
+                {
+                    return(0);
+                }
+
+                inflate->state = EZIMG_INFLATE_CODES;
+            }
+            else
+            {
+                return(0);
             }
         }
-        else if(filter == 2)
+        else if(inflate->state == EZIMG_INFLATE_STORED)
         {
-            b_pixel = prev_row;
-            for(x = 0;
-                x < width;
-                ++x)
+            while(inflate->stored_left > 0 && MORE())
+            {
+                unsigned int count;
+
+                ROOM();
+                count = inflate->stored_left;
+                if(count > EZIMG_MATCH_MAX)
+                {
+                    count = EZIMG_MATCH_MAX;
+                }
+
+                inflate->stored_left -= count;
+                while(count > 0)
+                {
+                    *outp++ = (unsigned char)ezimg_cread_bits(chunk_stream, 8);
+                    --count;
+                }
+                ROWS();
+            }
+
+            if(inflate->stored_left == 0)
             {
-                dst[0] = ezimg_png_filter2(src, b_pixel, 0);
-                dst[1] = ezimg_png_filter2(src, b_pixel, 1);
-                dst[2] = ezimg_png_filter2(src, b_pixel, 2);
-                dst[3] = ezimg_png_filter2(src, b_pixel, 3);
-
-                b_pixel += prev_row_advance;
-                dst += 4;
-                src += 4;
+                inflate->state = EZIMG_INFLATE_BLOCK;
             }
         }
-        else if(filter == 3)
+        else if(inflate->state == EZIMG_INFLATE_CODES)
         {
-            a_pixel = 0;
-            b_pixel = prev_row;
-            for(x = 0;
-                x < width;
-                ++x)
+            while(MORE())
             {
-                dst[0] = ezimg_png_filter3(src, (unsigned char *)&a_pixel, b_pixel, 0);
-                dst[1] = ezimg_png_filter3(src, (unsigned char *)&a_pixel, b_pixel, 1);
-                dst[2] = ezimg_png_filter3(src, (unsigned char *)&a_pixel, b_pixel, 2);
-                dst[3] = ezimg_png_filter3(src, (unsigned char *)&a_pixel, b_pixel, 3);
+                int lit_len;
+
+                lit_len = ezimg_huff_decode(&inflate->lit_len_huff, chunk_stream);
+                if(lit_len < 0)
+                {
+                    return(0);
+                }
+                else if(lit_len < 256)
+                {
+                    ROOM();
+                    *outp++ = (unsigned char)lit_len;
+                }
+                else if(lit_len == 256)
+                {
+                    inflate->state = EZIMG_INFLATE_BLOCK;
+                    break;
+                }
+                else
+                {
+                    int len, dist;
+                    unsigned char *backp;
 
-                a_pixel = (*((unsigned int *)dst) & 0xffffffff);
+                    len = ezimg_deflate_len(lit_len, chunk_stream);
+                    dist = ezimg_huff_decode(&inflate->dist_huff, chunk_stream);
+                    if(dist < 0)
+                    {
+                        return(0);
+                    }
 
-                b_pixel += prev_row_advance;
-                dst += 4;
-                src += 4;
-            }
-        }
-        else if(filter == 4)
-        {
-            a_pixel = 0;
-            b_pixel = prev_row;
-            c_pixel = 0;
-            for(x = 0;
-                x < width;
-                ++x)
-            {
-                dst[0] = ezimg_png_filter4(src, (unsigned char *)&a_pixel, b_pixel, (unsigned char *)&c_pixel, 0);
-                dst[1] = ezimg_png_filter4(src, (unsigned char *)&a_pixel, b_pixel, (unsigned char *)&c_pixel, 1);
-                dst[2] = ezimg_png_filter4(src, (unsigned char *)&a_pixel, b_pixel, (unsigned char *)&c_pixel, 2);
-                dst[3] = ezimg_png_filter4(src, (unsigned char *)&a_pixel, b_pixel, (unsigned char *)&c_pixel, 3);
+                    dist = ezimg_deflate_dist(dist, chunk_stream);
+                    if(dist < 0 || len <= 0)
+                    {
+                        return(0);
+                    }
+
+                    if(dist > outp - buff || len > EZIMG_MATCH_MAX)
+                    {
+                        return(0);
+                    }
 
-                c_pixel = (*((unsigned int *)b_pixel) & 0xffffffff);
-                a_pixel = (*((unsigned int *)dst) & 0xffffffff);
+                    ROOM();
+                    backp = outp - dist;
+                    while(len > 0)
+                    {
+                        *outp++ = *backp++;
+                        len -= 1;
+                    }
+                }
 
-                b_pixel += prev_row_advance;
-                dst += 4;
-                src += 4;
+                ROWS();
             }
         }
-        else
-        {
-            return(0);
-        }
+    }
 
-        prev_row = curr_row;
-        prev_row_advance = 4;
+    inflate->outp = outp;
+    inflate->row_start = row_start;
+
+    /* Too little data for the image */
+    if(inflate->state == EZIMG_INFLATE_DONE && rows->y < rows->height)
+    {
+        return(0);
     }
 
     return(1);
+
+#undef ROWS
+#undef ROOM
+#undef MORE
+
+#undef HCLEN_ORD_MAX
+#undef HLIT_MAX
+#undef HDIST_MAX
+#undef HCLEN_MAX
 }
 
 int
 ezimg_png_load(
     void *in, unsigned int in_size,
     void *out, unsigned int out_size,
+    int format,
     unsigned int *width, unsigned int *height)
 {
     unsigned char signature[8] = {0};
-    unsigned int w = 0, h = 0;
+    unsigned int w = 0, h = 0, pitch;
     unsigned int bit_count, color_type = 0, compression, filter, interlace;
     int first_chunk, last_chunk;
-    unsigned char *chunk_data, *next_chunk;
-    unsigned int i, x, y;
-    unsigned int idat_chunk_index;
-    unsigned int decomp_data_max_size;
-
-    unsigned char *decomp_data;
+    unsigned char *chunk_data, *next_chunk, *first_idat;
+    unsigned int i;
 
     ezimg_stream stream = {0};
     ezimg_cstream cstream = {0};
+    ezimg_png_rows rows;
+    ezimg_inflate inflate;
 
     ezimg_init_stream_big(&stream, in, in_size);
 
@@ -1596,7 +2417,7 @@ ezimg_png_load(
         return(EZIMG_INVALID_IMAGE);
     }
 
-    idat_chunk_index = 0;
+    first_idat = 0;
     first_chunk = 1;
     last_chunk = 0;
     while(!last_chunk)
@@ -1609,6 +2430,13 @@ ezimg_png_load(
         chunk_data = (unsigned char *)stream.ptr;
         next_chunk = chunk_data + len + 4;
 
+        /* The file ends before the chunk does */
+        if(len > (unsigned int)(stream.ptr_end - chunk_data) ||
+           (unsigned int)(stream.ptr_end - chunk_data) - len < 4)
+        {
+            return(EZIMG_INVALID_IMAGE);
+        }
+
         if(first_chunk && type != EZIMG_CHUNK_START)
         {
             return(EZIMG_INVALID_IMAGE);
@@ -1640,16 +2468,10 @@ ezimg_png_load(
         {
             last_chunk = 1;
         }
-        else if(type == EZIMG_CHUNK_IDAT)
+        else if(type == EZIMG_CHUNK_IDAT && !first_idat)
         {
-            if(idat_chunk_index >= EZIMG_CHUNK_MAX_ENTRIES)
-            {
-                return(EZIMG_NOT_SUPPORTED);
-            }
-
-            cstream.chunks[idat_chunk_index] = chunk_data;
-            cstream.lens[idat_chunk_index] = len;
-            idat_chunk_index += 1;
+            /* The compressed stream finds the others from here */
+            first_idat = chunk_data - 8;
         }
 
         first_chunk = 0;
@@ -1659,96 +2481,496 @@ ezimg_png_load(
             in_size - (unsigned int)(next_chunk - (unsigned char *)in));
     }
 
-    if(idat_chunk_index == 0)
+    if(!first_idat)
     {
         return(EZIMG_INVALID_IMAGE);
     }
 
-    /* Decompress IDAT chunk(s) */
-    ezimg_init_cstream(&cstream, idat_chunk_index);
-    decomp_data = ezimg_decompress_idat(&cstream, w, h, out, out_size);
-    if(!decomp_data)
+    pitch = ezimg_pitch(format, w);
+    if(!pitch)
+    {
+        return(EZIMG_NOT_SUPPORTED);
+    }
+
+    if(out_size < pitch*h + EZIMG_PNG_WORK_SIZE(w))
+    {
+        return(EZIMG_NOT_ENOUGH_SPACE);
+    }
+
+    rows.width = w;
+    rows.height = h;
+    rows.bpp = (color_type == 2) ? 3 : 4;
+    rows.len = w*rows.bpp;
+    rows.y = 0;
+    rows.out = (unsigned char *)out;
+    rows.pitch = pitch;
+    rows.format = format;
+    rows.callback = 0;
+    rows.user = 0;
+    rows.prev = rows.out + pitch*h;
+    rows.curr = rows.prev + w*4;
+
+    /* Decompress IDAT chunk(s), unfiltering and converting every row as
+       soon as it is complete */
+    ezimg_init_cstream(&cstream, first_idat, (unsigned char *)in + in_size);
+    ezimg_init_inflate(&inflate, rows.curr + w*4, 1 + rows.len);
+    if(!ezimg_png_inflate(&inflate, &cstream, &rows, 1))
     {
         return(EZIMG_INVALID_IMAGE);
     }
-    decomp_data_max_size = ezimg_png_decomp_data_max_size(w, h);
 
-    /* RGB to RGBA */
-    if(color_type == 2)
+    if(width)
     {
-        for(y = 0;
-            y < h;
-            ++y)
+        *width = w;
+    }
+
+    if(height)
+    {
+        *height = h;
+    }
+
+    return(EZIMG_OK);
+}
+
+/*
+ The push decoder goes through the file a piece at a time: the signature,
+ chunk headers and the IHDR data are gathered in have until they are
+ whole, other chunks and the CRCs are skipped. IDAT data is copied into
+ input, which the compressed stream reads as its one chunk, and inflated
+ each time input fills up (ezimg_png_inflate stops with less than
+ EZIMG_INFLATE_STEP_MAX bytes left, those move to the start of input).
+ The rest of the stream is inflated at IEND.
+ */
+enum
+{
+    EZIMG_PNG_SIGNATURE,
+    EZIMG_PNG_CHUNK,
+    EZIMG_PNG_HEADER,
+    EZIMG_PNG_IDAT,
+    EZIMG_PNG_SKIP,
+    EZIMG_PNG_END
+};
+
+#define EZIMG_PNG_INPUT_SIZE (16*EZIMG_INFLATE_STEP_MAX)
+
+struct
+ezimg_png_decoder
+{
+    int state;
+    int result;
+
+    unsigned char have[13];
+    unsigned int have_count;
+    unsigned int chunk_left;
+    int first_chunk;
+    int seen_idat;
+
+    unsigned char *out;
+    unsigned int out_size;
+    int format;
+    ezimg_png_row_callback *callback;
+    void *user;
+
+    ezimg_png_rows rows;
+    ezimg_inflate inflate;
+    ezimg_cstream cstream;
+    unsigned char input[EZIMG_PNG_INPUT_SIZE];
+};
+
+/* The decoder goes at the end of out, 16 bytes aligned from its start */
+#define EZIMG_PNG_DECODER_OFFSET(size) (((size) - (unsigned int)sizeof(ezimg_png_decoder)) & ~15u)
+
+unsigned int
+ezimg_png_decoder_size(
+    void *in, unsigned int in_size,
+    int format, int use_callback)
+{
+    unsigned int width, height, pitch, size;
+
+    if(!ezimg_png_dimensions(in, in_size, &width, &height))
+    {
+        return(0);
+    }
+
+    pitch = ezimg_pitch(format, width);
+    if(!pitch)
+    {
+        return(0);
+    }
+
+    size = (use_callback ? pitch : pitch*height) + EZIMG_PNG_WORK_SIZE(width);
+    return(((size + 15) & ~15u) + (unsigned int)sizeof(ezimg_png_decoder));
+}
+
+ezimg_png_decoder *
+ezimg_png_init(
+    void *out, unsigned int out_size,
+    int format,
+    ezimg_png_row_callback *callback, void *user)
+{
+    ezimg_png_decoder *decoder;
+    unsigned int offset;
+
+    if(out_size < sizeof(ezimg_png_decoder))
+    {
+        return(0);
+    }
+
+    offset = EZIMG_PNG_DECODER_OFFSET(out_size);
+    decoder = (ezimg_png_decoder *)((unsigned char *)out + offset);
+
+    decoder->state = EZIMG_PNG_SIGNATURE;
+    decoder->result = EZIMG_OK;
+    decoder->have_count = 0;
+    decoder->chunk_left = 0;
+    decoder->first_chunk = 1;
+    decoder->seen_idat = 0;
+
+    decoder->out = (unsigned char *)out;
+    decoder->out_size = offset;
+    decoder->format = format;
+    decoder->callback = callback;
+    decoder->user = user;
+
+    /* Not ezimg_init_cstream, which would find the stream empty and end
+       it */
+    decoder->cstream.ptr = decoder->input;
+    decoder->cstream.ptr_end = decoder->input;
+    decoder->cstream.next = 0;
+    decoder->cstream.file_end = 0;
+    decoder->cstream.bits = 0;
+    decoder->cstream.bit_count = 0;
+    decoder->cstream.end = 0;
+
+    return(decoder);
+}
+
+/* Reads the IHDR data in have and sets up the rows and inflate */
+int
+ezimg_png_decoder_header(ezimg_png_decoder *decoder)
+{
+    ezimg_stream stream = {0};
+    ezimg_png_rows *rows;
+    unsigned int w, h, pitch, image_size;
+    unsigned int bit_count, color_type, compression, filter, interlace;
+
+    ezimg_init_stream_big(&stream, decoder->have, 13);
+    w = ezimg_read_u32(&stream);
+    h = ezimg_read_u32(&stream);
+    bit_count = ezimg_read_u8(&stream);
+    color_type = ezimg_read_u8(&stream);
+    compression = ezimg_read_u8(&stream);
+    filter = ezimg_read_u8(&stream);
+    interlace = ezimg_read_u8(&stream);
+
+    if(w == 0 || h == 0)
+    {
+        return(EZIMG_INVALID_IMAGE);
+    }
+
+    if( bit_count != 8 || (color_type != 2 && color_type != 6) ||
+        compression != 0 || filter != 0 ||
+        interlace != 0)
+    {
+        return(EZIMG_NOT_SUPPORTED);
+    }
+
+    pitch = ezimg_pitch(decoder->format, w);
+    if(!pitch)
+    {
+        return(EZIMG_NOT_SUPPORTED);
+    }
+
+    image_size = decoder->callback ? pitch : pitch*h;
+    if(decoder->out_size < image_size + EZIMG_PNG_WORK_SIZE(w))
+    {
+        return(EZIMG_NOT_ENOUGH_SPACE);
+    }
+
+    rows = &decoder->rows;
+    rows->width = w;
+    rows->height = h;
+    rows->bpp = (color_type == 2) ? 3 : 4;
+    rows->len = w*rows->bpp;
+    rows->y = 0;
+    rows->out = decoder->out;
+    rows->pitch = pitch;
+    rows->format = decoder->format;
+    rows->callback = decoder->callback;
+    rows->user = decoder->user;
+    rows->prev = rows->out + image_size;
+    rows->curr = rows->prev + w*4;
+
+    ezimg_init_inflate(&decoder->inflate, rows->curr + w*4, 1 + rows->len);
+
+    return(EZIMG_OK);
+}
+
+/* Inflates what there is of the IDAT data and moves what is left of it to
+   the start of input */
+int
+ezimg_png_decoder_inflate(ezimg_png_decoder *decoder, int final)
+{
+    ezimg_cstream *cstream;
+    unsigned char *src;
+    unsigned int left, i;
+
+    cstream = &decoder->cstream;
+    if(!ezimg_png_inflate(&decoder->inflate, cstream, &decoder->rows, final))
+    {
+        return(EZIMG_INVALID_IMAGE);
+    }
+
+    src = cstream->ptr;
+    left = (unsigned int)(cstream->ptr_end - cstream->ptr);
+    for(i = 0;
+        i < left;
+        ++i)
+    {
+        decoder->input[i] = src[i];
+    }
+
+    cstream->ptr = decoder->input;
+    cstream->ptr_end = decoder->input + left;
+
+    return(EZIMG_OK);
+}
+
+/* Reads the chunk header in have */
+int
+ezimg_png_decoder_chunk(ezimg_png_decoder *decoder)
+{
+    ezimg_stream stream = {0};
+    unsigned int len, type;
+
+    ezimg_init_stream_big(&stream, decoder->have, 8);
+    len = ezimg_read_u32(&stream);
+    type = ezimg_read_u32(&stream);
+
+    if( (decoder->first_chunk && type != EZIMG_CHUNK_START) ||
+        len > 0x7fffffff)
+    {
+        return(EZIMG_INVALID_IMAGE);
+    }
+
+    decoder->first_chunk = 0;
+
+    if(type == EZIMG_CHUNK_START)
+    {
+        if(len != 13)
         {
-            for(x = 0;
-                x < w;
-                ++x)
+            return(EZIMG_INVALID_IMAGE);
+        }
+
+        decoder->state = EZIMG_PNG_HEADER;
+    }
+    else if(type == EZIMG_CHUNK_END)
+    {
+        if(!decoder->seen_idat)
+        {
+            return(EZIMG_INVALID_IMAGE);
+        }
+
+        decoder->state = EZIMG_PNG_END;
+        return(ezimg_png_decoder_inflate(decoder, 1));
+    }
+    else if(type == EZIMG_CHUNK_IDAT)
+    {
+        decoder->seen_idat = 1;
+        decoder->chunk_left = len;
+        decoder->state = EZIMG_PNG_IDAT;
+    }
+    else
+    {
+        decoder->chunk_left = len + 4;
+        decoder->state = EZIMG_PNG_SKIP;
+    }
+
+    return(EZIMG_OK);
+}
+
+int
+ezimg_png_feed(ezimg_png_decoder *decoder, void *in, unsigned int in_size)
+{
+    unsigned char *inp, *in_end;
+
+    inp = (unsigned char *)in;
+    in_end = inp + in_size;
+    while(decoder->result == EZIMG_OK && inp < in_end)
+    {
+        unsigned int count;
+
+        if( decoder->state == EZIMG_PNG_SIGNATURE ||
+            decoder->state == EZIMG_PNG_CHUNK ||
+            decoder->state == EZIMG_PNG_HEADER)
+        {
+            unsigned int need;
+
+            need = (decoder->state == EZIMG_PNG_HEADER) ? 13 : 8;
+            count = need - decoder->have_count;
+            if(count > (unsigned int)(in_end - inp))
+            {
+                count = (unsigned int)(in_end - inp);
+            }
+
+            while(count > 0)
+            {
+                decoder->have[decoder->have_count++] = *inp++;
+                --count;
+            }
+
+            if(decoder->have_count < need)
+            {
+                break;
+            }
+
+            decoder->have_count = 0;
+            if(decoder->state == EZIMG_PNG_SIGNATURE)
+            {
+                decoder->state = EZIMG_PNG_CHUNK;
+                if(!ezimg_png_check_signature(decoder->have))
+                {
+                    decoder->result = EZIMG_INVALID_IMAGE;
+                }
+            }
+            else if(decoder->state == EZIMG_PNG_CHUNK)
+            {
+                decoder->result = ezimg_png_decoder_chunk(decoder);
+            }
+            else
+            {
+                decoder->chunk_left = 4;
+                decoder->state = EZIMG_PNG_SKIP;
+                decoder->result = ezimg_png_decoder_header(decoder);
+            }
+        }
+        else if(decoder->state == EZIMG_PNG_IDAT)
+        {
+            ezimg_cstream *cstream = &decoder->cstream;
+            unsigned char *dst, *input_end;
+            unsigned int i;
+
+            count = decoder->chunk_left;
+            if(count > (unsigned int)(in_end - inp))
+            {
+                count = (unsigned int)(in_end - inp);
+            }
+
+            if(decoder->inflate.state == EZIMG_INFLATE_DONE)
+            {
+                /* Past the end of the zlib stream, nothing to decode */
+                inp += count;
+            }
+            else
             {
-                unsigned int pos = 1 + x*4 + 3;
-                for(i = decomp_data_max_size - 1;
-                    i > pos;
-                    --i)
+                dst = cstream->ptr_end;
+                input_end = decoder->input + EZIMG_PNG_INPUT_SIZE;
+                if(count > (unsigned int)(input_end - dst))
+                {
+                    count = (unsigned int)(input_end - dst);
+                }
+
+                for(i = 0;
+                    i < count;
+                    ++i)
+                {
+                    dst[i] = inp[i];
+                }
+
+                inp += count;
+                cstream->ptr_end += count;
+
+                if(cstream->ptr_end == input_end)
                 {
-                    decomp_data[i] = decomp_data[i - 1];
+                    decoder->result = ezimg_png_decoder_inflate(decoder, 0);
                 }
-                decomp_data[pos] = 0;
             }
+
+            decoder->chunk_left -= count;
+            if(decoder->chunk_left == 0)
+            {
+                decoder->chunk_left = 4;
+                decoder->state = EZIMG_PNG_SKIP;
+            }
+        }
+        else if(decoder->state == EZIMG_PNG_SKIP)
+        {
+            count = decoder->chunk_left;
+            if(count > (unsigned int)(in_end - inp))
+            {
+                count = (unsigned int)(in_end - inp);
+            }
+
+            inp += count;
+            decoder->chunk_left -= count;
+            if(decoder->chunk_left == 0)
+            {
+                decoder->state = EZIMG_PNG_CHUNK;
+            }
+        }
+        else
+        {
+            /* Whatever comes after IEND */
+            inp = in_end;
         }
     }
 
-    /* Reconstruct filters */
-    if(!ezimg_png_filter(decomp_data, w, h))
+    return(decoder->result);
+}
+
+int
+ezimg_png_finish(
+    ezimg_png_decoder *decoder,
+    unsigned int *width, unsigned int *height)
+{
+    if(decoder->result != EZIMG_OK)
     {
-        return(EZIMG_INVALID_IMAGE);
+        return(decoder->result);
     }
 
-    /* Transform RGBA to ARGB */
-    for(y = 0;
-        y < h;
-        ++y)
+    /* The file stopped short of IEND */
+    if(decoder->state != EZIMG_PNG_END)
     {
-        for(x = 0;
-            x < w;
-            ++x)
-        {
-            unsigned int offset;
-            unsigned char r, g, b, a;
-
-            offset = (y*w + x)*4;
-            r = *(decomp_data + offset + 0);
-            g = *(decomp_data + offset + 1);
-            b = *(decomp_data + offset + 2);
-            a = *(decomp_data + offset + 3);
-
-            *(decomp_data + offset + 0) = (color_type == 2) ? 0xff : a;
-            *(decomp_data + offset + 1) = r;
-            *(decomp_data + offset + 2) = g;
-            *(decomp_data + offset + 3) = b;
-        }
+        return(EZIMG_INVALID_IMAGE);
     }
 
     if(width)
     {
-        *width = w;
+        *width = decoder->rows.width;
     }
 
     if(height)
     {
-        *height = h;
+        *height = decoder->rows.height;
     }
 
     return(EZIMG_OK);
 }
 
+#undef EZIMG_PNG_DECODER_OFFSET
+#undef EZIMG_PNG_INPUT_SIZE
+
+#undef EZIMG_INFLATE_STEP_MAX
+#undef EZIMG_PNG_WORK_SIZE
+#undef EZIMG_INFLATE_BUFFER_SIZE
+#undef EZIMG_MATCH_MAX
+#undef EZIMG_WINDOW_SIZE
+
 #undef EZIMG_CHUNK_IDAT
 #undef EZIMG_CHUNK_END
 #undef EZIMG_CHUNK_START
 
 #undef EZIMG_HTABLE_MAX_ENTRIES
+#undef EZIMG_HUFF_FAST_BITS
+#undef EZIMG_HUFF_MAX_LEN
+#undef EZIMG_HUFF_SUBTABLE
+#undef EZIMG_HUFF_LEN_MASK
+#undef EZIMG_HUFF_TABLE_SIZE
 
-#undef EZIMG_CHUNK_MAX_ENTRIES
+#undef EZIMG_SSE2
 
 #undef EZIMG_ABS
 
 #endif
 #endif
+#endif
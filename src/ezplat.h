@@ -370,6 +370,7 @@ extern int      EzInitialize(ez *Ez);
 extern void     EzPush(ez *Ez);
 extern void     EzPull(ez *Ez);
 extern void     EzUpdate(ez *Ez);
+extern void     EzWait(ez *Ez, int TimeoutMilliseconds);
 extern void     EzClose(ez *Ez);
 
 #endif
@@ -434,6 +435,7 @@ Printf(char *format, ...)
 typedef BOOL (*TRANSLATE_MESSAGE)(const MSG *);
 typedef BOOL (*DISPATCH_MESSAGE_A)(const MSG *);
 typedef BOOL (*PEEK_MESSAGE_A)(LPMSG, HWND, UINT, UINT, UINT);
+typedef DWORD (*MSG_WAIT_FOR_MULTIPLE_OBJECTS_EX)(DWORD, const HANDLE *, DWORD, DWORD, DWORD);
 typedef LRESULT (*DEF_WINDOW_PROC_A)(HWND, UINT, WPARAM, LPARAM);
 typedef ATOM (*REGISTER_CLASS_A)(const WNDCLASSA *);
 typedef HWND (*CREATE_WINDOW_EX_A)(DWORD, LPCSTR, LPCSTR, DWORD, int, int, int, int, HWND, HMENU, HINSTANCE, LPVOID);
@@ -488,6 +490,7 @@ ez_win32
     TRANSLATE_MESSAGE TranslateMessage;
     DISPATCH_MESSAGE_A DispatchMessageA;
     PEEK_MESSAGE_A PeekMessageA;
+    MSG_WAIT_FOR_MULTIPLE_OBJECTS_EX MsgWaitForMultipleObjectsEx;
     REGISTER_CLASS_A RegisterClassA;
     CREATE_WINDOW_EX_A CreateWindowExA;
     DESTROY_WINDOW DestroyWindow;
@@ -593,6 +596,7 @@ Win32LoadUser32Dll(ez *Ez)
     WIN32_LOAD_PROC_ADDR(User32Dll, TRANSLATE_MESSAGE, TranslateMessage);
     WIN32_LOAD_PROC_ADDR(User32Dll, DISPATCH_MESSAGE_A, DispatchMessageA);
     WIN32_LOAD_PROC_ADDR(User32Dll, PEEK_MESSAGE_A, PeekMessageA);
+    WIN32_LOAD_PROC_ADDR(User32Dll, MSG_WAIT_FOR_MULTIPLE_OBJECTS_EX, MsgWaitForMultipleObjectsEx);
     WIN32_LOAD_PROC_ADDR(User32Dll, REGISTER_CLASS_A, RegisterClassA);
     WIN32_LOAD_PROC_ADDR(User32Dll, CREATE_WINDOW_EX_A, CreateWindowExA);
     WIN32_LOAD_PROC_ADDR(User32Dll, DESTROY_WINDOW, DestroyWindow);
@@ -1485,6 +1489,34 @@ EzUpdate(ez *Ez)
     EzPush(Ez);
 }
 
+// XInput has no events, so connected gamepads are still polled
+#define EZ_GAMEPAD_POLL_MILLISECONDS 16
+
+// Blocks until there is input for the window or TimeoutMilliseconds have
+// passed. A negative timeout waits for input only. Call EzPull after it.
+extern void
+EzWait(ez *Ez, int TimeoutMilliseconds)
+{
+    if(Ez && Ez->Initialized)
+    {
+        ez_win32 *Win32 = EzGetWin32Context(Ez);
+        if(Win32)
+        {
+            DWORD Timeout = (TimeoutMilliseconds < 0) ? INFINITE : (DWORD)TimeoutMilliseconds;
+            if(Ez->Input.ConnectedGamepads > 0 && Timeout > EZ_GAMEPAD_POLL_MILLISECONDS)
+            {
+                Timeout = EZ_GAMEPAD_POLL_MILLISECONDS;
+            }
+
+            // NOTE: MWMO_INPUTAVAILABLE also returns for messages that were
+            // already in the queue when EzWait was called
+            Win32->MsgWaitForMultipleObjectsEx(0, 0, Timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        }
+    }
+}
+
+#undef EZ_GAMEPAD_POLL_MILLISECONDS
+
 extern void
 EzClose(ez *Ez)
 {
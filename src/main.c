@@ -4,25 +4,111 @@ int _fltused;
 #include <stddef.h>
 
 typedef uint8_t  u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef int8_t   i8;
 typedef int32_t  i32;
 typedef unsigned int uint;
 
-#define FONT_SIZE 16
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+void
+CpuId(u32 Leaf, u32 SubLeaf, u32 Regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex((int *)Regs, (int)Leaf, (int)SubLeaf);
+#else
+    __cpuid_count(Leaf, SubLeaf, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+}
+
+uint64_t
+XGetBv0(void)
+{
+#if defined(_MSC_VER)
+    return(_xgetbv(0));
+#else
+    u32 Lo, Hi;
+    __asm__ volatile("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+    return(((uint64_t)Hi << 32) | Lo);
+#endif
+}
+
+#if defined(_MSC_VER)
+/* NOTE: We don't link the CRT, but the optimizer is still allowed to turn
+   loops and struct copies into calls to these two */
+#pragma function(memset)
+void *
+memset(void *Dest, int Value, size_t Count)
+{
+    volatile u8 *At = (volatile u8 *)Dest;
+    while(Count--)
+    {
+        *At++ = (u8)Value;
+    }
+    return(Dest);
+}
+
+#pragma function(memcpy)
+void *
+memcpy(void *Dest, const void *Src, size_t Count)
+{
+    volatile u8 *At = (volatile u8 *)Dest;
+    const u8 *From = (const u8 *)Src;
+    while(Count--)
+    {
+        *At++ = *From++;
+    }
+    return(Dest);
+}
+#endif
+
+#define MAX_GLYPH_SIZE 32
 #define SCREEN_WIDTH 80
 #define SCREEN_HEIGHT 50
 
-#define BUFFER_WIDTH SCREEN_WIDTH*FONT_SIZE
-#define BUFFER_HEIGHT SCREEN_HEIGHT*FONT_SIZE
-u32 BackBuffer[BUFFER_WIDTH*BUFFER_HEIGHT];
+/* The map is shown in the top left VIEW_WIDTH x VIEW_HEIGHT cells, with
+   the side panel (minimap) to its right and the message log below both.
+   Only the view scrolls with the camera. */
+#define MESSAGE_LOG_HEIGHT 6
+#define SIDE_PANEL_WIDTH 16
+#define VIEW_WIDTH (SCREEN_WIDTH - SIDE_PANEL_WIDTH)
+#define VIEW_HEIGHT (SCREEN_HEIGHT - MESSAGE_LOG_HEIGHT)
 
+/* NOTE: The glyph size comes from the loaded font, so the window's buffer
+   is allocated by PackFont (see ResizeFrameBuffers). MAX_BUFFER_WIDTH only
+   bounds scratch rows. */
+#define MAX_BUFFER_WIDTH (SCREEN_WIDTH*MAX_GLYPH_SIZE)
+u32 *WindowBackBuffer;
+
+/* Everything is drawn into BackBuffer, see SetRenderTarget */
+u32 *BackBuffer;
+
+uint GlyphSize = 16;
+uint BufferWidth = SCREEN_WIDTH*16;
+uint BufferHeight = SCREEN_HEIGHT*16;
+
+#if defined(_WIN32)
 #define OS_IMPLEMENTATION_WIN32
+#else
+#define OS_IMPLEMENTATION_POSIX
+#endif
 #include "os.h"
 
+/* NOTE: The headless build (build.sh) renders into a caller-owned buffer
+   and never opens a window */
+#ifndef R0GU3_HEADLESS
 #define EZPLAT_IMPLEMENTATION
 #include "ezplat.h"
 ez Ez = {0};
+#endif
 
 #define EZIMG_IMPLEMENTATION
 #include "ezimg.h"
@@ -69,60 +155,75 @@ image
     void *Pixels;
 } image;
 
+/* PNGs are read and decoded a piece at a time (see ezimg_png_feed), so
+   loading one takes the image and a LOAD_PIECE_SIZE buffer, not the whole
+   file on top of it */
+#define LOAD_PIECE_SIZE (64*1024)
+
+/* Format is one of EZIMG_FORMAT_*, the renderer draws EZIMG_FORMAT_BGRA
+   images (premultiplied for DrawImageBlend) */
 image
-LoadImagePng(char *FilePath)
+LoadImagePng(char *FilePath, int Format)
 {
     image Result = {0};
 
-    size_t FileSize;
-    void *FileContent = ReadEntireFile(FilePath, &FileSize);
-    if(!FileContent || !FileSize)
+    void *File = os_file_open(FilePath);
+    if(!File)
     {
         return(Result);
     }
 
-    uint ImageSize = ezimg_png_size(FileContent, (uint)FileSize);
-    void *Pixels = os_memory_alloc(ImageSize);
-    if(!Pixels)
+    u8 *Piece = os_memory_alloc(LOAD_PIECE_SIZE);
+    if(!Piece)
     {
-        os_memory_free(FileContent);
+        os_file_close(File);
         return(Result);
     }
 
-    uint Width, Height;
-    int ImageLoadResult = ezimg_png_load(
-        FileContent, (uint)FileSize,
-        Pixels, ImageSize,
-        &Width, &Height);
-    if(ImageLoadResult != EZIMG_OK)
+    /* The size of the image is in the first 24 bytes */
+    size_t PieceSize = 0;
+    while(PieceSize < 24)
     {
-        os_memory_free(FileContent);
-        os_memory_free(Pixels);
-        return(Result);
+        size_t Read = os_file_read_next(File, Piece + PieceSize, LOAD_PIECE_SIZE - PieceSize);
+        if(!Read)
+        {
+            break;
+        }
+        PieceSize += Read;
     }
 
-    /* Transform ARGB to BGRA */
-    for(uint PixelIndex = 0;
-        PixelIndex < Width*Height;
-        ++PixelIndex)
+    uint ImageSize = ezimg_png_decoder_size(Piece, (uint)PieceSize, Format, 0);
+    void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+
+    uint Width, Height;
+    int ImageLoadResult = EZIMG_NOT_ENOUGH_SPACE;
+    if(Pixels)
     {
-        u8 R, G, B, A;
-        u32 Pixel;
+        ezimg_png_decoder *Decoder = ezimg_png_init(Pixels, ImageSize, Format, 0, 0);
 
-        Pixel = ((u32 *)Pixels)[PixelIndex];
+        ImageLoadResult = EZIMG_OK;
+        while(PieceSize && ImageLoadResult == EZIMG_OK)
+        {
+            ImageLoadResult = ezimg_png_feed(Decoder, Piece, (uint)PieceSize);
+            PieceSize = os_file_read_next(File, Piece, LOAD_PIECE_SIZE);
+        }
 
-        A = (u8)(((Pixel & 0x000000ff) >>  0) & 0xff);
-        R = (u8)(((Pixel & 0x0000ff00) >>  8) & 0xff);
-        G = (u8)(((Pixel & 0x00ff0000) >> 16) & 0xff);
-        B = (u8)(((Pixel & 0xff000000) >> 24) & 0xff);
+        if(ImageLoadResult == EZIMG_OK)
+        {
+            ImageLoadResult = ezimg_png_finish(Decoder, &Width, &Height);
+        }
+    }
 
-        Pixel =
-            (((u32)B & 0xff) << 0) |
-            (((u32)G & 0xff) << 8) |
-            (((u32)R & 0xff) << 16) |
-            (((u32)A & 0xff) << 24);
+    os_memory_free(Piece);
+    os_file_close(File);
 
-        ((u32 *)Pixels)[PixelIndex] = Pixel;
+    if(ImageLoadResult != EZIMG_OK)
+    {
+        if(Pixels)
+        {
+            os_memory_free(Pixels);
+        }
+        return(Result);
     }
 
     Result.Width = Width;
@@ -132,211 +233,6116 @@ LoadImagePng(char *FilePath)
     return(Result);
 }
 
+/* Exact round(X*Y/255) for X, Y in 0..255 */
+u32
+MulDiv255(u32 X, u32 Y)
+{
+    u32 T = X*Y + 128;
+    return((T + (T >> 8)) >> 8);
+}
+
+/* Scales the color channels of every pixel by its alpha, which is what
+   DrawImageBlend expects */
 void
-ClearBackBuffer(u32 Color)
+PremultiplyImage(image Image)
 {
-    for(uint Index = 0;
-        Index < BUFFER_WIDTH*BUFFER_HEIGHT;
-        ++Index)
+    u32 *Pixels = (u32 *)Image.Pixels;
+    for(uint Index = 0; Index < Image.Width*Image.Height; ++Index)
     {
-        BackBuffer[Index] = Color;
+        u32 Pixel = Pixels[Index];
+        u32 A = Pixel >> 24;
+        Pixels[Index] =
+            (A << 24) |
+            (MulDiv255((Pixel >> 16) & 0xff, A) << 16) |
+            (MulDiv255((Pixel >>  8) & 0xff, A) <<  8) |
+            (MulDiv255((Pixel >>  0) & 0xff, A) <<  0);
     }
 }
 
-void
-DrawImage(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+/* Loads an image with transparency (tiles, cursors, UI) for DrawImageBlend */
+image
+LoadSpritePng(char *FilePath)
 {
-    if(SrcX >= Image.Width || SrcY >= Image.Height)
+    return(LoadImagePng(FilePath, EZIMG_FORMAT_BGRA_PREMULTIPLIED));
+}
+
+typedef struct
+render_stats
+{
+    uint CommandsSubmitted;
+    uint CommandsCulled;
+    uint CommandsExecuted;
+    uint CellsDrawn;
+    uint PixelsWritten;
+} render_stats;
+
+/* NOTE: Only FlushDrawCommands writes these, for the frame it executed */
+render_stats RenderStats;
+
+/*
+ * Palette mode
+ *
+ * When Palette.Enabled is set, everything is drawn into IndexBuffer, one
+ * byte per pixel, and ResolvePalette expands it into BackBuffer through
+ * Palette.Colors right before the frame is pushed to the platform layer.
+ * Drawing still takes ARGB colors: each color is given an index the first
+ * time it is seen (PaletteIndexOf), so changing Palette.Colors afterwards
+ * (PaletteSetColor) recolors everything drawn with it at no drawing cost.
+ */
+
+#ifndef PALETTE_MODE
+#define PALETTE_MODE 0
+#endif
+#define PALETTE_MAP_SLOTS 512
+#define PALETTE_BLEND_CACHE_SLOTS 256
+
+typedef struct
+palette
+{
+    int Enabled;
+    int ResolveAll;
+    uint Count;
+    u32 Colors[256];
+    u32 Keys[256];
+    u16 MapSlots[PALETTE_MAP_SLOTS];
+} palette;
+
+palette Palette;
+u8 *IndexBuffer;
+
+uint
+PaletteHash(u32 Color)
+{
+    u32 Hash = Color*0x9e3779b1;
+    return((Hash >> 16) & (PALETTE_MAP_SLOTS - 1));
+}
+
+/* Index of the entry of Table (Palette.Keys or Palette.Colors) closest to
+   Color */
+u8
+PaletteNearest(u32 *Table, u32 Color)
+{
+    uint Best = 0;
+    uint BestDistance = 0xffffffff;
+
+    for(uint Index = 0; Index < Palette.Count; ++Index)
     {
-        return;
+        int Dr = (int)((Color >> 16) & 0xff) - (int)((Table[Index] >> 16) & 0xff);
+        int Dg = (int)((Color >>  8) & 0xff) - (int)((Table[Index] >>  8) & 0xff);
+        int Db = (int)((Color >>  0) & 0xff) - (int)((Table[Index] >>  0) & 0xff);
+        uint Distance = (uint)(Dr*Dr + Dg*Dg + Db*Db);
+        if(Distance < BestDistance)
+        {
+            Best = Index;
+            BestDistance = Distance;
+        }
     }
 
-    if(SrcW > Image.Width)
+    return((u8)Best);
+}
+
+/* Looks a color up without registering it, so it is safe to call from the
+   render threads. Unknown colors map to the nearest registered one. */
+u8
+PaletteFind(u32 Color)
+{
+    uint Slot = PaletteHash(Color);
+
+    while(Palette.MapSlots[Slot])
     {
-        SrcW = Image.Width;
+        uint Index = Palette.MapSlots[Slot] - 1u;
+        if(Palette.Keys[Index] == Color)
+        {
+            return((u8)Index);
+        }
+        Slot = (Slot + 1) & (PALETTE_MAP_SLOTS - 1);
     }
 
-    if(SrcH > Image.Height)
+    return(PaletteNearest(Palette.Keys, Color));
+}
+
+/* Returns the index for a color, registering it if the palette has room */
+u8
+PaletteIndexOf(u32 Color)
+{
+    uint Slot = PaletteHash(Color);
+
+    while(Palette.MapSlots[Slot])
     {
-        SrcH = Image.Height;
+        uint Index = Palette.MapSlots[Slot] - 1u;
+        if(Palette.Keys[Index] == Color)
+        {
+            return((u8)Index);
+        }
+        Slot = (Slot + 1) & (PALETTE_MAP_SLOTS - 1);
     }
 
-    /* TODO */
-    for(uint Y = 0; Y < SrcH; ++Y)
+    if(Palette.Count >= 256)
     {
-        for(uint X = 0; X < SrcW; ++X)
+        return(PaletteNearest(Palette.Keys, Color));
+    }
+
+    uint Index = Palette.Count;
+    Palette.Count += 1;
+    Palette.Keys[Index] = Color;
+    Palette.Colors[Index] = Color;
+    Palette.MapSlots[Slot] = (u16)(Index + 1);
+
+    return((u8)Index);
+}
+
+/* Changes what an index looks like on screen (e.g. palette cycling) */
+void
+PaletteSetColor(u8 Index, u32 Color)
+{
+    Palette.Colors[Index] = Color;
+    Palette.ResolveAll = 1;
+}
+
+/* The public drawing functions are immediate mode: nothing tracks which
+   cells they touched, so in palette mode the whole IndexBuffer is resolved.
+   The render bands call the ...Raw variants instead and leave this to
+   FlushDrawCommands, since they run at the same time. */
+void
+PaletteMarkDrawn(void)
+{
+    if(Palette.Enabled)
+    {
+        Palette.ResolveAll = 1;
+    }
+}
+
+void
+ClearBackBuffer(u32 Color)
+{
+    if(Palette.Enabled)
+    {
+        u8 ColorIndex = PaletteIndexOf(Color);
+        for(uint Index = 0;
+            Index < BufferWidth*BufferHeight;
+            ++Index)
         {
-            if( (SrcY+Y) < Image.Height &&
-                (SrcX+X) < Image.Width &&
-                (DestY+Y) < SCREEN_HEIGHT*FONT_SIZE &&
-                (DestX+X) < SCREEN_WIDTH*FONT_SIZE)
-            {
-                BackBuffer[(DestY+Y)*SCREEN_WIDTH*FONT_SIZE + (DestX+X)] = 
-                    ((u32 *)Image.Pixels)[(SrcY+Y)*Image.Width + (SrcX+X)];
-            }
+            IndexBuffer[Index] = ColorIndex;
         }
+
+        Palette.ResolveAll = 1;
+        return;
+    }
+
+    for(uint Index = 0;
+        Index < BufferWidth*BufferHeight;
+        ++Index)
+    {
+        BackBuffer[Index] = Color;
     }
 }
 
 void
-DrawImageMono(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Color)
+FillRectRaw(uint DestX, uint DestY, uint Width, uint Height, u32 Color)
 {
-    if(SrcX >= Image.Width || SrcY >= Image.Height)
+    if(DestX >= BufferWidth || DestY >= BufferHeight)
     {
         return;
     }
 
-    if(SrcW > Image.Width)
+    if(Width > BufferWidth - DestX)
     {
-        SrcW = Image.Width;
+        Width = BufferWidth - DestX;
     }
 
-    if(SrcH > Image.Height)
+    if(Height > BufferHeight - DestY)
     {
-        SrcH = Image.Height;
+        Height = BufferHeight - DestY;
     }
 
-    /* TODO */
-    for(uint Y = 0; Y < SrcH; ++Y)
+    if(Palette.Enabled)
     {
-        for(uint X = 0; X < SrcW; ++X)
+        u8 ColorIndex = PaletteIndexOf(Color);
+        for(uint Y = 0; Y < Height; ++Y)
         {
-            if( (SrcY+Y) < Image.Height &&
-                (SrcX+X) < Image.Width &&
-                (DestY+Y) < SCREEN_HEIGHT*FONT_SIZE &&
-                (DestX+X) < SCREEN_WIDTH*FONT_SIZE)
+            u8 *Row = IndexBuffer + (DestY+Y)*BufferWidth + DestX;
+            for(uint X = 0; X < Width; ++X)
             {
-                u32 PixelColor = ((u32 *)Image.Pixels)[(SrcY+Y)*Image.Width + (SrcX+X)];
-                if((PixelColor & 0xffffff) == 0xffffff)
-                {
-                    PixelColor = Color;
-                    BackBuffer[(DestY+Y)*SCREEN_WIDTH*FONT_SIZE + (DestX+X)] = PixelColor;
-                }
+                Row[X] = ColorIndex;
             }
         }
+
+        return;
+    }
+
+    for(uint Y = 0; Y < Height; ++Y)
+    {
+        u32 *Row = BackBuffer + (DestY+Y)*BufferWidth + DestX;
+        for(uint X = 0; X < Width; ++X)
+        {
+            Row[X] = Color;
+        }
     }
 }
 
-image FontImage;
-
 void
-DrawChar(int CharToDraw, uint X, uint Y, u32 Color)
+FillRect(uint DestX, uint DestY, uint Width, uint Height, u32 Color)
 {
-    uint SrcX = ((uint)CharToDraw%16)*FONT_SIZE;
-    uint SrcY = ((uint)CharToDraw/16)*FONT_SIZE;
-    DrawImageMono(FontImage, SrcX, SrcY, FONT_SIZE, FONT_SIZE, X*FONT_SIZE, Y*FONT_SIZE, Color);
+    PaletteMarkDrawn();
+    FillRectRaw(DestX, DestY, Width, Height, Color);
 }
 
+/*
+ * Blit kernels
+ *
+ * DrawImage, DrawImageMono, DrawImageCell and DrawImageBlend clip their
+ * rectangles once and then hand whole rows to the kernels below. The
+ * widest kernel set supported by the CPU is picked at startup by
+ * InitBlitKernels.
+ */
+
+typedef void blit_copy_row(u32 *Dest, u32 *Src, uint Count);
+typedef void blit_mono_row(u32 *Dest, u32 *Src, uint Count, u32 Color);
+typedef void blit_cell_row(u32 *Dest, u32 *Src, uint Count, u32 Fg, u32 Bg);
+typedef void blit_blend_row(u32 *Dest, u32 *Src, uint Count);
+typedef void blit_modulate_row(u32 *Dest, u32 *Src, u32 *Light, uint Count);
+typedef void blit_expand_row(u32 *Dest, u32 Bits, uint Count, u32 Fg, u32 Bg);
+typedef void blit_expand_row8(u8 *Dest, u32 Bits, uint Count, u8 Fg, u8 Bg);
+
 typedef enum
-action_type
+blit_kernel_type
 {
-    ACT_NONE,
-    ACT_MOVE,
-    ACT_ESCAPE,
-    ACT_COUNT
-} action_type;
+    BLIT_KERNEL_SCALAR,
+    BLIT_KERNEL_SSE2,
+    BLIT_KERNEL_AVX2,
+    BLIT_KERNEL_COUNT
+} blit_kernel_type;
 
 typedef struct
-action
+blit_kernels
 {
-    action_type Type;
-    int Dx, Dy;
-} action;
+    char *Name;
+    blit_copy_row *CopyRow;
+    blit_mono_row *MonoRow;
+    blit_cell_row *CellRow;
+    blit_blend_row *BlendRow;
+    blit_modulate_row *ModulateRow;
+    blit_expand_row *ExpandRow;
+    blit_expand_row8 *ExpandRow8;
+} blit_kernels;
 
-typedef struct
-entity
+void
+BlitCopyRowScalar(u32 *Dest, u32 *Src, uint Count)
 {
-    int Alive;
-    int RenderType;
-    int X, Y;
-    u32 Color;
-} entity;
+    for(uint X = 0; X < Count; ++X)
+    {
+        Dest[X] = Src[X];
+    }
+}
 
-#define MAX_ENTITIES 100
-entity Entities[MAX_ENTITIES];
-uint EntityCount;
+void
+BlitMonoRowScalar(u32 *Dest, u32 *Src, uint Count, u32 Color)
+{
+    for(uint X = 0; X < Count; ++X)
+    {
+        if((Src[X] & 0xffffff) == 0xffffff)
+        {
+            Dest[X] = Color;
+        }
+    }
+}
 
-entity *
-CreateEntity()
+/* White source pixels become Fg and all others Bg, so every destination
+   pixel is written exactly once. Adding 1 carries out of the low 24 bits
+   only for white; the all-ones mask from that test picks Fg without a
+   branch, so the loop stays as cheap as the vector kernels' blend. */
+void
+BlitCellRowScalar(u32 *Dest, u32 *Src, uint Count, u32 Fg, u32 Bg)
 {
-    if(EntityCount >= MAX_ENTITIES)
+    for(uint X = 0; X < Count; ++X)
     {
-        return(0);
+        u32 M = 0u - (u32)(((Src[X] + 1) & 0xffffff) == 0);
+        Dest[X] = (Fg & M) | (Bg & ~M);
     }
+}
 
-    entity *Entity = &Entities[EntityCount];
-    EntityCount += 1;
+/* Premultiplied "over": Dest = Src + Dest*(255 - SrcAlpha)/255 on all four
+   channels, saturated like the vector kernels. Fully transparent source
+   pixels are skipped and fully opaque ones copied. */
+void
+BlitBlendRowScalar(u32 *Dest, u32 *Src, uint Count)
+{
+    for(uint X = 0; X < Count; ++X)
+    {
+        u32 S = Src[X];
+        u32 InvA = 255 - (S >> 24);
+        if(InvA == 255)
+        {
+            continue;
+        }
 
-    Entity->Alive = 1;
+        if(InvA == 0)
+        {
+            Dest[X] = S;
+            continue;
+        }
 
-    return(Entity);
+        u32 D = Dest[X];
+        u32 Result = 0;
+        for(uint Shift = 0; Shift < 32; Shift += 8)
+        {
+            u32 C = ((S >> Shift) & 0xff) + MulDiv255((D >> Shift) & 0xff, InvA);
+            Result |= ((C > 255) ? 255 : C) << Shift;
+        }
+        Dest[X] = Result;
+    }
 }
 
+/* Dest = Src*Light/255 for each of the four bytes of every u32, so a
+   Light of all ones leaves Src unchanged */
 void
-MoveEntity(entity *Entity, int Dx, int Dy)
+BlitModulateRowScalar(u32 *Dest, u32 *Src, u32 *Light, uint Count)
 {
-    Entity->X += Dx;
-    Entity->Y += Dy;
+    for(uint X = 0; X < Count; ++X)
+    {
+        u32 Result = 0;
+        for(uint Shift = 0; Shift < 32; Shift += 8)
+        {
+            Result |= MulDiv255((Src[X] >> Shift) & 0xff, (Light[X] >> Shift) & 0xff) << Shift;
+        }
+        Dest[X] = Result;
+    }
 }
 
+/* Bit X of Bits selects Fg (set) or Bg (clear) for pixel X */
 void
-DrawEntity(entity *Entity)
+BlitExpandRowScalar(u32 *Dest, u32 Bits, uint Count, u32 Fg, u32 Bg)
 {
-    if(Entity->RenderType >= 0 && Entity->RenderType < 256)
+    u32 Xor = Fg ^ Bg;
+    for(uint X = 0; X < Count; ++X)
     {
-        DrawChar(
-            Entity->RenderType,
-            (uint)Entity->X, (uint)Entity->Y,
-            Entity->Color);
+        u32 Mask = 0 - ((Bits >> X) & 1);
+        Dest[X] = Bg ^ (Xor & Mask);
     }
 }
 
-#include <windows.h>
+void
+BlitExpandRow8Scalar(u8 *Dest, u32 Bits, uint Count, u8 Fg, u8 Bg)
+{
+    u8 Xor = (u8)(Fg ^ Bg);
+    for(uint X = 0; X < Count; ++X)
+    {
+        u8 Mask = (u8)(0 - ((Bits >> X) & 1));
+        Dest[X] = (u8)(Bg ^ (Xor & Mask));
+    }
+}
 
-int GameIsRunning;
+void
+BlitCopyRowSse2(u32 *Dest, u32 *Src, uint Count)
+{
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
+    {
+        _mm_storeu_si128((__m128i *)(Dest + X), _mm_loadu_si128((__m128i *)(Src + X)));
+    }
+
+    BlitCopyRowScalar(Dest + X, Src + X, Count - X);
+}
 
 void
-main(void)
+BlitMonoRowSse2(u32 *Dest, u32 *Src, uint Count, u32 Color)
 {
-    Ez.Display.Name = "r0gu3";
-    Ez.Display.Width = FONT_SIZE*SCREEN_WIDTH;
-    Ez.Display.Height = FONT_SIZE*SCREEN_HEIGHT;
-    Ez.Display.Pixels = (void *)BackBuffer;
-    Ez.Display.RenderingType = EZ_RENDERING_SOFTWARE;
-    Ez.Display.PixelFormat = EZ_PIXEL_FORMAT_ARGB;
+    __m128i White = _mm_set1_epi32(0xffffff);
+    __m128i Fg = _mm_set1_epi32((int)Color);
 
-    if(!EzInitialize(&Ez))
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
     {
-        ExitProcess(1);
+        __m128i S = _mm_loadu_si128((__m128i *)(Src + X));
+        __m128i D = _mm_loadu_si128((__m128i *)(Dest + X));
+        __m128i Mask = _mm_cmpeq_epi32(_mm_and_si128(S, White), White);
+        D = _mm_or_si128(_mm_and_si128(Mask, Fg), _mm_andnot_si128(Mask, D));
+        _mm_storeu_si128((__m128i *)(Dest + X), D);
     }
 
-    entity *Player = CreateEntity();
-    Player->RenderType = '@';
-    Player->Color = 0xffffff;
-    Player->X = SCREEN_WIDTH/2;
-    Player->Y = SCREEN_HEIGHT/2;
+    BlitMonoRowScalar(Dest + X, Src + X, Count - X, Color);
+}
 
-    entity *Npc = CreateEntity();
-    Npc->RenderType = 'M';
-    Npc->Color = 0xff0000;
-    Npc->X = SCREEN_WIDTH/2 - 5;
-    Npc->Y = SCREEN_HEIGHT/2 - 3;
+void
+BlitCellRowSse2(u32 *Dest, u32 *Src, uint Count, u32 Fg, u32 Bg)
+{
+    __m128i White = _mm_set1_epi32(0xffffff);
+    __m128i FgV = _mm_set1_epi32((int)Fg);
+    __m128i BgV = _mm_set1_epi32((int)Bg);
 
-    FontImage = LoadImagePng("res/font16x16.png");
-    GameIsRunning = 1;
-    while(GameIsRunning && Ez.Running)
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
     {
-        EzUpdate(&Ez);
+        __m128i S = _mm_loadu_si128((__m128i *)(Src + X));
+        __m128i Mask = _mm_cmpeq_epi32(_mm_and_si128(S, White), White);
+        __m128i D = _mm_or_si128(_mm_and_si128(Mask, FgV), _mm_andnot_si128(Mask, BgV));
+        _mm_storeu_si128((__m128i *)(Dest + X), D);
+    }
 
-        /* Input */
-        action Action = {0};
-        if(Ez.Input.Keys[EZ_KEY_UP].Pressed)
-        {
-            Action.Type = ACT_MOVE;
-            Action.Dx = 0;
-            Action.Dy = -1;
-        }
-        else if(Ez.Input.Keys[EZ_KEY_DOWN].Pressed)
+    BlitCellRowScalar(Dest + X, Src + X, Count - X, Fg, Bg);
+}
+
+/* Two pixels unpacked to 16 bits per channel, times the broadcast inverse
+   alpha, divided by 255 with rounding */
+__m128i
+BlendScaleSse2(__m128i D16, __m128i S16)
+{
+    __m128i A = _mm_shufflehi_epi16(_mm_shufflelo_epi16(S16, 0xff), 0xff);
+    __m128i T = _mm_mullo_epi16(D16, _mm_sub_epi16(_mm_set1_epi16(255), A));
+    T = _mm_add_epi16(T, _mm_set1_epi16(128));
+    return(_mm_srli_epi16(_mm_add_epi16(T, _mm_srli_epi16(T, 8)), 8));
+}
+
+void
+BlitBlendRowSse2(u32 *Dest, u32 *Src, uint Count)
+{
+    __m128i Zero = _mm_setzero_si128();
+    __m128i AlphaMask = _mm_set1_epi32((int)0xff000000);
+
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
+    {
+        __m128i S = _mm_loadu_si128((__m128i *)(Src + X));
+        __m128i A = _mm_and_si128(S, AlphaMask);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(A, Zero)) == 0xffff)
+        {
+            continue;
+        }
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(A, AlphaMask)) == 0xffff)
+        {
+            _mm_storeu_si128((__m128i *)(Dest + X), S);
+            continue;
+        }
+
+        __m128i D = _mm_loadu_si128((__m128i *)(Dest + X));
+        __m128i Lo = BlendScaleSse2(_mm_unpacklo_epi8(D, Zero), _mm_unpacklo_epi8(S, Zero));
+        __m128i Hi = BlendScaleSse2(_mm_unpackhi_epi8(D, Zero), _mm_unpackhi_epi8(S, Zero));
+        _mm_storeu_si128((__m128i *)(Dest + X), _mm_adds_epu8(S, _mm_packus_epi16(Lo, Hi)));
+    }
+
+    BlitBlendRowScalar(Dest + X, Src + X, Count - X);
+}
+
+/* 16 bit products of two unpacked vectors, divided by 255 with rounding */
+__m128i
+MulDiv255Sse2(__m128i A16, __m128i B16)
+{
+    __m128i T = _mm_add_epi16(_mm_mullo_epi16(A16, B16), _mm_set1_epi16(128));
+    return(_mm_srli_epi16(_mm_add_epi16(T, _mm_srli_epi16(T, 8)), 8));
+}
+
+void
+BlitModulateRowSse2(u32 *Dest, u32 *Src, u32 *Light, uint Count)
+{
+    __m128i Zero = _mm_setzero_si128();
+
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
+    {
+        __m128i S = _mm_loadu_si128((__m128i *)(Src + X));
+        __m128i L = _mm_loadu_si128((__m128i *)(Light + X));
+        __m128i Lo = MulDiv255Sse2(_mm_unpacklo_epi8(S, Zero), _mm_unpacklo_epi8(L, Zero));
+        __m128i Hi = MulDiv255Sse2(_mm_unpackhi_epi8(S, Zero), _mm_unpackhi_epi8(L, Zero));
+        _mm_storeu_si128((__m128i *)(Dest + X), _mm_packus_epi16(Lo, Hi));
+    }
+
+    BlitModulateRowScalar(Dest + X, Src + X, Light + X, Count - X);
+}
+
+void
+BlitExpandRowSse2(u32 *Dest, u32 Bits, uint Count, u32 Fg, u32 Bg)
+{
+    __m128i Select = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i FgV = _mm_set1_epi32((int)Fg);
+    __m128i BgV = _mm_set1_epi32((int)Bg);
+
+    uint X = 0;
+    for(; X + 4 <= Count; X += 4)
+    {
+        __m128i B = _mm_set1_epi32((int)(Bits >> X));
+        __m128i Mask = _mm_cmpeq_epi32(_mm_and_si128(B, Select), Select);
+        __m128i D = _mm_or_si128(_mm_and_si128(Mask, FgV), _mm_andnot_si128(Mask, BgV));
+        _mm_storeu_si128((__m128i *)(Dest + X), D);
+    }
+
+    if(X < Count)
+    {
+        BlitExpandRowScalar(Dest + X, Bits >> X, Count - X, Fg, Bg);
+    }
+}
+
+/* NOTE: A 16 pixel row is a single vector at one byte per pixel, so this
+   one is also used by the AVX2 kernel set */
+void
+BlitExpandRow8Sse2(u8 *Dest, u32 Bits, uint Count, u8 Fg, u8 Bg)
+{
+    __m128i Select = _mm_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, (char)128,
+        1, 2, 4, 8, 16, 32, 64, (char)128);
+    __m128i FgV = _mm_set1_epi8((char)Fg);
+    __m128i BgV = _mm_set1_epi8((char)Bg);
+
+    uint X = 0;
+    for(; X + 16 <= Count; X += 16)
+    {
+        long long Lo = (long long)((Bits >> X) & 0xff)*0x0101010101010101LL;
+        long long Hi = (long long)((Bits >> (X + 8)) & 0xff)*0x0101010101010101LL;
+        __m128i B = _mm_set_epi64x(Hi, Lo);
+        __m128i Mask = _mm_cmpeq_epi8(_mm_and_si128(B, Select), Select);
+        __m128i D = _mm_or_si128(_mm_and_si128(Mask, FgV), _mm_andnot_si128(Mask, BgV));
+        _mm_storeu_si128((__m128i *)(Dest + X), D);
+    }
+
+    if(X < Count)
+    {
+        BlitExpandRow8Scalar(Dest + X, Bits >> X, Count - X, Fg, Bg);
+    }
+}
+
+TARGET_AVX2 void
+BlitCopyRowAvx2(u32 *Dest, u32 *Src, uint Count)
+{
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_loadu_si256((__m256i *)(Src + X)));
+    }
+
+    /* NOTE: Avoid the AVX-SSE transition penalty on the way out */
+    _mm256_zeroupper();
+    BlitCopyRowSse2(Dest + X, Src + X, Count - X);
+}
+
+TARGET_AVX2 void
+BlitMonoRowAvx2(u32 *Dest, u32 *Src, uint Count, u32 Color)
+{
+    __m256i White = _mm256_set1_epi32(0xffffff);
+    __m256i Fg = _mm256_set1_epi32((int)Color);
+
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        __m256i S = _mm256_loadu_si256((__m256i *)(Src + X));
+        __m256i D = _mm256_loadu_si256((__m256i *)(Dest + X));
+        __m256i Mask = _mm256_cmpeq_epi32(_mm256_and_si256(S, White), White);
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_blendv_epi8(D, Fg, Mask));
+    }
+
+    /* NOTE: Avoid the AVX-SSE transition penalty on the way out */
+    _mm256_zeroupper();
+    BlitMonoRowSse2(Dest + X, Src + X, Count - X, Color);
+}
+
+TARGET_AVX2 void
+BlitCellRowAvx2(u32 *Dest, u32 *Src, uint Count, u32 Fg, u32 Bg)
+{
+    __m256i White = _mm256_set1_epi32(0xffffff);
+    __m256i FgV = _mm256_set1_epi32((int)Fg);
+    __m256i BgV = _mm256_set1_epi32((int)Bg);
+
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        __m256i S = _mm256_loadu_si256((__m256i *)(Src + X));
+        __m256i Mask = _mm256_cmpeq_epi32(_mm256_and_si256(S, White), White);
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_blendv_epi8(BgV, FgV, Mask));
+    }
+
+    /* NOTE: Avoid the AVX-SSE transition penalty on the way out */
+    _mm256_zeroupper();
+    BlitCellRowSse2(Dest + X, Src + X, Count - X, Fg, Bg);
+}
+
+TARGET_AVX2 __m256i
+BlendScaleAvx2(__m256i D16, __m256i S16)
+{
+    __m256i A = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(S16, 0xff), 0xff);
+    __m256i T = _mm256_mullo_epi16(D16, _mm256_sub_epi16(_mm256_set1_epi16(255), A));
+    T = _mm256_add_epi16(T, _mm256_set1_epi16(128));
+    return(_mm256_srli_epi16(_mm256_add_epi16(T, _mm256_srli_epi16(T, 8)), 8));
+}
+
+TARGET_AVX2 void
+BlitBlendRowAvx2(u32 *Dest, u32 *Src, uint Count)
+{
+    __m256i Zero = _mm256_setzero_si256();
+    __m256i AlphaMask = _mm256_set1_epi32((int)0xff000000);
+
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        __m256i S = _mm256_loadu_si256((__m256i *)(Src + X));
+        __m256i A = _mm256_and_si256(S, AlphaMask);
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(A, Zero)) == -1)
+        {
+            continue;
+        }
+
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(A, AlphaMask)) == -1)
+        {
+            _mm256_storeu_si256((__m256i *)(Dest + X), S);
+            continue;
+        }
+
+        /* NOTE: Unpack and pack both work per 128 bit lane, so the pixel
+           order comes back out unchanged */
+        __m256i D = _mm256_loadu_si256((__m256i *)(Dest + X));
+        __m256i Lo = BlendScaleAvx2(_mm256_unpacklo_epi8(D, Zero), _mm256_unpacklo_epi8(S, Zero));
+        __m256i Hi = BlendScaleAvx2(_mm256_unpackhi_epi8(D, Zero), _mm256_unpackhi_epi8(S, Zero));
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_adds_epu8(S, _mm256_packus_epi16(Lo, Hi)));
+    }
+
+    /* NOTE: Avoid the AVX-SSE transition penalty on the way out */
+    _mm256_zeroupper();
+    BlitBlendRowSse2(Dest + X, Src + X, Count - X);
+}
+
+TARGET_AVX2 void
+BlitModulateRowAvx2(u32 *Dest, u32 *Src, u32 *Light, uint Count)
+{
+    __m256i Zero = _mm256_setzero_si256();
+    __m256i Round = _mm256_set1_epi16(128);
+
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        __m256i S = _mm256_loadu_si256((__m256i *)(Src + X));
+        __m256i L = _mm256_loadu_si256((__m256i *)(Light + X));
+        __m256i Lo = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(S, Zero), _mm256_unpacklo_epi8(L, Zero)), Round);
+        __m256i Hi = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(S, Zero), _mm256_unpackhi_epi8(L, Zero)), Round);
+        Lo = _mm256_srli_epi16(_mm256_add_epi16(Lo, _mm256_srli_epi16(Lo, 8)), 8);
+        Hi = _mm256_srli_epi16(_mm256_add_epi16(Hi, _mm256_srli_epi16(Hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_packus_epi16(Lo, Hi));
+    }
+
+    /* NOTE: Avoid the AVX-SSE transition penalty on the way out */
+    _mm256_zeroupper();
+    BlitModulateRowSse2(Dest + X, Src + X, Light + X, Count - X);
+}
+
+TARGET_AVX2 void
+BlitExpandRowAvx2(u32 *Dest, u32 Bits, uint Count, u32 Fg, u32 Bg)
+{
+    __m256i Select = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i FgV = _mm256_set1_epi32((int)Fg);
+    __m256i BgV = _mm256_set1_epi32((int)Bg);
+
+    uint X = 0;
+    for(; X + 8 <= Count; X += 8)
+    {
+        __m256i B = _mm256_set1_epi32((int)(Bits >> X));
+        __m256i Mask = _mm256_cmpeq_epi32(_mm256_and_si256(B, Select), Select);
+        _mm256_storeu_si256((__m256i *)(Dest + X), _mm256_blendv_epi8(BgV, FgV, Mask));
+    }
+
+    _mm256_zeroupper();
+    if(X < Count)
+    {
+        BlitExpandRowSse2(Dest + X, Bits >> X, Count - X, Fg, Bg);
+    }
+}
+
+blit_kernels BlitKernelTable[BLIT_KERNEL_COUNT] = {
+    { "scalar", BlitCopyRowScalar, BlitMonoRowScalar, BlitCellRowScalar, BlitBlendRowScalar, BlitModulateRowScalar, BlitExpandRowScalar, BlitExpandRow8Scalar },
+    { "sse2",   BlitCopyRowSse2,   BlitMonoRowSse2,   BlitCellRowSse2,   BlitBlendRowSse2,   BlitModulateRowSse2,   BlitExpandRowSse2,   BlitExpandRow8Sse2 },
+    { "avx2",   BlitCopyRowAvx2,   BlitMonoRowAvx2,   BlitCellRowAvx2,   BlitBlendRowAvx2,   BlitModulateRowAvx2,   BlitExpandRowAvx2,   BlitExpandRow8Sse2 },
+};
+
+blit_kernels Blit = { "scalar", BlitCopyRowScalar, BlitMonoRowScalar, BlitCellRowScalar, BlitBlendRowScalar, BlitModulateRowScalar, BlitExpandRowScalar, BlitExpandRow8Scalar };
+
+int
+CpuSupportsBlitKernel(blit_kernel_type Type)
+{
+    u32 Regs[4];
+
+    switch(Type)
+    {
+        case BLIT_KERNEL_SCALAR:
+        {
+            return(1);
+        } break;
+
+        case BLIT_KERNEL_SSE2:
+        {
+            CpuId(1, 0, Regs);
+            return((Regs[3] & (1 << 26)) != 0);
+        } break;
+
+        case BLIT_KERNEL_AVX2:
+        {
+            CpuId(0, 0, Regs);
+            if(Regs[0] < 7)
+            {
+                return(0);
+            }
+
+            /* The OS has to save the YMM registers (OSXSAVE + XCR0) */
+            CpuId(1, 0, Regs);
+            if(!(Regs[2] & (1 << 27)) || !(Regs[2] & (1 << 28)))
+            {
+                return(0);
+            }
+
+            if((XGetBv0() & 0x6) != 0x6)
+            {
+                return(0);
+            }
+
+            CpuId(7, 0, Regs);
+            return((Regs[1] & (1 << 5)) != 0);
+        } break;
+
+        default: break;
+    }
+
+    return(0);
+}
+
+void
+SetBlitKernel(blit_kernel_type Type)
+{
+    if(Type < BLIT_KERNEL_COUNT && CpuSupportsBlitKernel(Type))
+    {
+        Blit = BlitKernelTable[Type];
+    }
+}
+
+void
+InitBlitKernels(void)
+{
+    for(int Type = BLIT_KERNEL_COUNT - 1;
+        Type >= 0;
+        --Type)
+    {
+        if(CpuSupportsBlitKernel((blit_kernel_type)Type))
+        {
+            Blit = BlitKernelTable[Type];
+            break;
+        }
+    }
+}
+
+/* Clips the source rectangle against the image and the destination
+   against BackBuffer. Returns 0 if nothing is left to draw. */
+int
+ClipBlit(image Image, uint SrcX, uint SrcY, uint *SrcW, uint *SrcH, uint DestX, uint DestY)
+{
+    if( !Image.Pixels ||
+        SrcX >= Image.Width || SrcY >= Image.Height ||
+        DestX >= BufferWidth || DestY >= BufferHeight)
+    {
+        return(0);
+    }
+
+    if(*SrcW > Image.Width - SrcX)
+    {
+        *SrcW = Image.Width - SrcX;
+    }
+
+    if(*SrcW > BufferWidth - DestX)
+    {
+        *SrcW = BufferWidth - DestX;
+    }
+
+    if(*SrcH > Image.Height - SrcY)
+    {
+        *SrcH = Image.Height - SrcY;
+    }
+
+    if(*SrcH > BufferHeight - DestY)
+    {
+        *SrcH = BufferHeight - DestY;
+    }
+
+    return(*SrcW > 0 && *SrcH > 0);
+}
+
+void
+DrawImageRaw(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    u32 *Src = (u32 *)Image.Pixels + SrcY*Image.Width + SrcX;
+
+    if(Palette.Enabled)
+    {
+        /* NOTE: Arbitrary images go through the color map pixel by pixel */
+        u8 *Dest8 = IndexBuffer + DestY*BufferWidth + DestX;
+        for(uint Y = 0; Y < SrcH; ++Y)
+        {
+            for(uint X = 0; X < SrcW; ++X)
+            {
+                Dest8[X] = PaletteIndexOf(Src[X]);
+            }
+            Src += Image.Width;
+            Dest8 += BufferWidth;
+        }
+
+        return;
+    }
+
+    u32 *Dest = BackBuffer + DestY*BufferWidth + DestX;
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        Blit.CopyRow(Dest, Src, SrcW);
+        Src += Image.Width;
+        Dest += BufferWidth;
+    }
+}
+
+void
+DrawImage(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    PaletteMarkDrawn();
+    DrawImageRaw(Image, SrcX, SrcY, SrcW, SrcH, DestX, DestY);
+}
+
+/* NOTE: The vector kernels store whole rows, so every pixel of the clipped
+   rectangle counts as written even where the mask kept the destination */
+void
+DrawImageMonoRaw(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Color)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    u32 *Src = (u32 *)Image.Pixels + SrcY*Image.Width + SrcX;
+
+    if(Palette.Enabled)
+    {
+        u8 ColorIndex = PaletteIndexOf(Color);
+        u8 *Dest8 = IndexBuffer + DestY*BufferWidth + DestX;
+        for(uint Y = 0; Y < SrcH; ++Y)
+        {
+            for(uint X = 0; X < SrcW; ++X)
+            {
+                if((Src[X] & 0xffffff) == 0xffffff)
+                {
+                    Dest8[X] = ColorIndex;
+                }
+            }
+            Src += Image.Width;
+            Dest8 += BufferWidth;
+        }
+
+        return;
+    }
+
+    u32 *Dest = BackBuffer + DestY*BufferWidth + DestX;
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        Blit.MonoRow(Dest, Src, SrcW, Color);
+        Src += Image.Width;
+        Dest += BufferWidth;
+    }
+}
+
+void
+DrawImageMono(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Color)
+{
+    PaletteMarkDrawn();
+    DrawImageMonoRaw(Image, SrcX, SrcY, SrcW, SrcH, DestX, DestY, Color);
+}
+
+/* Fused DrawImageMono over a FillRect of Bg: white source pixels become
+   Fg and everything else Bg, one write per pixel and no pre-clear */
+void
+DrawImageCellRaw(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Fg, u32 Bg)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    u32 *Src = (u32 *)Image.Pixels + SrcY*Image.Width + SrcX;
+
+    if(Palette.Enabled)
+    {
+        u8 FgIndex = PaletteIndexOf(Fg);
+        u8 BgIndex = PaletteIndexOf(Bg);
+        u8 Xor = (u8)(FgIndex ^ BgIndex);
+        u8 *Dest8 = IndexBuffer + DestY*BufferWidth + DestX;
+        for(uint Y = 0; Y < SrcH; ++Y)
+        {
+            for(uint X = 0; X < SrcW; ++X)
+            {
+                u8 Mask = (u8)(0 - ((Src[X] & 0xffffff) == 0xffffff));
+                Dest8[X] = (u8)(BgIndex ^ (Xor & Mask));
+            }
+            Src += Image.Width;
+            Dest8 += BufferWidth;
+        }
+
+        return;
+    }
+
+    u32 *Dest = BackBuffer + DestY*BufferWidth + DestX;
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        Blit.CellRow(Dest, Src, SrcW, Fg, Bg);
+        Src += Image.Width;
+        Dest += BufferWidth;
+    }
+}
+
+void
+DrawImageCell(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Fg, u32 Bg)
+{
+    PaletteMarkDrawn();
+    DrawImageCellRaw(Image, SrcX, SrcY, SrcW, SrcH, DestX, DestY, Fg, Bg);
+}
+
+/* Alpha blends a premultiplied image (see PremultiplyImage) over
+   BackBuffer */
+void
+DrawImageBlendRaw(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    u32 *Src = (u32 *)Image.Pixels + SrcY*Image.Width + SrcX;
+
+    if(Palette.Enabled)
+    {
+        /* NOTE: Rows are expanded to the colors their indices show,
+           blended with the kernel and mapped back to the nearest shown
+           color through a direct-mapped cache local to this call, so
+           nothing is registered and the render threads can run it */
+        u32 Row[MAX_BUFFER_WIDTH];
+        u32 CacheColors[PALETTE_BLEND_CACHE_SLOTS];
+        u16 CacheIndices[PALETTE_BLEND_CACHE_SLOTS] = {0};
+
+        u8 *Dest8 = IndexBuffer + DestY*BufferWidth + DestX;
+        for(uint Y = 0; Y < SrcH; ++Y)
+        {
+            for(uint X = 0; X < SrcW; ++X)
+            {
+                Row[X] = Palette.Colors[Dest8[X]];
+            }
+
+            Blit.BlendRow(Row, Src, SrcW);
+
+            for(uint X = 0; X < SrcW; ++X)
+            {
+                u32 Color = Row[X];
+                uint Slot = PaletteHash(Color) & (PALETTE_BLEND_CACHE_SLOTS - 1);
+                if(!CacheIndices[Slot] || CacheColors[Slot] != Color)
+                {
+                    CacheColors[Slot] = Color;
+                    CacheIndices[Slot] = (u16)(PaletteNearest(Palette.Colors, Color) + 1u);
+                }
+                Dest8[X] = (u8)(CacheIndices[Slot] - 1u);
+            }
+
+            Src += Image.Width;
+            Dest8 += BufferWidth;
+        }
+
+        return;
+    }
+
+    u32 *Dest = BackBuffer + DestY*BufferWidth + DestX;
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        Blit.BlendRow(Dest, Src, SrcW);
+        Src += Image.Width;
+        Dest += BufferWidth;
+    }
+}
+
+void
+DrawImageBlend(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    PaletteMarkDrawn();
+    DrawImageBlendRaw(Image, SrcX, SrcY, SrcW, SrcH, DestX, DestY);
+}
+
+/*
+ * Font
+ *
+ * The font atlas (16x16 glyphs of GlyphSize x GlyphSize pixels) is only
+ * read once at startup and packed into one bit per pixel, GlyphSize rows
+ * of u32 per glyph. Bit X of a row is set when pixel X of that row is
+ * white in the atlas. The glyph size is taken from the atlas, so any of
+ * the sizes in GlyphBlitterTable can be loaded without a rebuild.
+ */
+
+typedef struct
+font
+{
+    int Loaded;
+    u32 Rows[256][MAX_GLYPH_SIZE];
+} font;
+
+font Font;
+
+/* Rows of the blank cell drawn for glyphs outside the font */
+u32 BlankGlyphRows[MAX_GLYPH_SIZE];
+
+/*
+ * Glyph blitters
+ *
+ * Opaque glyph cells are the bulk of what gets drawn, so for every
+ * supported glyph size there is a pair of blitters: Rasterize expands the
+ * packed rows of a glyph to Fg/Bg pixels and CopyTile copies a cached
+ * Size x Size tile. The pair matching the loaded font is picked by
+ * SelectGlyphBlitters.
+ *
+ * Up to 16 pixels the row loop is fully unrolled and the column loop is a
+ * compile-time count of 4 pixel vectors. At 24 and 32 the unrolled body
+ * got slower than RasterizeGlyphRows, the generic version on top of the
+ * Blit kernels (AVX2 where the CPU has it), so those sizes use it.
+ *
+ * NOTE: The unrolled blitters only use SSE2, which every x64 CPU has.
+ */
+
+typedef void glyph_rasterize(u32 *Dest, uint Pitch, u32 *Rows, u32 Fg, u32 Bg);
+typedef void glyph_copy_tile(u32 *Dest, uint Pitch, u32 *Tile);
+
+typedef struct
+glyph_blitters
+{
+    uint Size;
+    glyph_rasterize *Rasterize;
+    glyph_copy_tile *CopyTile;
+    int Unrolled;
+} glyph_blitters;
+
+void
+RasterizeGlyphRows(u32 *Dest, uint Pitch, u32 *Rows, uint Size, u32 Fg, u32 Bg)
+{
+    for(uint Y = 0; Y < Size; ++Y)
+    {
+        Blit.ExpandRow(Dest, Rows[Y], Size, Fg, Bg);
+        Dest += Pitch;
+    }
+}
+
+void
+CopyGlyphTileRows(u32 *Dest, uint Pitch, u32 *Tile, uint Size)
+{
+    for(uint Y = 0; Y < Size; ++Y)
+    {
+        Blit.CopyRow(Dest, Tile, Size);
+        Tile += Size;
+        Dest += Pitch;
+    }
+}
+
+#define GLYPH_ROWS_8(Op, Size) \
+    Op(Size, 0) Op(Size, 1) Op(Size, 2) Op(Size, 3) \
+    Op(Size, 4) Op(Size, 5) Op(Size, 6) Op(Size, 7)
+#define GLYPH_ROWS_12(Op, Size) GLYPH_ROWS_8(Op, Size) \
+    Op(Size, 8) Op(Size, 9) Op(Size, 10) Op(Size, 11)
+#define GLYPH_ROWS_16(Op, Size) GLYPH_ROWS_12(Op, Size) \
+    Op(Size, 12) Op(Size, 13) Op(Size, 14) Op(Size, 15)
+
+/* Same select as BlitExpandRowSse2, shifting the row bits down by 4
+   pixels per vector instead of reloading them */
+#define GLYPH_EXPAND_ROW(Size, Row)                                         \
+    {                                                                       \
+        __m128i B = _mm_set1_epi32((int)Rows[Row]);                         \
+        __m128i *D = (__m128i *)(Dest + (Row)*Pitch);                       \
+        for(uint V = 0; V < (Size)/4; ++V)                                  \
+        {                                                                   \
+            __m128i Mask = _mm_cmpeq_epi32(_mm_and_si128(B, Select), Select); \
+            _mm_storeu_si128(D + V,                                         \
+                _mm_or_si128(_mm_and_si128(Mask, FgV), _mm_andnot_si128(Mask, BgV))); \
+            B = _mm_srli_epi32(B, 4);                                       \
+        }                                                                   \
+    }
+
+#define GLYPH_COPY_ROW(Size, Row)                                           \
+    {                                                                       \
+        __m128i *D = (__m128i *)(Dest + (Row)*Pitch);                       \
+        __m128i *S = (__m128i *)(Tile + (Row)*(Size));                      \
+        for(uint V = 0; V < (Size)/4; ++V)                                  \
+        {                                                                   \
+            _mm_storeu_si128(D + V, _mm_loadu_si128(S + V));                \
+        }                                                                   \
+    }
+
+#define DEFINE_GLYPH_BLITTERS(Size)                                         \
+    void                                                                    \
+    GlyphRasterize##Size##x##Size(u32 *Dest, uint Pitch, u32 *Rows, u32 Fg, u32 Bg) \
+    {                                                                       \
+        __m128i Select = _mm_setr_epi32(1, 2, 4, 8);                        \
+        __m128i FgV = _mm_set1_epi32((int)Fg);                              \
+        __m128i BgV = _mm_set1_epi32((int)Bg);                              \
+        GLYPH_ROWS_##Size(GLYPH_EXPAND_ROW, Size)                           \
+    }                                                                       \
+                                                                            \
+    void                                                                    \
+    GlyphCopyTile##Size##x##Size(u32 *Dest, uint Pitch, u32 *Tile)          \
+    {                                                                       \
+        GLYPH_ROWS_##Size(GLYPH_COPY_ROW, Size)                             \
+    }
+
+DEFINE_GLYPH_BLITTERS(8)
+DEFINE_GLYPH_BLITTERS(12)
+DEFINE_GLYPH_BLITTERS(16)
+
+/* The sizes that go through the generic row loops */
+#define DEFINE_GENERIC_GLYPH_BLITTERS(Size)                                 \
+    void                                                                    \
+    GlyphRasterize##Size##x##Size(u32 *Dest, uint Pitch, u32 *Rows, u32 Fg, u32 Bg) \
+    {                                                                       \
+        RasterizeGlyphRows(Dest, Pitch, Rows, Size, Fg, Bg);                \
+    }                                                                       \
+                                                                            \
+    void                                                                    \
+    GlyphCopyTile##Size##x##Size(u32 *Dest, uint Pitch, u32 *Tile)          \
+    {                                                                       \
+        CopyGlyphTileRows(Dest, Pitch, Tile, Size);                         \
+    }
+
+DEFINE_GENERIC_GLYPH_BLITTERS(24)
+DEFINE_GENERIC_GLYPH_BLITTERS(32)
+
+glyph_blitters GlyphBlitterTable[] = {
+    {  8, GlyphRasterize8x8,   GlyphCopyTile8x8,   1 },
+    { 12, GlyphRasterize12x12, GlyphCopyTile12x12, 1 },
+    { 16, GlyphRasterize16x16, GlyphCopyTile16x16, 1 },
+    { 24, GlyphRasterize24x24, GlyphCopyTile24x24, 0 },
+    { 32, GlyphRasterize32x32, GlyphCopyTile32x32, 0 },
+};
+
+#define GLYPH_BLITTER_COUNT (sizeof(GlyphBlitterTable)/sizeof(GlyphBlitterTable[0]))
+
+glyph_blitters GlyphBlit = { 16, GlyphRasterize16x16, GlyphCopyTile16x16, 1 };
+
+/* Returns 0 if there is no specialization for Size */
+int
+SelectGlyphBlitters(uint Size)
+{
+    for(uint Index = 0; Index < GLYPH_BLITTER_COUNT; ++Index)
+    {
+        if(GlyphBlitterTable[Index].Size == Size)
+        {
+            GlyphBlit = GlyphBlitterTable[Index];
+            return(1);
+        }
+    }
+
+    return(0);
+}
+
+/* Makes the window's buffer and IndexBuffer hold Width*Height pixels. They
+   only ever grow, and BackBuffer follows the window's buffer if it was
+   drawing into it. */
+int
+ResizeFrameBuffers(uint Width, uint Height)
+{
+    static size_t Capacity;
+    size_t Count = (size_t)Width*Height;
+
+    if(Count <= Capacity)
+    {
+        return(1);
+    }
+
+    u32 *Pixels = (u32 *)os_memory_alloc(Count*sizeof(u32));
+    u8 *Indices = (u8 *)os_memory_alloc(Count);
+    if(!Pixels || !Indices)
+    {
+        if(Pixels)
+        {
+            os_memory_free(Pixels);
+        }
+        if(Indices)
+        {
+            os_memory_free(Indices);
+        }
+        return(0);
+    }
+
+    if(WindowBackBuffer)
+    {
+        os_memory_free(WindowBackBuffer);
+        os_memory_free(IndexBuffer);
+    }
+
+    if(BackBuffer == WindowBackBuffer)
+    {
+        BackBuffer = Pixels;
+    }
+    WindowBackBuffer = Pixels;
+    IndexBuffer = Indices;
+    Capacity = Count;
+
+    return(1);
+}
+
+/* Atlas is a 16x16 grid of glyphs in EZIMG_FORMAT_MASK1 */
+int
+PackFont(image Atlas)
+{
+    uint Size = Atlas.Width/16;
+    uint Pitch = ezimg_pitch(EZIMG_FORMAT_MASK1, Atlas.Width);
+
+    if( !Atlas.Pixels ||
+        Atlas.Width != Atlas.Height ||
+        Atlas.Width != 16*Size ||
+        !SelectGlyphBlitters(Size) ||
+        !ResizeFrameBuffers(SCREEN_WIDTH*Size, SCREEN_HEIGHT*Size))
+    {
+        return(0);
+    }
+
+    GlyphSize = Size;
+    BufferWidth = SCREEN_WIDTH*Size;
+    BufferHeight = SCREEN_HEIGHT*Size;
+
+    for(uint Glyph = 0; Glyph < 256; ++Glyph)
+    {
+        uint SrcX = (Glyph%16)*Size;
+        uint SrcY = (Glyph/16)*Size;
+
+        for(uint Y = 0; Y < Size; ++Y)
+        {
+            u8 *Src = (u8 *)Atlas.Pixels + (SrcY+Y)*Pitch;
+            u32 Bits = 0;
+            for(uint X = 0; X < Size; ++X)
+            {
+                if(Src[(SrcX+X) >> 3] & (0x80 >> ((SrcX+X) & 7)))
+                {
+                    Bits |= (1u << X);
+                }
+            }
+            Font.Rows[Glyph][Y] = Bits;
+        }
+    }
+
+    Font.Loaded = 1;
+    return(1);
+}
+
+int
+LoadFont(char *FilePath)
+{
+    image Atlas = LoadImagePng(FilePath, EZIMG_FORMAT_MASK1);
+    int Result = PackFont(Atlas);
+
+    if(Atlas.Pixels)
+    {
+        os_memory_free(Atlas.Pixels);
+    }
+
+    return(Result);
+}
+
+/* Draws only the set pixels of a glyph, leaving the rest of the cell as is */
+void
+DrawCharRaw(int CharToDraw, uint X, uint Y, u32 Color)
+{
+    if(CharToDraw < 0 || CharToDraw >= 256 || X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    u32 *Rows = Font.Rows[CharToDraw];
+
+    if(Palette.Enabled)
+    {
+        u8 ColorIndex = PaletteIndexOf(Color);
+        u8 *Dest8 = IndexBuffer + Y*GlyphSize*BufferWidth + X*GlyphSize;
+        for(uint Row = 0; Row < GlyphSize; ++Row)
+        {
+            for(uint Col = 0; Col < GlyphSize; ++Col)
+            {
+                if(Rows[Row] & (1u << Col))
+                {
+                    Dest8[Col] = ColorIndex;
+                }
+            }
+            Dest8 += BufferWidth;
+        }
+
+        return;
+    }
+
+    u32 *Dest = BackBuffer + Y*GlyphSize*BufferWidth + X*GlyphSize;
+    for(uint Row = 0; Row < GlyphSize; ++Row)
+    {
+        for(uint Col = 0; Col < GlyphSize; ++Col)
+        {
+            if(Rows[Row] & (1u << Col))
+            {
+                Dest[Col] = Color;
+            }
+        }
+        Dest += BufferWidth;
+    }
+}
+
+void
+DrawChar(int CharToDraw, uint X, uint Y, u32 Color)
+{
+    PaletteMarkDrawn();
+    DrawCharRaw(CharToDraw, X, Y, Color);
+}
+
+/*
+ * Glyph cache
+ *
+ * Every (glyph, fg, bg) combination is expanded once from Font into a
+ * ready-to-copy GlyphSize x GlyphSize tile, so drawing an opaque glyph cell
+ * is just GlyphSize row copies. Tiles are built lazily and the least
+ * recently used one is evicted when the cache is full. The tiles are
+ * packed in Tiles at the loaded GlyphSize, entry N (1-based) at
+ * (N - 1)*GlyphSize*GlyphSize.
+ *
+ * NOTE: Entry and bucket links are 1-based so that 0 means "none" and a
+ * zero-initialized cache is an empty one.
+ */
+
+#ifndef GLYPH_CACHE_SIZE
+#define GLYPH_CACHE_SIZE 512
+#endif
+#define GLYPH_CACHE_BUCKETS 1024
+
+typedef struct
+glyph_cache_entry
+{
+    u32 Glyph;
+    u32 Fg;
+    u32 Bg;
+
+    uint HashNext;
+    uint LruPrev;
+    uint LruNext;
+} glyph_cache_entry;
+
+typedef struct
+glyph_cache
+{
+    glyph_cache_entry Entries[GLYPH_CACHE_SIZE];
+    u32 Tiles[GLYPH_CACHE_SIZE*MAX_GLYPH_SIZE*MAX_GLYPH_SIZE];
+    uint Buckets[GLYPH_CACHE_BUCKETS];
+    uint Count;
+    uint LruHead;
+    uint LruTail;
+
+    uint Hits;
+    uint Misses;
+    uint Evictions;
+} glyph_cache;
+
+glyph_cache GlyphCache;
+
+uint
+GlyphCacheHash(u32 Glyph, u32 Fg, u32 Bg)
+{
+    u32 Hash = Glyph*0x9e3779b1;
+    Hash = (Hash ^ Fg)*0x85ebca6b;
+    Hash = (Hash ^ Bg)*0xc2b2ae35;
+    Hash ^= Hash >> 16;
+    return(Hash & (GLYPH_CACHE_BUCKETS - 1));
+}
+
+void
+GlyphCacheLruUnlink(uint Index)
+{
+    glyph_cache_entry *Entry = &GlyphCache.Entries[Index - 1];
+
+    if(Entry->LruPrev)
+    {
+        GlyphCache.Entries[Entry->LruPrev - 1].LruNext = Entry->LruNext;
+    }
+    else
+    {
+        GlyphCache.LruHead = Entry->LruNext;
+    }
+
+    if(Entry->LruNext)
+    {
+        GlyphCache.Entries[Entry->LruNext - 1].LruPrev = Entry->LruPrev;
+    }
+    else
+    {
+        GlyphCache.LruTail = Entry->LruPrev;
+    }
+
+    Entry->LruPrev = 0;
+    Entry->LruNext = 0;
+}
+
+void
+GlyphCacheLruPushFront(uint Index)
+{
+    glyph_cache_entry *Entry = &GlyphCache.Entries[Index - 1];
+
+    Entry->LruPrev = 0;
+    Entry->LruNext = GlyphCache.LruHead;
+    if(GlyphCache.LruHead)
+    {
+        GlyphCache.Entries[GlyphCache.LruHead - 1].LruPrev = Index;
+    }
+    GlyphCache.LruHead = Index;
+
+    if(!GlyphCache.LruTail)
+    {
+        GlyphCache.LruTail = Index;
+    }
+}
+
+void
+GlyphCacheRemoveFromBucket(uint Index)
+{
+    glyph_cache_entry *Entry = &GlyphCache.Entries[Index - 1];
+    uint *Link = &GlyphCache.Buckets[GlyphCacheHash(Entry->Glyph, Entry->Fg, Entry->Bg)];
+
+    while(*Link)
+    {
+        if(*Link == Index)
+        {
+            *Link = Entry->HashNext;
+            break;
+        }
+        Link = &GlyphCache.Entries[*Link - 1].HashNext;
+    }
+
+    Entry->HashNext = 0;
+}
+
+/* Writes the whole GlyphSize x GlyphSize cell, Pitch pixels per row */
+void
+RasterizeGlyph(u32 *Pixels, uint Pitch, u32 Glyph, u32 Fg, u32 Bg)
+{
+    GlyphBlit.Rasterize(Pixels, Pitch, (Glyph < 256) ? Font.Rows[Glyph] : BlankGlyphRows, Fg, Bg);
+}
+
+void
+RasterizeGlyph8(u8 *Pixels, uint Pitch, u32 Glyph, u8 Fg, u8 Bg)
+{
+    for(uint Y = 0; Y < GlyphSize; ++Y)
+    {
+        u32 Bits = (Glyph < 256) ? Font.Rows[Glyph][Y] : 0;
+        Blit.ExpandRow8(Pixels, Bits, GlyphSize, Fg, Bg);
+        Pixels += Pitch;
+    }
+}
+
+u32 *
+GlyphCacheTile(uint Index)
+{
+    return(GlyphCache.Tiles + (Index - 1)*GlyphSize*GlyphSize);
+}
+
+u32 *
+GlyphCacheGet(u32 Glyph, u32 Fg, u32 Bg)
+{
+    uint Bucket = GlyphCacheHash(Glyph, Fg, Bg);
+
+    for(uint Index = GlyphCache.Buckets[Bucket];
+        Index;
+        Index = GlyphCache.Entries[Index - 1].HashNext)
+    {
+        glyph_cache_entry *Entry = &GlyphCache.Entries[Index - 1];
+        if(Entry->Glyph == Glyph && Entry->Fg == Fg && Entry->Bg == Bg)
+        {
+            if(GlyphCache.LruHead != Index)
+            {
+                GlyphCacheLruUnlink(Index);
+                GlyphCacheLruPushFront(Index);
+            }
+
+            GlyphCache.Hits += 1;
+            return(GlyphCacheTile(Index));
+        }
+    }
+
+    uint Index;
+    if(GlyphCache.Count < GLYPH_CACHE_SIZE)
+    {
+        GlyphCache.Count += 1;
+        Index = GlyphCache.Count;
+    }
+    else
+    {
+        Index = GlyphCache.LruTail;
+        GlyphCacheLruUnlink(Index);
+        GlyphCacheRemoveFromBucket(Index);
+        GlyphCache.Evictions += 1;
+    }
+
+    glyph_cache_entry *Entry = &GlyphCache.Entries[Index - 1];
+    Entry->Glyph = Glyph;
+    Entry->Fg = Fg;
+    Entry->Bg = Bg;
+    RasterizeGlyph(GlyphCacheTile(Index), GlyphSize, Glyph, Fg, Bg);
+
+    Entry->HashNext = GlyphCache.Buckets[Bucket];
+    GlyphCache.Buckets[Bucket] = Index;
+    GlyphCacheLruPushFront(Index);
+
+    GlyphCache.Misses += 1;
+    return(GlyphCacheTile(Index));
+}
+
+/* Drops every tile, e.g. after a new font has been loaded */
+void
+GlyphCacheReset(void)
+{
+    for(uint Index = 0;
+        Index < GLYPH_CACHE_BUCKETS;
+        ++Index)
+    {
+        GlyphCache.Buckets[Index] = 0;
+    }
+
+    GlyphCache.Count = 0;
+    GlyphCache.LruHead = 0;
+    GlyphCache.LruTail = 0;
+
+    GlyphCache.Hits = 0;
+    GlyphCache.Misses = 0;
+    GlyphCache.Evictions = 0;
+}
+
+void
+CopyGlyphTile(u32 *Dest, u32 *Tile)
+{
+    GlyphBlit.CopyTile(Dest, BufferWidth, Tile);
+}
+
+/* Draws an opaque glyph cell (every pixel is either Fg or Bg) */
+void
+DrawGlyphCell(int CharToDraw, uint X, uint Y, u32 Fg, u32 Bg)
+{
+    if(X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    u32 *Tile = GlyphCacheGet((u32)CharToDraw, Fg, Bg);
+    CopyGlyphTile(BackBuffer + Y*GlyphSize*BufferWidth + X*GlyphSize, Tile);
+}
+
+/*
+ * Console
+ *
+ * The game never draws into BackBuffer directly: it writes glyphs into a
+ * SCREEN_WIDTH x SCREEN_HEIGHT grid of cells and ConsolePresent rasterizes
+ * only the cells that differ from what was presented last frame.
+ *
+ * Once ConsoleSetLight has been called, every cell also has a light (RGB
+ * intensity) and ConsolePresent first multiplies the Fg and Bg of all
+ * cells by it, in a single vector pass over the grid, so Shadow holds lit
+ * colors. The light is kept in the layout of Cells with all ones in the
+ * glyph word, which the multiply leaves as it is: the pass just runs over
+ * Cells and Light as flat arrays of u32.
+ *
+ * Reserved cells (ConsoleReserve) are never drawn, their pixels belong to
+ * whoever reserved them (the minimap).
+ */
+
+typedef struct
+console_cell
+{
+    u32 Glyph;
+    u32 Fg;
+    u32 Bg;
+} console_cell;
+
+typedef struct
+console
+{
+    console_cell Cells[SCREEN_WIDTH*SCREEN_HEIGHT];
+    console_cell Shadow[SCREEN_WIDTH*SCREEN_HEIGHT];
+    u8 Resolve[SCREEN_WIDTH*SCREEN_HEIGHT];
+    int FullRedraw;
+
+    int Lighting;
+    console_cell Light[SCREEN_WIDTH*SCREEN_HEIGHT];
+    console_cell Lit[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+    u8 Reserved[SCREEN_WIDTH*SCREEN_HEIGHT];
+} console;
+
+console Console;
+
+/* Glyphs outside the font are drawn as a space (see PushGlyphCell), and are
+   stored as one so that no cell can hold CONSOLE_STALE_GLYPH */
+u32
+ConsoleGlyph(int Glyph)
+{
+    return((Glyph >= 0 && Glyph < 256) ? (u32)Glyph : ' ');
+}
+
+void
+ConsoleClear(u32 Bg)
+{
+    if(Palette.Enabled)
+    {
+        PaletteIndexOf(0);
+        PaletteIndexOf(Bg);
+    }
+
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+        ++Index)
+    {
+        Console.Cells[Index].Glyph = ' ';
+        Console.Cells[Index].Fg = 0;
+        Console.Cells[Index].Bg = Bg;
+    }
+}
+
+void
+ConsoleSetCell(uint X, uint Y, int Glyph, u32 Fg, u32 Bg)
+{
+    if(X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    if(Palette.Enabled)
+    {
+        PaletteIndexOf(Fg);
+        PaletteIndexOf(Bg);
+    }
+
+    console_cell *Cell = &Console.Cells[Y*SCREEN_WIDTH + X];
+    Cell->Glyph = ConsoleGlyph(Glyph);
+    Cell->Fg = Fg;
+    Cell->Bg = Bg;
+}
+
+void
+ConsolePutChar(uint X, uint Y, int Glyph, u32 Fg)
+{
+    if(X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    if(Palette.Enabled)
+    {
+        PaletteIndexOf(Fg);
+    }
+
+    console_cell *Cell = &Console.Cells[Y*SCREEN_WIDTH + X];
+    Cell->Glyph = ConsoleGlyph(Glyph);
+    Cell->Fg = Fg;
+}
+
+/* Light is 0xRRGGBB, where 0xffffff leaves the colors of the cell as they
+   are and 0 makes it black. The first call turns lighting on with every
+   other cell at full light. */
+void
+ConsoleSetLight(uint X, uint Y, u32 Light)
+{
+    if(X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    if(!Console.Lighting)
+    {
+        console_cell Full = { 0xffffffff, 0xffffffff, 0xffffffff };
+        for(uint Index = 0;
+            Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+            ++Index)
+        {
+            Console.Light[Index] = Full;
+        }
+        Console.Lighting = 1;
+    }
+
+    console_cell *Cell = &Console.Light[Y*SCREEN_WIDTH + X];
+    Cell->Fg = Light | 0xff000000;
+    Cell->Bg = Light | 0xff000000;
+}
+
+/* Forces every cell to be rasterized on the next present (e.g. after
+   something other than the console has drawn into BackBuffer) */
+void
+ConsoleInvalidate(void)
+{
+    Console.FullRedraw = 1;
+}
+
+/* No cell ever has this glyph (see ConsoleGlyph), so a shadow cell holding
+   it is redrawn */
+#define CONSOLE_STALE_GLYPH 0xffffffff
+
+/* Reserves (or with Reserve 0 releases) a rectangle of cells */
+void
+ConsoleReserve(uint X, uint Y, uint Width, uint Height, int Reserve)
+{
+    for(uint Row = Y; Row < Y + Height && Row < SCREEN_HEIGHT; ++Row)
+    {
+        for(uint Column = X; Column < X + Width && Column < SCREEN_WIDTH; ++Column)
+        {
+            Console.Reserved[Row*SCREEN_WIDTH + Column] = (u8)(Reserve != 0);
+            if(!Reserve)
+            {
+                Console.Shadow[Row*SCREEN_WIDTH + Column].Glyph = CONSOLE_STALE_GLYPH;
+            }
+        }
+    }
+}
+
+u32 ScrollScratchRow[MAX_BUFFER_WIDTH];
+
+/* Moves a Width x Height rectangle of u32s inside a buffer of Pitch u32s
+   per row. The source and destination may overlap. */
+void
+MoveRect32(u32 *Base, uint Pitch, uint SrcX, uint SrcY, uint DestX, uint DestY, uint Width, uint Height)
+{
+    for(uint Index = 0; Index < Height; ++Index)
+    {
+        uint Row = (DestY <= SrcY) ? Index : Height - 1 - Index;
+        u32 *Src = Base + (SrcY + Row)*Pitch + SrcX;
+        u32 *Dest = Base + (DestY + Row)*Pitch + DestX;
+
+        /* NOTE: The row kernels copy forwards, which is only safe within
+           a row when moving to the left */
+        if(DestY == SrcY && DestX > SrcX)
+        {
+            Blit.CopyRow(ScrollScratchRow, Src, Width);
+            Blit.CopyRow(Dest, ScrollScratchRow, Width);
+        }
+        else
+        {
+            Blit.CopyRow(Dest, Src, Width);
+        }
+    }
+}
+
+/* Same for BackBuffer, and IndexBuffer in palette mode */
+void
+MoveBackBufferRect(uint SrcX, uint SrcY, uint DestX, uint DestY, uint Width, uint Height)
+{
+    MoveRect32(BackBuffer, BufferWidth, SrcX, SrcY, DestX, DestY, Width, Height);
+
+    if(Palette.Enabled)
+    {
+        for(uint Index = 0; Index < Height; ++Index)
+        {
+            uint Row = (DestY <= SrcY) ? Index : Height - 1 - Index;
+            u8 *Src8 = IndexBuffer + (SrcY + Row)*BufferWidth + SrcX;
+            u8 *Dest8 = IndexBuffer + (DestY + Row)*BufferWidth + DestX;
+            if(Dest8 > Src8)
+            {
+                for(uint X = Width; X > 0; --X)
+                {
+                    Dest8[X - 1] = Src8[X - 1];
+                }
+            }
+            else
+            {
+                for(uint X = 0; X < Width; ++X)
+                {
+                    Dest8[X] = Src8[X];
+                }
+            }
+        }
+    }
+}
+
+/* A scroll by (Dx, Dy) cells keeps a KeptWidth x KeptHeight block of the
+   view, which moves from (SrcX, SrcY) to (DestX, DestY) */
+typedef struct
+scroll
+{
+    uint SrcX, SrcY;
+    uint DestX, DestY;
+    uint KeptWidth, KeptHeight;
+} scroll;
+
+/* Returns 0 if nothing on screen can be kept */
+int
+GetScroll(int Dx, int Dy, scroll *Scroll)
+{
+    if( Dx <= -VIEW_WIDTH || Dx >= VIEW_WIDTH ||
+        Dy <= -VIEW_HEIGHT || Dy >= VIEW_HEIGHT)
+    {
+        return(0);
+    }
+
+    Scroll->SrcX = (Dx > 0) ? (uint)Dx : 0;
+    Scroll->SrcY = (Dy > 0) ? (uint)Dy : 0;
+    Scroll->DestX = (Dx < 0) ? (uint)-Dx : 0;
+    Scroll->DestY = (Dy < 0) ? (uint)-Dy : 0;
+    Scroll->KeptWidth = VIEW_WIDTH - Scroll->SrcX - Scroll->DestX;
+    Scroll->KeptHeight = VIEW_HEIGHT - Scroll->SrcY - Scroll->DestY;
+    return(1);
+}
+
+/* Scrolls the view part of a SCREEN_WIDTH x SCREEN_HEIGHT grid of
+   Words-sized cells and fills the exposed rows and columns with Exposed
+   (0 fills with zeros). The cells outside the view are left alone. */
+void
+ScrollGrid(void *Grid, uint Words, scroll *Scroll, void *Exposed)
+{
+    u32 *Cells = (u32 *)Grid;
+
+    MoveRect32(
+        Cells, SCREEN_WIDTH*Words,
+        Scroll->SrcX*Words, Scroll->SrcY,
+        Scroll->DestX*Words, Scroll->DestY,
+        Scroll->KeptWidth*Words, Scroll->KeptHeight);
+
+    for(uint Y = 0; Y < VIEW_HEIGHT; ++Y)
+    {
+        int RowExposed = (Y < Scroll->DestY || Y >= Scroll->DestY + Scroll->KeptHeight);
+        for(uint X = 0; X < VIEW_WIDTH; ++X)
+        {
+            if(!RowExposed && X == Scroll->DestX)
+            {
+                /* Skip the kept part of the row */
+                X += Scroll->KeptWidth - 1;
+                continue;
+            }
+
+            u32 *Cell = Cells + (Y*SCREEN_WIDTH + X)*Words;
+            for(uint Word = 0; Word < Words; ++Word)
+            {
+                Cell[Word] = Exposed ? ((u32 *)Exposed)[Word] : 0;
+            }
+        }
+    }
+}
+
+/*
+ * The view moved by (Dx, Dy) cells: what is already in the view moves by
+ * (-Dx, -Dy) with a block move of BackBuffer, and the cells and shadow
+ * cells move along with it. Only the exposed rows and columns are left
+ * stale, so the next present rasterizes a strip along the edge instead
+ * of the screen.
+ */
+void
+ConsoleScroll(int Dx, int Dy)
+{
+    scroll Scroll;
+
+    if(!Dx && !Dy)
+    {
+        return;
+    }
+
+    if(!GetScroll(Dx, Dy, &Scroll))
+    {
+        ConsoleInvalidate();
+        return;
+    }
+
+    if(!Console.FullRedraw)
+    {
+        MoveBackBufferRect(
+            Scroll.SrcX*GlyphSize, Scroll.SrcY*GlyphSize,
+            Scroll.DestX*GlyphSize, Scroll.DestY*GlyphSize,
+            Scroll.KeptWidth*GlyphSize, Scroll.KeptHeight*GlyphSize);
+    }
+
+    console_cell Blank = { ' ', 0, 0 };
+    console_cell Stale = { CONSOLE_STALE_GLYPH, 0, 0 };
+    ScrollGrid(Console.Cells, sizeof(console_cell)/4, &Scroll, &Blank);
+    ScrollGrid(Console.Shadow, sizeof(console_cell)/4, &Scroll, &Stale);
+}
+
+/*
+ * Layers
+ *
+ * The game draws into retained cell layers, bottom to top: map, items,
+ * actors, effects and UI. A layer cell either has a glyph, a background,
+ * both or neither (transparent). CompositeLayers stacks the layers into
+ * the console cells, but only where a layer changed since the last
+ * composite: every layer keeps a list of the cells touched since then and
+ * what it looked like at that point, so a monster moving one step only
+ * recomposites the cell it left and the one it entered.
+ */
+
+typedef enum
+layer_type
+{
+    LAYER_MAP,
+    LAYER_ITEMS,
+    LAYER_ACTORS,
+    LAYER_EFFECTS,
+    LAYER_UI,
+    LAYER_COUNT
+} layer_type;
+
+char *LayerNames[LAYER_COUNT] = { "map", "items", "actors", "effects", "ui" };
+
+#define LAYER_CELL_GLYPH 0x1
+#define LAYER_CELL_BG    0x2
+
+/* Only set on composited cells, which then never match and get
+   composited again */
+#define LAYER_CELL_STALE 0x80000000
+
+/* NOTE: Zero is an empty cell */
+typedef struct
+layer_cell
+{
+    u32 Glyph;
+    u32 Fg;
+    u32 Bg;
+    u32 Flags;
+} layer_cell;
+
+typedef struct
+cell_layer
+{
+    layer_cell Cells[SCREEN_WIDTH*SCREEN_HEIGHT];
+    layer_cell Composited[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+    /* Cells touched since the last composite */
+    u16 Dirty[SCREEN_WIDTH*SCREEN_HEIGHT];
+    u8 IsDirty[SCREEN_WIDTH*SCREEN_HEIGHT];
+    uint DirtyCount;
+
+    /* Cells this layer changed in the last composite */
+    uint CompositedCells;
+} cell_layer;
+
+cell_layer Layers[LAYER_COUNT];
+
+int
+LayerCellsAreEqual(layer_cell *A, layer_cell *B)
+{
+    return(A->Flags == B->Flags && A->Glyph == B->Glyph && A->Fg == B->Fg && A->Bg == B->Bg);
+}
+
+void
+LayerMarkDirty(cell_layer *Layer, uint Index)
+{
+    if(!Layer->IsDirty[Index])
+    {
+        Layer->IsDirty[Index] = 1;
+        Layer->Dirty[Layer->DirtyCount++] = (u16)Index;
+    }
+}
+
+void
+LayerWriteCell(layer_type Type, uint X, uint Y, layer_cell Cell)
+{
+    if(Type >= LAYER_COUNT || X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    cell_layer *Layer = &Layers[Type];
+    uint Index = Y*SCREEN_WIDTH + X;
+    if(!LayerCellsAreEqual(&Layer->Cells[Index], &Cell))
+    {
+        Layer->Cells[Index] = Cell;
+        LayerMarkDirty(Layer, Index);
+    }
+}
+
+void
+LayerSetCell(layer_type Type, uint X, uint Y, int Glyph, u32 Fg, u32 Bg)
+{
+    layer_cell Cell = { (u32)Glyph, Fg, Bg, LAYER_CELL_GLYPH | LAYER_CELL_BG };
+    LayerWriteCell(Type, X, Y, Cell);
+}
+
+/* Draws a glyph over whatever background the layers below have */
+void
+LayerPutChar(layer_type Type, uint X, uint Y, int Glyph, u32 Fg)
+{
+    layer_cell Cell = { (u32)Glyph, Fg, 0, LAYER_CELL_GLYPH };
+    LayerWriteCell(Type, X, Y, Cell);
+}
+
+/* Only changes the background, keeping the glyphs of the layers below */
+void
+LayerSetBg(layer_type Type, uint X, uint Y, u32 Bg)
+{
+    layer_cell Cell = { 0, 0, Bg, LAYER_CELL_BG };
+    LayerWriteCell(Type, X, Y, Cell);
+}
+
+void
+LayerClearCell(layer_type Type, uint X, uint Y)
+{
+    layer_cell Empty = {0};
+    LayerWriteCell(Type, X, Y, Empty);
+}
+
+void
+LayerClear(layer_type Type)
+{
+    cell_layer *Layer = &Layers[Type];
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+        ++Index)
+    {
+        if(Layer->Cells[Index].Flags)
+        {
+            Layer->Cells[Index].Flags = 0;
+            Layer->Cells[Index].Glyph = 0;
+            Layer->Cells[Index].Fg = 0;
+            Layer->Cells[Index].Bg = 0;
+            LayerMarkDirty(Layer, Index);
+        }
+    }
+}
+
+void
+LayerMarkStale(cell_layer *Layer, uint Index)
+{
+    Layer->Composited[Index].Flags |= LAYER_CELL_STALE;
+    LayerMarkDirty(Layer, Index);
+}
+
+/* Moves the world layers along with a ConsoleScroll, so that only the
+   exposed strip has to be drawn and composited again. The UI layer stays
+   where it is on screen. */
+void
+LayersScroll(int Dx, int Dy)
+{
+    scroll Scroll;
+
+    if(!Dx && !Dy)
+    {
+        return;
+    }
+
+    if(!GetScroll(Dx, Dy, &Scroll))
+    {
+        for(uint Type = 0; Type < LAYER_UI; ++Type)
+        {
+            LayerClear((layer_type)Type);
+        }
+        return;
+    }
+
+    /* NOTE: The console moved the UI cells in the view along with the
+       rest, so both where they are and where they were moved to have to
+       be composited again */
+    cell_layer *Ui = &Layers[LAYER_UI];
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*VIEW_HEIGHT;
+        ++Index)
+    {
+        if( Index % SCREEN_WIDTH < VIEW_WIDTH &&
+            (Ui->Composited[Index].Flags & (LAYER_CELL_GLYPH | LAYER_CELL_BG)))
+        {
+            int X = (int)(Index % SCREEN_WIDTH) - Dx;
+            int Y = (int)(Index / SCREEN_WIDTH) - Dy;
+            LayerMarkStale(Ui, Index);
+            if(X >= 0 && Y >= 0 && X < VIEW_WIDTH && Y < VIEW_HEIGHT)
+            {
+                LayerMarkStale(Ui, (uint)(Y*SCREEN_WIDTH + X));
+            }
+        }
+    }
+
+    for(uint Type = 0; Type < LAYER_UI; ++Type)
+    {
+        cell_layer *Layer = &Layers[Type];
+
+        /* NOTE: Dirty cells in the view move too, or are dropped if they
+           scrolled out */
+        uint DirtyCount = Layer->DirtyCount;
+        Layer->DirtyCount = 0;
+        for(uint Index = 0; Index < DirtyCount; ++Index)
+        {
+            Layer->IsDirty[Layer->Dirty[Index]] = 0;
+        }
+
+        for(uint Index = 0; Index < DirtyCount; ++Index)
+        {
+            int X = (int)(Layer->Dirty[Index] % SCREEN_WIDTH);
+            int Y = (int)(Layer->Dirty[Index] / SCREEN_WIDTH);
+            if(X < VIEW_WIDTH && Y < VIEW_HEIGHT)
+            {
+                X -= Dx;
+                Y -= Dy;
+                if(X < 0 || Y < 0 || X >= VIEW_WIDTH || Y >= VIEW_HEIGHT)
+                {
+                    continue;
+                }
+            }
+            LayerMarkDirty(Layer, (uint)(Y*SCREEN_WIDTH + X));
+        }
+
+        ScrollGrid(Layer->Cells, sizeof(layer_cell)/4, &Scroll, 0);
+        ScrollGrid(Layer->Composited, sizeof(layer_cell)/4, &Scroll, 0);
+    }
+}
+
+/* Screen cells to restack in the current composite */
+u16 CompositeCells[SCREEN_WIDTH*SCREEN_HEIGHT];
+u8 CompositeCellIsQueued[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+void
+CompositeLayers(void)
+{
+    uint CellCount = 0;
+
+    for(uint Type = 0; Type < LAYER_COUNT; ++Type)
+    {
+        cell_layer *Layer = &Layers[Type];
+        Layer->CompositedCells = 0;
+
+        for(uint Index = 0; Index < Layer->DirtyCount; ++Index)
+        {
+            uint Cell = Layer->Dirty[Index];
+            Layer->IsDirty[Cell] = 0;
+
+            if(LayerCellsAreEqual(&Layer->Cells[Cell], &Layer->Composited[Cell]))
+            {
+                continue;
+            }
+
+            Layer->Composited[Cell] = Layer->Cells[Cell];
+            Layer->CompositedCells += 1;
+
+            if(!CompositeCellIsQueued[Cell])
+            {
+                CompositeCellIsQueued[Cell] = 1;
+                CompositeCells[CellCount++] = (u16)Cell;
+            }
+        }
+
+        Layer->DirtyCount = 0;
+    }
+
+    for(uint Index = 0; Index < CellCount; ++Index)
+    {
+        uint Cell = CompositeCells[Index];
+        CompositeCellIsQueued[Cell] = 0;
+
+        u32 Glyph = ' ';
+        u32 Fg = 0;
+        u32 Bg = 0;
+        for(uint Type = 0; Type < LAYER_COUNT; ++Type)
+        {
+            layer_cell *LayerCell = &Layers[Type].Cells[Cell];
+            if(LayerCell->Flags & LAYER_CELL_BG)
+            {
+                Bg = LayerCell->Bg;
+            }
+            if(LayerCell->Flags & LAYER_CELL_GLYPH)
+            {
+                Glyph = LayerCell->Glyph;
+                Fg = LayerCell->Fg;
+            }
+        }
+
+        ConsoleSetCell(Cell % SCREEN_WIDTH, Cell / SCREEN_WIDTH, (int)Glyph, Fg, Bg);
+    }
+}
+
+/*
+ * Text
+ *
+ * DrawString and DrawTextBox write text into the UI layer. A string is
+ * laid out once into a list of positioned glyphs, which is cached by the
+ * hash of the string and the wrap width, so a panel that shows the same
+ * text every frame costs a lookup and some cell writes. The layer diff
+ * then keeps the cells that did not change from being rasterized again.
+ *
+ * Markup: ^1 to ^9 switch to TextColors[N], ^0 back to the color passed
+ * in and ^^ is a ^. Lines wrap at spaces (words longer than a line are
+ * cut) and \n starts a new line.
+ */
+
+#define TEXT_NO_WRAP 255
+#define TEXT_MAX_LENGTH 512
+#define TEXT_CACHE_SETS 16
+#define TEXT_CACHE_WAYS 4
+
+u32 TextColors[10] = {
+    0x000000, 0xff4040, 0x40ff40, 0xffff40, 0x4080ff,
+    0xff40ff, 0x40ffff, 0xffffff, 0x808080, 0xff8000,
+};
+
+/* A glyph is packed as X | Y << 8 | Glyph << 16 | Color << 24, where
+   Color indexes TextColors and 0 is the default */
+typedef struct
+text_layout
+{
+    u32 Hash;
+    uint Width;
+    uint Length;
+    uint LastUsed;
+
+    uint LineCount;
+    uint GlyphCount;
+    u32 Glyphs[TEXT_MAX_LENGTH];
+
+    char Source[TEXT_MAX_LENGTH];
+} text_layout;
+
+typedef struct
+text_cache
+{
+    text_layout Layouts[TEXT_CACHE_SETS*TEXT_CACHE_WAYS];
+    uint Clock;
+    uint Hits;
+    uint Misses;
+} text_cache;
+
+text_cache TextCache;
+
+u32
+TextColor(u32 Glyph, u32 Default)
+{
+    uint Color = Glyph >> 24;
+    return(Color ? TextColors[Color] : Default);
+}
+
+/* Returns the next character of the string after any color markup, and
+   0 at the end */
+char
+TextNextChar(char **At, u8 *Color)
+{
+    char *Char = *At;
+    while(Char[0] == '^' && Char[1] >= '0' && Char[1] <= '9')
+    {
+        *Color = (u8)(Char[1] - '0');
+        Char += 2;
+    }
+
+    char Result = Char[0];
+    if(Result == '^' && Char[1] == '^')
+    {
+        Char += 1;
+    }
+    if(Result)
+    {
+        Char += 1;
+    }
+
+    *At = Char;
+    return(Result);
+}
+
+uint
+TextWordLength(char *At)
+{
+    uint Length = 0;
+    u8 Color = 0;
+    for(;;)
+    {
+        char Char = TextNextChar(&At, &Color);
+        if(!Char || Char == ' ' || Char == '\n')
+        {
+            break;
+        }
+        Length += 1;
+    }
+
+    return(Length);
+}
+
+void
+LayoutText(text_layout *Layout)
+{
+    uint Width = Layout->Width;
+    uint X = 0;
+    uint Y = 0;
+    u8 Color = 0;
+    int Wrapped = 0;
+
+    Layout->GlyphCount = 0;
+
+    char *At = Layout->Source;
+    while(Y < 256)
+    {
+        char *WordStart = At;
+        char Char = TextNextChar(&At, &Color);
+        if(!Char)
+        {
+            break;
+        }
+
+        if(Char == '\n')
+        {
+            X = 0;
+            Y += 1;
+            Wrapped = 0;
+            continue;
+        }
+
+        if(Char == ' ')
+        {
+            /* NOTE: Spaces that would start a wrapped line are dropped */
+            if(X >= Width)
+            {
+                X = 0;
+                Y += 1;
+                Wrapped = 1;
+            }
+            else if(X > 0 || !Wrapped)
+            {
+                X += 1;
+            }
+            continue;
+        }
+
+        if(X > 0 && X + TextWordLength(WordStart) > Width)
+        {
+            X = 0;
+            Y += 1;
+        }
+
+        At = WordStart;
+        for(;;)
+        {
+            char *CharStart = At;
+            Char = TextNextChar(&At, &Color);
+            if(!Char || Char == ' ' || Char == '\n')
+            {
+                At = CharStart;
+                break;
+            }
+
+            if(X >= Width)
+            {
+                X = 0;
+                Y += 1;
+            }
+
+            if(Y < 256)
+            {
+                Layout->Glyphs[Layout->GlyphCount++] =
+                    X | (Y << 8) | ((u32)(u8)Char << 16) | ((u32)Color << 24);
+            }
+            X += 1;
+        }
+        Wrapped = 0;
+    }
+
+    Layout->LineCount = (Y < 256) ? Y + 1 : 256;
+}
+
+/* Returns the cached layout of String wrapped at Width, laying it out if
+   it is not in the cache. Strings are cut at TEXT_MAX_LENGTH - 1. */
+text_layout *
+GetTextLayout(char *String, uint Width)
+{
+    if(!Width || Width > TEXT_NO_WRAP)
+    {
+        Width = TEXT_NO_WRAP;
+    }
+
+    u32 Hash = 0x811c9dc5 ^ Width;
+    uint Length = 0;
+    while(String[Length] && Length < TEXT_MAX_LENGTH - 1)
+    {
+        Hash = (Hash ^ (u8)String[Length])*0x01000193;
+        Length += 1;
+    }
+
+    text_layout *Set = TextCache.Layouts + (Hash % TEXT_CACHE_SETS)*TEXT_CACHE_WAYS;
+    text_layout *Oldest = Set;
+    TextCache.Clock += 1;
+
+    for(uint Way = 0; Way < TEXT_CACHE_WAYS; ++Way)
+    {
+        text_layout *Layout = &Set[Way];
+        if( Layout->LastUsed &&
+            Layout->Hash == Hash && Layout->Width == Width && Layout->Length == Length)
+        {
+            uint Index = 0;
+            while(Index < Length && Layout->Source[Index] == String[Index])
+            {
+                Index += 1;
+            }
+
+            if(Index == Length)
+            {
+                Layout->LastUsed = TextCache.Clock;
+                TextCache.Hits += 1;
+                return(Layout);
+            }
+        }
+
+        if(Layout->LastUsed < Oldest->LastUsed)
+        {
+            Oldest = Layout;
+        }
+    }
+
+    Oldest->Hash = Hash;
+    Oldest->Width = Width;
+    Oldest->Length = Length;
+    Oldest->LastUsed = TextCache.Clock;
+    for(uint Index = 0; Index < Length; ++Index)
+    {
+        Oldest->Source[Index] = String[Index];
+    }
+    Oldest->Source[Length] = 0;
+
+    LayoutText(Oldest);
+    TextCache.Misses += 1;
+
+    return(Oldest);
+}
+
+/* Draws text over whatever is below it, wrapping only at \n. Returns the
+   number of lines. */
+uint
+DrawString(uint X, uint Y, char *String, u32 Color)
+{
+    text_layout *Layout = GetTextLayout(String, TEXT_NO_WRAP);
+    for(uint Index = 0; Index < Layout->GlyphCount; ++Index)
+    {
+        u32 Glyph = Layout->Glyphs[Index];
+        LayerPutChar(
+            LAYER_UI, X + (Glyph & 0xff), Y + ((Glyph >> 8) & 0xff),
+            (int)((Glyph >> 16) & 0xff), TextColor(Glyph, Color));
+    }
+
+    return(Layout->LineCount);
+}
+
+/* Draws lines [FirstLine, FirstLine + Height) of a laid out text into an
+   opaque Width x Height box, filling the rest of the box with Bg */
+void
+DrawTextLayoutBox(uint X, uint Y, uint Width, uint Height, text_layout *Layout, uint FirstLine, u32 Fg, u32 Bg)
+{
+    for(uint Row = 0; Row < Height; ++Row)
+    {
+        for(uint Column = 0; Column < Width; ++Column)
+        {
+            LayerSetCell(LAYER_UI, X + Column, Y + Row, ' ', Fg, Bg);
+        }
+    }
+
+    /* NOTE: Cells that get a glyph were just set to a space, but a cell
+       that ends up as it was composited is skipped by CompositeLayers */
+    for(uint Index = 0; Index < Layout->GlyphCount; ++Index)
+    {
+        u32 Glyph = Layout->Glyphs[Index];
+        uint Line = (Glyph >> 8) & 0xff;
+        if(Line >= FirstLine && Line < FirstLine + Height && (Glyph & 0xff) < Width)
+        {
+            LayerSetCell(
+                LAYER_UI, X + (Glyph & 0xff), Y + Line - FirstLine,
+                (int)((Glyph >> 16) & 0xff), TextColor(Glyph, Fg), Bg);
+        }
+    }
+}
+
+/* Draws text wrapped to an opaque Width x Height box. Returns the number
+   of lines, which may be more than fit. */
+uint
+DrawTextBox(uint X, uint Y, uint Width, uint Height, char *String, u32 Fg, u32 Bg)
+{
+    text_layout *Layout = GetTextLayout(String, Width);
+    DrawTextLayoutBox(X, Y, Width, Height, Layout, 0, Fg, Bg);
+    return(Layout->LineCount);
+}
+
+/* Moves the rows of an opaque UI panel up by Lines: the pixels, the
+   console cells and the UI layer cells all move together, so afterwards
+   only the rows redrawn at the bottom differ from what is on screen.
+   Every cell of the panel has to be opaque in the UI layer and nothing
+   in it may be waiting to be composited. */
+void
+ScrollPanel(uint X, uint Y, uint Width, uint Height, uint Lines)
+{
+    if(!Lines || Lines >= Height)
+    {
+        return;
+    }
+
+    if(!Console.FullRedraw)
+    {
+        MoveBackBufferRect(
+            X*GlyphSize, (Y + Lines)*GlyphSize,
+            X*GlyphSize, Y*GlyphSize,
+            Width*GlyphSize, (Height - Lines)*GlyphSize);
+    }
+
+    uint ConsoleWords = sizeof(console_cell)/4;
+    uint LayerWords = sizeof(layer_cell)/4;
+    MoveRect32((u32 *)Console.Cells, SCREEN_WIDTH*ConsoleWords,
+        X*ConsoleWords, Y + Lines, X*ConsoleWords, Y, Width*ConsoleWords, Height - Lines);
+    MoveRect32((u32 *)Console.Shadow, SCREEN_WIDTH*ConsoleWords,
+        X*ConsoleWords, Y + Lines, X*ConsoleWords, Y, Width*ConsoleWords, Height - Lines);
+    MoveRect32((u32 *)Layers[LAYER_UI].Cells, SCREEN_WIDTH*LayerWords,
+        X*LayerWords, Y + Lines, X*LayerWords, Y, Width*LayerWords, Height - Lines);
+    MoveRect32((u32 *)Layers[LAYER_UI].Composited, SCREEN_WIDTH*LayerWords,
+        X*LayerWords, Y + Lines, X*LayerWords, Y, Width*LayerWords, Height - Lines);
+}
+
+/*
+ * Message log
+ *
+ * The last MESSAGE_LOG_SIZE messages, newest at the bottom of the box.
+ * When messages were added since the box was last drawn, the panel is
+ * scrolled up by their lines first, so only the new lines are composited
+ * and rasterized.
+ */
+
+#define MESSAGE_LOG_SIZE 64
+#define MESSAGE_MAX_LENGTH 128
+
+typedef struct
+message_log
+{
+    char Messages[MESSAGE_LOG_SIZE][MESSAGE_MAX_LENGTH];
+    uint Count;
+
+    /* What the last DrawMessageLog left on screen */
+    uint DrawnX, DrawnY;
+    uint DrawnWidth, DrawnHeight;
+    uint DrawnCount;
+} message_log;
+
+message_log MessageLog;
+
+void
+LogMessage(char *Message)
+{
+    char *Dest = MessageLog.Messages[MessageLog.Count % MESSAGE_LOG_SIZE];
+    uint Length = 0;
+    while(Message[Length] && Length < MESSAGE_MAX_LENGTH - 1)
+    {
+        Dest[Length] = Message[Length];
+        Length += 1;
+    }
+    Dest[Length] = 0;
+
+    MessageLog.Count += 1;
+}
+
+void
+DrawMessageLog(uint X, uint Y, uint Width, uint Height, u32 Fg, u32 Bg)
+{
+    uint Oldest = (MessageLog.Count > MESSAGE_LOG_SIZE) ? MessageLog.Count - MESSAGE_LOG_SIZE : 0;
+
+    int SameBox =
+        MessageLog.DrawnX == X && MessageLog.DrawnY == Y &&
+        MessageLog.DrawnWidth == Width && MessageLog.DrawnHeight == Height;
+
+    if( SameBox && MessageLog.DrawnCount >= Oldest && !Layers[LAYER_UI].DirtyCount)
+    {
+        uint NewLines = 0;
+        for(uint Message = MessageLog.DrawnCount; Message < MessageLog.Count; ++Message)
+        {
+            NewLines += GetTextLayout(MessageLog.Messages[Message % MESSAGE_LOG_SIZE], Width)->LineCount;
+        }
+
+        ScrollPanel(X, Y, Width, Height, NewLines);
+    }
+
+    /* Newest message at the bottom, going up until the box is full */
+    uint Row = Height;
+    uint Message = MessageLog.Count;
+    while(Row > 0 && Message > Oldest)
+    {
+        Message -= 1;
+        text_layout *Layout = GetTextLayout(MessageLog.Messages[Message % MESSAGE_LOG_SIZE], Width);
+        uint Lines = Layout->LineCount;
+        uint FirstLine = 0;
+        if(Lines > Row)
+        {
+            FirstLine = Lines - Row;
+            Lines = Row;
+        }
+
+        Row -= Lines;
+        DrawTextLayoutBox(X, Y + Row, Width, Lines, Layout, FirstLine, Fg, Bg);
+    }
+
+    for(uint Empty = 0; Empty < Row; ++Empty)
+    {
+        for(uint Column = 0; Column < Width; ++Column)
+        {
+            LayerSetCell(LAYER_UI, X + Column, Y + Empty, ' ', Fg, Bg);
+        }
+    }
+
+    MessageLog.DrawnX = X;
+    MessageLog.DrawnY = Y;
+    MessageLog.DrawnWidth = Width;
+    MessageLog.DrawnHeight = Height;
+    MessageLog.DrawnCount = MessageLog.Count;
+}
+
+/*
+ * Draw commands
+ *
+ * Pixel drawing for a frame is recorded with the Push functions and done
+ * in FlushDrawCommands. The flush drops every command whose cells are all
+ * fully covered by later opaque commands, cuts the rest into one piece
+ * per cell row and runs the pieces row by row (each row in submission
+ * order), so BackBuffer is walked top to bottom once. This is also the
+ * only place where RenderStats are collected.
+ *
+ * Colors are registered with the palette at push time, which leaves only
+ * read-only palette lookups for the render threads.
+ */
+
+typedef enum
+draw_command_type
+{
+    DRAW_GLYPH,      /* Transparent glyph, see DrawChar */
+    DRAW_GLYPH_CELL, /* Opaque glyph cell */
+    DRAW_RECT,
+    DRAW_IMAGE,
+    DRAW_IMAGE_MONO, /* Transparent, see DrawImageMono */
+    DRAW_IMAGE_CELL, /* Opaque, see DrawImageCell */
+    DRAW_IMAGE_BLEND, /* Transparent, see DrawImageBlend */
+} draw_command_type;
+
+typedef struct
+draw_command
+{
+    draw_command_type Type;
+    u32 Glyph;
+    u32 Fg; /* Also the color of rects and mono images */
+    u32 Bg;
+
+    /* Destination in pixels, clipped to the buffer */
+    uint X, Y;
+    uint Width, Height;
+
+    image Image;
+    uint SrcX, SrcY;
+} draw_command;
+
+#define MAX_DRAW_COMMANDS 8192
+#define MAX_DRAW_PIECES (4*MAX_DRAW_COMMANDS)
+
+typedef struct
+draw_commands
+{
+    draw_command Commands[MAX_DRAW_COMMANDS];
+    uint Count;
+    uint PieceCount;
+    uint Submitted;
+
+    /* Set when a full buffer forced a flush in the middle of a frame */
+    int Continued;
+
+    /* 1-based index of the last opaque command covering each cell */
+    uint CoveredBy[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+    /* Command indices bucketed by cell row */
+    uint Pieces[MAX_DRAW_PIECES];
+    uint RowStart[SCREEN_HEIGHT + 1];
+} draw_commands;
+
+draw_commands DrawCommands;
+
+void FlushDrawCommands(void);
+
+int
+DrawCommandIsOpaque(draw_command *Command)
+{
+    return( Command->Type == DRAW_GLYPH_CELL ||
+            Command->Type == DRAW_RECT ||
+            Command->Type == DRAW_IMAGE ||
+            Command->Type == DRAW_IMAGE_CELL);
+}
+
+void
+PushDrawCommand(draw_command *Command)
+{
+    if(!Command->Width || !Command->Height)
+    {
+        return;
+    }
+
+    uint Rows = (Command->Y + Command->Height - 1)/GlyphSize - Command->Y/GlyphSize + 1;
+    if( DrawCommands.Count >= MAX_DRAW_COMMANDS ||
+        DrawCommands.PieceCount + Rows > MAX_DRAW_PIECES)
+    {
+        FlushDrawCommands();
+        DrawCommands.Continued = 1;
+    }
+
+    /* NOTE: Blended images only look colors up, see DrawImageBlend */
+    if(Palette.Enabled && Command->Type != DRAW_IMAGE_BLEND)
+    {
+        if(Command->Type != DRAW_IMAGE)
+        {
+            PaletteIndexOf(Command->Fg);
+        }
+        if(Command->Type == DRAW_GLYPH_CELL || Command->Type == DRAW_IMAGE_CELL)
+        {
+            PaletteIndexOf(Command->Bg);
+        }
+        if(Command->Type == DRAW_IMAGE)
+        {
+            u32 *Src = (u32 *)Command->Image.Pixels + Command->SrcY*Command->Image.Width + Command->SrcX;
+            for(uint Y = 0; Y < Command->Height; ++Y)
+            {
+                for(uint X = 0; X < Command->Width; ++X)
+                {
+                    PaletteIndexOf(Src[X]);
+                }
+                Src += Command->Image.Width;
+            }
+        }
+    }
+
+    DrawCommands.Commands[DrawCommands.Count++] = *Command;
+    DrawCommands.PieceCount += Rows;
+    DrawCommands.Submitted += 1;
+}
+
+void
+PushGlyph(int CharToDraw, uint X, uint Y, u32 Color)
+{
+    if(CharToDraw < 0 || CharToDraw >= 256 || X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_GLYPH;
+    Command.Glyph = (u32)CharToDraw;
+    Command.Fg = Color;
+    Command.X = X*GlyphSize;
+    Command.Y = Y*GlyphSize;
+    Command.Width = GlyphSize;
+    Command.Height = GlyphSize;
+    PushDrawCommand(&Command);
+}
+
+void
+PushGlyphCell(int CharToDraw, uint X, uint Y, u32 Fg, u32 Bg)
+{
+    if(X >= SCREEN_WIDTH || Y >= SCREEN_HEIGHT)
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_GLYPH_CELL;
+    Command.Glyph = (CharToDraw >= 0 && CharToDraw < 256) ? (u32)CharToDraw : ' ';
+    Command.Fg = Fg;
+    Command.Bg = Bg;
+    Command.X = X*GlyphSize;
+    Command.Y = Y*GlyphSize;
+    Command.Width = GlyphSize;
+    Command.Height = GlyphSize;
+    PushDrawCommand(&Command);
+}
+
+void
+PushRect(uint X, uint Y, uint Width, uint Height, u32 Color)
+{
+    if(X >= BufferWidth || Y >= BufferHeight)
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_RECT;
+    Command.Fg = Color;
+    Command.X = X;
+    Command.Y = Y;
+    Command.Width = (Width > BufferWidth - X) ? BufferWidth - X : Width;
+    Command.Height = (Height > BufferHeight - Y) ? BufferHeight - Y : Height;
+    PushDrawCommand(&Command);
+}
+
+void
+PushImage(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_IMAGE;
+    Command.Image = Image;
+    Command.SrcX = SrcX;
+    Command.SrcY = SrcY;
+    Command.X = DestX;
+    Command.Y = DestY;
+    Command.Width = SrcW;
+    Command.Height = SrcH;
+    PushDrawCommand(&Command);
+}
+
+void
+PushImageMono(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Color)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_IMAGE_MONO;
+    Command.Fg = Color;
+    Command.Image = Image;
+    Command.SrcX = SrcX;
+    Command.SrcY = SrcY;
+    Command.X = DestX;
+    Command.Y = DestY;
+    Command.Width = SrcW;
+    Command.Height = SrcH;
+    PushDrawCommand(&Command);
+}
+
+void
+PushImageCell(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Fg, u32 Bg)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_IMAGE_CELL;
+    Command.Fg = Fg;
+    Command.Bg = Bg;
+    Command.Image = Image;
+    Command.SrcX = SrcX;
+    Command.SrcY = SrcY;
+    Command.X = DestX;
+    Command.Y = DestY;
+    Command.Width = SrcW;
+    Command.Height = SrcH;
+    PushDrawCommand(&Command);
+}
+
+void
+PushImageBlend(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    if(!ClipBlit(Image, SrcX, SrcY, &SrcW, &SrcH, DestX, DestY))
+    {
+        return;
+    }
+
+    draw_command Command = {0};
+    Command.Type = DRAW_IMAGE_BLEND;
+    Command.Image = Image;
+    Command.SrcX = SrcX;
+    Command.SrcY = SrcY;
+    Command.X = DestX;
+    Command.Y = DestY;
+    Command.Width = SrcW;
+    Command.Height = SrcH;
+    PushDrawCommand(&Command);
+}
+
+/* Marks the cells an opaque command covers completely, then drops the
+   commands that only touch cells covered by a later one. Surviving
+   commands are bucketed by cell row, keeping submission order in a row.
+   Returns the number of culled commands. */
+uint
+SortDrawCommands(void)
+{
+    draw_commands *Draw = &DrawCommands;
+    uint Culled = 0;
+
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+        ++Index)
+    {
+        Draw->CoveredBy[Index] = 0;
+    }
+
+    for(uint Index = 0; Index < Draw->Count; ++Index)
+    {
+        draw_command *Command = &Draw->Commands[Index];
+        if(!DrawCommandIsOpaque(Command))
+        {
+            continue;
+        }
+
+        uint FirstX = (Command->X + GlyphSize - 1)/GlyphSize;
+        uint FirstY = (Command->Y + GlyphSize - 1)/GlyphSize;
+        uint EndX = (Command->X + Command->Width)/GlyphSize;
+        uint EndY = (Command->Y + Command->Height)/GlyphSize;
+        for(uint Y = FirstY; Y < EndY; ++Y)
+        {
+            for(uint X = FirstX; X < EndX; ++X)
+            {
+                Draw->CoveredBy[Y*SCREEN_WIDTH + X] = Index + 1;
+            }
+        }
+    }
+
+    for(uint Row = 0; Row <= SCREEN_HEIGHT; ++Row)
+    {
+        Draw->RowStart[Row] = 0;
+    }
+
+    for(uint Index = 0; Index < Draw->Count; ++Index)
+    {
+        draw_command *Command = &Draw->Commands[Index];
+        uint FirstX = Command->X/GlyphSize;
+        uint FirstY = Command->Y/GlyphSize;
+        uint LastX = (Command->X + Command->Width - 1)/GlyphSize;
+        uint LastY = (Command->Y + Command->Height - 1)/GlyphSize;
+
+        int Covered = 1;
+        for(uint Y = FirstY; Covered && Y <= LastY; ++Y)
+        {
+            for(uint X = FirstX; X <= LastX; ++X)
+            {
+                if(Draw->CoveredBy[Y*SCREEN_WIDTH + X] <= Index + 1)
+                {
+                    Covered = 0;
+                    break;
+                }
+            }
+        }
+
+        if(Covered)
+        {
+            /* NOTE: Culled commands get an empty height and no pieces */
+            Command->Height = 0;
+            Culled += 1;
+            continue;
+        }
+
+        for(uint Y = FirstY; Y <= LastY; ++Y)
+        {
+            Draw->RowStart[Y + 1] += 1;
+        }
+    }
+
+    for(uint Row = 0; Row < SCREEN_HEIGHT; ++Row)
+    {
+        Draw->RowStart[Row + 1] += Draw->RowStart[Row];
+    }
+
+    /* NOTE: Filling with a moving cursor per row keeps submission order,
+       and the cursors end up at the start of the next row */
+    for(uint Index = 0; Index < Draw->Count; ++Index)
+    {
+        draw_command *Command = &Draw->Commands[Index];
+        if(!Command->Height)
+        {
+            continue;
+        }
+
+        uint FirstY = Command->Y/GlyphSize;
+        uint LastY = (Command->Y + Command->Height - 1)/GlyphSize;
+        for(uint Y = FirstY; Y <= LastY; ++Y)
+        {
+            Draw->Pieces[Draw->RowStart[Y]++] = Index;
+        }
+    }
+
+    for(uint Row = SCREEN_HEIGHT; Row > 0; --Row)
+    {
+        Draw->RowStart[Row] = Draw->RowStart[Row - 1];
+    }
+    Draw->RowStart[0] = 0;
+
+    return(Culled);
+}
+
+/*
+ * Render threads
+ *
+ * FlushDrawCommands splits the cell rows into RenderThreadCount horizontal
+ * bands. Band 0 is executed by the calling thread and band N by worker N,
+ * always, so every band owns its rows of BackBuffer and its own stats:
+ * nothing is shared and nothing needs a lock.
+ *
+ * NOTE: The glyph cache is not thread-safe, so with more than one band the
+ * cells are expanded straight from the packed font. Both paths produce
+ * the same pixels, which keeps frames byte-identical for any thread count.
+ */
+
+#ifndef RENDER_THREADS
+#define RENDER_THREADS 1
+#endif
+#define MAX_RENDER_THREADS 16
+
+typedef struct
+render_band
+{
+    uint FirstRow;
+    uint OnePastLastRow;
+    int UseGlyphCache;
+    render_stats Stats;
+} render_band;
+
+typedef struct
+render_threads
+{
+    uint Count;
+    uint WorkerCount;
+    int BypassGlyphCache;
+    render_band Bands[MAX_RENDER_THREADS];
+    void *StartSemaphores[MAX_RENDER_THREADS];
+    void *DoneSemaphore;
+} render_threads;
+
+render_threads RenderThreads;
+
+/* Draws the part of Command that falls in cell row Row */
+void
+ExecuteDrawPiece(render_band *Band, draw_command *Command, uint Row)
+{
+    uint Top = Row*GlyphSize;
+    uint Bottom = Top + GlyphSize;
+    uint Y = (Command->Y > Top) ? Command->Y : Top;
+    uint EndY = (Command->Y + Command->Height < Bottom) ? Command->Y + Command->Height : Bottom;
+    uint Height = EndY - Y;
+
+    switch(Command->Type)
+    {
+        case DRAW_GLYPH:
+        {
+            DrawCharRaw((int)Command->Glyph, Command->X/GlyphSize, Row, Command->Fg);
+            Band->Stats.CellsDrawn += 1;
+        } break;
+
+        case DRAW_GLYPH_CELL:
+        {
+            uint X = Command->X/GlyphSize;
+            u32 *Dest = BackBuffer + Top*BufferWidth + Command->X;
+            if(Palette.Enabled)
+            {
+                RasterizeGlyph8(
+                    IndexBuffer + Top*BufferWidth + Command->X, BufferWidth,
+                    Command->Glyph, PaletteFind(Command->Fg), PaletteFind(Command->Bg));
+                Console.Resolve[Row*SCREEN_WIDTH + X] = 1;
+            }
+            else if(Band->UseGlyphCache)
+            {
+                CopyGlyphTile(Dest, GlyphCacheGet(Command->Glyph, Command->Fg, Command->Bg));
+            }
+            else
+            {
+                RasterizeGlyph(Dest, BufferWidth, Command->Glyph, Command->Fg, Command->Bg);
+            }
+            Band->Stats.CellsDrawn += 1;
+        } break;
+
+        case DRAW_RECT:
+        {
+            FillRectRaw(Command->X, Y, Command->Width, Height, Command->Fg);
+        } break;
+
+        case DRAW_IMAGE:
+        {
+            DrawImageRaw(
+                Command->Image, Command->SrcX, Command->SrcY + (Y - Command->Y),
+                Command->Width, Height, Command->X, Y);
+        } break;
+
+        case DRAW_IMAGE_MONO:
+        {
+            DrawImageMonoRaw(
+                Command->Image, Command->SrcX, Command->SrcY + (Y - Command->Y),
+                Command->Width, Height, Command->X, Y, Command->Fg);
+        } break;
+
+        case DRAW_IMAGE_CELL:
+        {
+            DrawImageCellRaw(
+                Command->Image, Command->SrcX, Command->SrcY + (Y - Command->Y),
+                Command->Width, Height, Command->X, Y, Command->Fg, Command->Bg);
+        } break;
+
+        case DRAW_IMAGE_BLEND:
+        {
+            DrawImageBlendRaw(
+                Command->Image, Command->SrcX, Command->SrcY + (Y - Command->Y),
+                Command->Width, Height, Command->X, Y);
+        } break;
+    }
+
+    Band->Stats.PixelsWritten += Command->Width*Height;
+    if(Row == Command->Y/GlyphSize)
+    {
+        Band->Stats.CommandsExecuted += 1;
+    }
+}
+
+void
+ExecuteDrawBand(render_band *Band)
+{
+    Band->Stats.CommandsExecuted = 0;
+    Band->Stats.CellsDrawn = 0;
+    Band->Stats.PixelsWritten = 0;
+
+    for(uint Row = Band->FirstRow; Row < Band->OnePastLastRow; ++Row)
+    {
+        for(uint Piece = DrawCommands.RowStart[Row];
+            Piece < DrawCommands.RowStart[Row + 1];
+            ++Piece)
+        {
+            ExecuteDrawPiece(Band, &DrawCommands.Commands[DrawCommands.Pieces[Piece]], Row);
+        }
+    }
+}
+
+void
+RenderWorkerProc(void *Data)
+{
+    uint Index = (uint)(size_t)Data;
+
+    for(;;)
+    {
+        os_semaphore_wait(RenderThreads.StartSemaphores[Index]);
+        ExecuteDrawBand(&RenderThreads.Bands[Index]);
+        os_semaphore_signal(RenderThreads.DoneSemaphore, 1);
+    }
+}
+
+/* Sets how many threads (bands) FlushDrawCommands uses, starting workers
+   as needed. Returns the count actually in effect. */
+uint
+SetRenderThreadCount(uint Count)
+{
+    if(Count < 1)
+    {
+        Count = 1;
+    }
+
+    if(Count > MAX_RENDER_THREADS)
+    {
+        Count = MAX_RENDER_THREADS;
+    }
+
+    if(Count > SCREEN_HEIGHT)
+    {
+        Count = SCREEN_HEIGHT;
+    }
+
+    if(Count > 1 && !RenderThreads.DoneSemaphore)
+    {
+        RenderThreads.DoneSemaphore = os_semaphore_create(0);
+        if(!RenderThreads.DoneSemaphore)
+        {
+            Count = 1;
+        }
+    }
+
+    while(RenderThreads.WorkerCount + 1 < Count)
+    {
+        uint Index = RenderThreads.WorkerCount + 1;
+
+        RenderThreads.StartSemaphores[Index] = os_semaphore_create(0);
+        if(!RenderThreads.StartSemaphores[Index])
+        {
+            break;
+        }
+
+        if(!os_thread_start(RenderWorkerProc, (void *)(size_t)Index))
+        {
+            os_semaphore_destroy(RenderThreads.StartSemaphores[Index]);
+            RenderThreads.StartSemaphores[Index] = 0;
+            break;
+        }
+
+        RenderThreads.WorkerCount += 1;
+    }
+
+    if(Count > RenderThreads.WorkerCount + 1)
+    {
+        Count = RenderThreads.WorkerCount + 1;
+    }
+
+    RenderThreads.Count = Count;
+    return(Count);
+}
+
+void
+FlushDrawCommands(void)
+{
+    if(!DrawCommands.Continued)
+    {
+        render_stats Empty = {0};
+        RenderStats = Empty;
+    }
+    DrawCommands.Continued = 0;
+
+    RenderStats.CommandsSubmitted += DrawCommands.Submitted;
+    RenderStats.CommandsCulled += SortDrawCommands();
+
+    /* Glyph cells mark the cells they resolve, anything else that is drawn
+       in palette mode has the whole IndexBuffer resolved. This is decided
+       here, on the calling thread, since the bands draw at the same time. */
+    if(Palette.Enabled)
+    {
+        for(uint Index = 0; Index < DrawCommands.Count; ++Index)
+        {
+            draw_command *Command = &DrawCommands.Commands[Index];
+            if(Command->Height && Command->Type != DRAW_GLYPH_CELL)
+            {
+                Palette.ResolveAll = 1;
+                break;
+            }
+        }
+    }
+
+    uint Count = RenderThreads.Count;
+    if(Count < 1)
+    {
+        Count = 1;
+    }
+
+    for(uint Index = 0; Index < Count; ++Index)
+    {
+        render_band *Band = &RenderThreads.Bands[Index];
+        Band->FirstRow = Index*SCREEN_HEIGHT/Count;
+        Band->OnePastLastRow = (Index + 1)*SCREEN_HEIGHT/Count;
+        Band->UseGlyphCache = (Count == 1 && !RenderThreads.BypassGlyphCache);
+    }
+
+    for(uint Index = 1; Index < Count; ++Index)
+    {
+        os_semaphore_signal(RenderThreads.StartSemaphores[Index], 1);
+    }
+
+    ExecuteDrawBand(&RenderThreads.Bands[0]);
+
+    for(uint Index = 1; Index < Count; ++Index)
+    {
+        os_semaphore_wait(RenderThreads.DoneSemaphore);
+    }
+
+    for(uint Index = 0; Index < Count; ++Index)
+    {
+        render_stats *Stats = &RenderThreads.Bands[Index].Stats;
+        RenderStats.CommandsExecuted += Stats->CommandsExecuted;
+        RenderStats.CellsDrawn += Stats->CellsDrawn;
+        RenderStats.PixelsWritten += Stats->PixelsWritten;
+    }
+
+    DrawCommands.Count = 0;
+    DrawCommands.PieceCount = 0;
+    DrawCommands.Submitted = 0;
+}
+
+/* Lights the cells, pushes a glyph cell for every cell that differs from
+   what was presented last time and executes the frame */
+void
+ConsolePresent(void)
+{
+    console_cell *Cells = Console.Cells;
+    if(Console.Lighting)
+    {
+        Blit.ModulateRow(
+            (u32 *)Console.Lit, (u32 *)Console.Cells, (u32 *)Console.Light,
+            SCREEN_WIDTH*SCREEN_HEIGHT*sizeof(console_cell)/4);
+        Cells = Console.Lit;
+    }
+
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+        ++Index)
+    {
+        console_cell *Cell = &Cells[Index];
+        console_cell *Shadow = &Console.Shadow[Index];
+
+        if(Console.Reserved[Index])
+        {
+            continue;
+        }
+
+        if( !Console.FullRedraw &&
+            Cell->Glyph == Shadow->Glyph &&
+            Cell->Fg == Shadow->Fg &&
+            Cell->Bg == Shadow->Bg)
+        {
+            continue;
+        }
+
+        PushGlyphCell((int)Cell->Glyph, Index % SCREEN_WIDTH, Index / SCREEN_WIDTH, Cell->Fg, Cell->Bg);
+        *Shadow = *Cell;
+    }
+
+    FlushDrawCommands();
+    Console.FullRedraw = 0;
+}
+
+void
+ResolvePaletteRows(uint FirstPixelRow, uint RowCount, uint FirstPixelColumn, uint ColumnCount)
+{
+    for(uint Y = FirstPixelRow; Y < FirstPixelRow + RowCount; ++Y)
+    {
+        u8 *Src = IndexBuffer + Y*BufferWidth + FirstPixelColumn;
+        u32 *Dest = BackBuffer + Y*BufferWidth + FirstPixelColumn;
+        for(uint X = 0; X < ColumnCount; ++X)
+        {
+            Dest[X] = Palette.Colors[Src[X]];
+        }
+    }
+}
+
+/* Expands IndexBuffer into BackBuffer. Only the cells ConsolePresent drew
+   are expanded, unless the palette or IndexBuffer changed in some other
+   way since the last resolve. Does nothing outside palette mode. */
+void
+ResolvePalette(void)
+{
+    if(!Palette.Enabled)
+    {
+        return;
+    }
+
+    if(Palette.ResolveAll)
+    {
+        ResolvePaletteRows(0, BufferHeight, 0, BufferWidth);
+    }
+    else
+    {
+        for(uint Y = 0; Y < SCREEN_HEIGHT; ++Y)
+        {
+            for(uint X = 0; X < SCREEN_WIDTH; ++X)
+            {
+                if(Console.Resolve[Y*SCREEN_WIDTH + X])
+                {
+                    ResolvePaletteRows(Y*GlyphSize, GlyphSize, X*GlyphSize, GlyphSize);
+                }
+            }
+        }
+    }
+
+    for(uint Index = 0;
+        Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+        ++Index)
+    {
+        Console.Resolve[Index] = 0;
+    }
+
+    Palette.ResolveAll = 0;
+}
+
+void
+SetPaletteMode(int Enabled)
+{
+    Palette.Enabled = Enabled;
+
+    if(Enabled)
+    {
+        for(uint Index = 0;
+            Index < SCREEN_WIDTH*SCREEN_HEIGHT;
+            ++Index)
+        {
+            PaletteIndexOf(Console.Cells[Index].Fg);
+            PaletteIndexOf(Console.Cells[Index].Bg);
+        }
+
+        Palette.ResolveAll = 1;
+    }
+
+    ConsoleInvalidate();
+}
+
+typedef enum
+action_type
+{
+    ACT_NONE,
+    ACT_MOVE,
+    ACT_ESCAPE,
+    ACT_COUNT
+} action_type;
+
+typedef struct
+action
+{
+    action_type Type;
+    int Dx, Dy;
+} action;
+
+/*
+ * Map
+ *
+ * The world is a MAP_WIDTH x MAP_HEIGHT grid of tiles and the view shows
+ * the VIEW_WIDTH x VIEW_HEIGHT part of it starting at Camera.
+ * Entities live in map coordinates.
+ */
+
+#define MAP_WIDTH 256
+#define MAP_HEIGHT 256
+
+typedef enum
+tile_type
+{
+    TILE_FLOOR,
+    TILE_WALL,
+    TILE_COUNT
+} tile_type;
+
+typedef struct
+tile_info
+{
+    int Glyph;
+    u32 Fg;
+    u32 Bg;
+    int Walkable;
+} tile_info;
+
+tile_info TileInfo[TILE_COUNT] = {
+    { '.', 0x404040, 0x000000, 1 },
+    { '#', 0x808080, 0x202020, 0 },
+};
+
+typedef struct
+map
+{
+    u8 Tiles[MAP_WIDTH*MAP_HEIGHT];
+
+    /* Set once a tile has been lit, see UpdateLighting */
+    u8 Explored[MAP_WIDTH*MAP_HEIGHT];
+} map;
+
+map Map;
+
+void MinimapMarkDirty(int X, int Y);
+void MinimapInvalidate(void);
+
+typedef struct
+camera
+{
+    int X, Y;
+} camera;
+
+camera Camera;
+
+/* Walls around the edge plus scattered pillars, the same every run */
+void
+GenerateMap(void)
+{
+    for(uint Y = 0; Y < MAP_HEIGHT; ++Y)
+    {
+        for(uint X = 0; X < MAP_WIDTH; ++X)
+        {
+            u32 Hash = (X*0x9e3779b1) ^ (Y*0x85ebca6b);
+            Hash = (Hash ^ (Hash >> 15))*0xc2b2ae35;
+            Hash ^= Hash >> 13;
+
+            int Border = (X == 0 || Y == 0 || X == MAP_WIDTH - 1 || Y == MAP_HEIGHT - 1);
+            Map.Tiles[Y*MAP_WIDTH + X] = (u8)((Border || (Hash & 0xff) < 20) ? TILE_WALL : TILE_FLOOR);
+            Map.Explored[Y*MAP_WIDTH + X] = 0;
+        }
+    }
+
+    MinimapInvalidate();
+}
+
+/* Changes one tile after GenerateMap (digging, doors, ...). Everything
+   that writes Map.Tiles goes through here so the minimap sees it. */
+void
+SetTile(int X, int Y, u8 Tile)
+{
+    if(X < 0 || Y < 0 || X >= MAP_WIDTH || Y >= MAP_HEIGHT)
+    {
+        return;
+    }
+
+    u8 *At = &Map.Tiles[Y*MAP_WIDTH + X];
+    if(*At != Tile)
+    {
+        *At = Tile;
+        MinimapMarkDirty(X, Y);
+    }
+}
+
+int
+IsWalkable(int X, int Y)
+{
+    if(X < 0 || Y < 0 || X >= MAP_WIDTH || Y >= MAP_HEIGHT)
+    {
+        return(0);
+    }
+
+    return(TileInfo[Map.Tiles[Y*MAP_WIDTH + X]].Walkable);
+}
+
+/* Moves the view to (X, Y), clamped to the map, and scrolls the console
+   along with it */
+void
+SetCamera(int X, int Y)
+{
+    if(X > MAP_WIDTH - VIEW_WIDTH)
+    {
+        X = MAP_WIDTH - VIEW_WIDTH;
+    }
+    if(Y > MAP_HEIGHT - VIEW_HEIGHT)
+    {
+        Y = MAP_HEIGHT - VIEW_HEIGHT;
+    }
+    if(X < 0)
+    {
+        X = 0;
+    }
+    if(Y < 0)
+    {
+        Y = 0;
+    }
+
+    ConsoleScroll(X - Camera.X, Y - Camera.Y);
+    LayersScroll(X - Camera.X, Y - Camera.Y);
+    Camera.X = X;
+    Camera.Y = Y;
+}
+
+void
+DrawMap(void)
+{
+    for(uint Y = 0; Y < VIEW_HEIGHT; ++Y)
+    {
+        u8 *Tiles = Map.Tiles + (Camera.Y + Y)*MAP_WIDTH + Camera.X;
+        for(uint X = 0; X < VIEW_WIDTH; ++X)
+        {
+            tile_info *Info = &TileInfo[Tiles[X]];
+            LayerSetCell(LAYER_MAP, X, Y, Info->Glyph, Info->Fg, Info->Bg);
+        }
+    }
+}
+
+typedef struct
+entity
+{
+    int Alive;
+    int RenderType;
+    int X, Y;
+    u32 Color;
+    int LightRadius;
+} entity;
+
+#define MAX_ENTITIES 100
+entity Entities[MAX_ENTITIES];
+uint EntityCount;
+
+entity *
+CreateEntity()
+{
+    if(EntityCount >= MAX_ENTITIES)
+    {
+        return(0);
+    }
+
+    entity *Entity = &Entities[EntityCount];
+    EntityCount += 1;
+
+    Entity->Alive = 1;
+
+    return(Entity);
+}
+
+/* Returns 0 if something was in the way */
+int
+MoveEntity(entity *Entity, int Dx, int Dy)
+{
+    if(!IsWalkable(Entity->X + Dx, Entity->Y + Dy))
+    {
+        return(0);
+    }
+
+    Entity->X += Dx;
+    Entity->Y += Dy;
+    return(1);
+}
+
+void
+DrawEntity(entity *Entity)
+{
+    if( Entity->RenderType >= 0 && Entity->RenderType < 256 &&
+        Entity->X - Camera.X < VIEW_WIDTH && Entity->Y - Camera.Y < VIEW_HEIGHT)
+    {
+        LayerPutChar(
+            LAYER_ACTORS,
+            (uint)(Entity->X - Camera.X), (uint)(Entity->Y - Camera.Y),
+            Entity->RenderType,
+            Entity->Color);
+    }
+}
+
+/*
+ * Minimap
+ *
+ * The side panel right of the view shows the explored map at one pixel
+ * per map cell, or one pixel per 2x2 block of cells when the panel is
+ * narrower than the map (small fonts). The top-left cells of the panel are
+ * reserved in the console and the minimap draws its own pixels there.
+ *
+ * Only the map cells passed to MinimapMarkDirty (newly explored tiles,
+ * tiles changed by SetTile and the cells entities left or entered) are
+ * looked at again, and the pixels that changed go out as a single image
+ * push of their bounding box. Everything is rebuilt when the console is
+ * redrawn from scratch, the font size changes, the map is generated again
+ * or too many cells changed at once.
+ */
+
+#define MINIMAP_UNEXPLORED 0x000000
+#define MINIMAP_FLOOR 0x383838
+#define MINIMAP_WALL 0x909090
+#define MAX_MINIMAP_DIRTY 4096
+
+typedef struct
+minimap
+{
+    int Valid;
+    uint GlyphSize;
+    uint Scale;
+    uint CellWidth, CellHeight;
+    image Image;
+
+    /* Entity index + 1 on every map cell (0 when empty) and where each
+       entity was when the minimap last looked */
+    u8 Occupant[MAP_WIDTH*MAP_HEIGHT];
+    int EntityShown[MAX_ENTITIES];
+    int EntityX[MAX_ENTITIES];
+    int EntityY[MAX_ENTITIES];
+
+    /* Pixels to recompute, IsDirty keeps them from being queued twice */
+    uint DirtyCount;
+    u32 Dirty[MAX_MINIMAP_DIRTY];
+    u8 IsDirty[MAP_WIDTH*MAP_HEIGHT];
+
+    uint PixelsChanged;
+} minimap;
+
+minimap Minimap;
+u32 MinimapPixels[MAP_WIDTH*MAP_HEIGHT];
+
+void
+MinimapMarkDirty(int X, int Y)
+{
+    if(!Minimap.Valid || X < 0 || Y < 0 || X >= MAP_WIDTH || Y >= MAP_HEIGHT)
+    {
+        return;
+    }
+
+    uint Pixel = ((uint)Y/Minimap.Scale)*Minimap.Image.Width + (uint)X/Minimap.Scale;
+    if(Minimap.IsDirty[Pixel])
+    {
+        return;
+    }
+
+    if(Minimap.DirtyCount >= MAX_MINIMAP_DIRTY)
+    {
+        /* NOTE: Past this point a rebuild is cheaper anyway */
+        Minimap.Valid = 0;
+        return;
+    }
+
+    Minimap.IsDirty[Pixel] = 1;
+    Minimap.Dirty[Minimap.DirtyCount++] = Pixel;
+}
+
+void
+MinimapInvalidate(void)
+{
+    Minimap.Valid = 0;
+}
+
+/* Entities beat walls, walls beat floors and anything explored beats the
+   black of unexplored cells */
+u32
+MinimapPixel(uint PixelX, uint PixelY)
+{
+    u32 Color = MINIMAP_UNEXPLORED;
+    uint Rank = 0;
+
+    for(uint Y = PixelY*Minimap.Scale; Y < (PixelY + 1)*Minimap.Scale; ++Y)
+    {
+        for(uint X = PixelX*Minimap.Scale; X < (PixelX + 1)*Minimap.Scale; ++X)
+        {
+            uint Index = Y*MAP_WIDTH + X;
+            if(!Map.Explored[Index])
+            {
+                continue;
+            }
+
+            if(Minimap.Occupant[Index])
+            {
+                return(Entities[Minimap.Occupant[Index] - 1].Color);
+            }
+
+            uint CellRank = (Map.Tiles[Index] == TILE_WALL) ? 2 : 1;
+            if(CellRank > Rank)
+            {
+                Rank = CellRank;
+                Color = (CellRank == 2) ? MINIMAP_WALL : MINIMAP_FLOOR;
+            }
+        }
+    }
+
+    return(Color);
+}
+
+/* Recomputes which entity shows on (X, Y) after one left it */
+void
+MinimapFindOccupant(int X, int Y)
+{
+    Minimap.Occupant[Y*MAP_WIDTH + X] = 0;
+    for(uint Index = 0; Index < MAX_ENTITIES; ++Index)
+    {
+        if( Minimap.EntityShown[Index] &&
+            Minimap.EntityX[Index] == X && Minimap.EntityY[Index] == Y)
+        {
+            Minimap.Occupant[Y*MAP_WIDTH + X] = (u8)(Index + 1);
+        }
+    }
+}
+
+void
+MinimapTrackEntities(void)
+{
+    for(uint Index = 0; Index < MAX_ENTITIES; ++Index)
+    {
+        entity *Entity = &Entities[Index];
+        int Shown = (Index < EntityCount && Entity->Alive &&
+                     Entity->X >= 0 && Entity->Y >= 0 &&
+                     Entity->X < MAP_WIDTH && Entity->Y < MAP_HEIGHT);
+
+        if( Shown == Minimap.EntityShown[Index] &&
+            (!Shown || (Entity->X == Minimap.EntityX[Index] && Entity->Y == Minimap.EntityY[Index])))
+        {
+            continue;
+        }
+
+        if(Minimap.EntityShown[Index])
+        {
+            Minimap.EntityShown[Index] = 0;
+            MinimapFindOccupant(Minimap.EntityX[Index], Minimap.EntityY[Index]);
+            MinimapMarkDirty(Minimap.EntityX[Index], Minimap.EntityY[Index]);
+        }
+
+        if(Shown)
+        {
+            Minimap.EntityShown[Index] = 1;
+            Minimap.EntityX[Index] = Entity->X;
+            Minimap.EntityY[Index] = Entity->Y;
+            Minimap.Occupant[Entity->Y*MAP_WIDTH + Entity->X] = (u8)(Index + 1);
+            MinimapMarkDirty(Entity->X, Entity->Y);
+        }
+    }
+}
+
+void
+RebuildMinimap(void)
+{
+    ConsoleReserve(VIEW_WIDTH, 0, Minimap.CellWidth, Minimap.CellHeight, 0);
+
+    uint PanelSize = SIDE_PANEL_WIDTH*GlyphSize;
+    Minimap.GlyphSize = GlyphSize;
+    Minimap.Scale = (PanelSize < MAP_WIDTH) ? 2 : 1;
+    Minimap.Image.Width = MAP_WIDTH/Minimap.Scale;
+    Minimap.Image.Height = MAP_HEIGHT/Minimap.Scale;
+    Minimap.Image.Pixels = MinimapPixels;
+    Minimap.CellWidth = (Minimap.Image.Width + GlyphSize - 1)/GlyphSize;
+    Minimap.CellHeight = (Minimap.Image.Height + GlyphSize - 1)/GlyphSize;
+
+    for(uint Y = 0; Y < Minimap.Image.Height; ++Y)
+    {
+        for(uint X = 0; X < Minimap.Image.Width; ++X)
+        {
+            MinimapPixels[Y*Minimap.Image.Width + X] = MinimapPixel(X, Y);
+        }
+    }
+
+    for(uint Index = 0; Index < Minimap.DirtyCount; ++Index)
+    {
+        Minimap.IsDirty[Minimap.Dirty[Index]] = 0;
+    }
+    Minimap.DirtyCount = 0;
+    Minimap.Valid = 1;
+    Minimap.PixelsChanged = Minimap.Image.Width*Minimap.Image.Height;
+
+    ConsoleReserve(VIEW_WIDTH, 0, Minimap.CellWidth, Minimap.CellHeight, 1);
+
+    /* NOTE: The image does not fill the last row and column of cells when
+       the glyph size does not divide it */
+    PushRect(VIEW_WIDTH*GlyphSize, 0, Minimap.CellWidth*GlyphSize, Minimap.CellHeight*GlyphSize, MINIMAP_UNEXPLORED);
+    PushImage(Minimap.Image, 0, 0, Minimap.Image.Width, Minimap.Image.Height, VIEW_WIDTH*GlyphSize, 0);
+}
+
+/* Pushes the draw commands that bring the minimap up to date */
+void
+UpdateMinimap(void)
+{
+    MinimapTrackEntities();
+
+    if(!Minimap.Valid || Minimap.GlyphSize != GlyphSize || Console.FullRedraw)
+    {
+        RebuildMinimap();
+        return;
+    }
+
+    uint MinX = Minimap.Image.Width, MinY = Minimap.Image.Height;
+    uint MaxX = 0, MaxY = 0;
+    Minimap.PixelsChanged = 0;
+
+    for(uint Index = 0; Index < Minimap.DirtyCount; ++Index)
+    {
+        uint Pixel = Minimap.Dirty[Index];
+        uint X = Pixel % Minimap.Image.Width;
+        uint Y = Pixel / Minimap.Image.Width;
+        Minimap.IsDirty[Pixel] = 0;
+
+        u32 Color = MinimapPixel(X, Y);
+        if(MinimapPixels[Pixel] == Color)
+        {
+            continue;
+        }
+
+        MinimapPixels[Pixel] = Color;
+        Minimap.PixelsChanged += 1;
+        MinX = (X < MinX) ? X : MinX;
+        MinY = (Y < MinY) ? Y : MinY;
+        MaxX = (X > MaxX) ? X : MaxX;
+        MaxY = (Y > MaxY) ? Y : MaxY;
+    }
+    Minimap.DirtyCount = 0;
+
+    if(Minimap.PixelsChanged)
+    {
+        PushImage(
+            Minimap.Image, MinX, MinY, MaxX - MinX + 1, MaxY - MinY + 1,
+            VIEW_WIDTH*GlyphSize + MinX, MinY);
+    }
+}
+
+/*
+ * Lighting
+ *
+ * Entities with a LightRadius light up the cells around them, brightest
+ * at the entity and falling off in LIGHT_LEVELS steps. Every tile that
+ * was ever lit is remembered as explored and keeps a dim ambient light,
+ * while tiles that were never seen stay black (fog of war). The light of
+ * each view cell goes to ConsoleSetLight.
+ *
+ * NOTE: The light is quantized so that lit colors stay few, which matters
+ * in palette mode.
+ */
+
+#define LIGHT_LEVELS 8
+#define TORCH_LIGHT 0xffd8a0
+#define AMBIENT_LIGHT 0x283040
+
+u32 ViewLight[SCREEN_WIDTH*VIEW_HEIGHT];
+
+/* Adds two lights channel by channel, saturating */
+u32
+AddLight(u32 A, u32 B)
+{
+    u32 Result = 0;
+    for(uint Shift = 0; Shift < 24; Shift += 8)
+    {
+        u32 Channel = ((A >> Shift) & 0xff) + ((B >> Shift) & 0xff);
+        Result |= ((Channel > 255) ? 255 : Channel) << Shift;
+    }
+
+    return(Result);
+}
+
+u32
+ScaleLight(u32 Light, uint Level)
+{
+    u32 Scale = Level*255/LIGHT_LEVELS;
+    return( (MulDiv255((Light >> 16) & 0xff, Scale) << 16) |
+            (MulDiv255((Light >>  8) & 0xff, Scale) <<  8) |
+            (MulDiv255((Light >>  0) & 0xff, Scale) <<  0));
+}
+
+void
+UpdateLighting(void)
+{
+    for(uint Index = 0; Index < SCREEN_WIDTH*VIEW_HEIGHT; ++Index)
+    {
+        ViewLight[Index] = 0;
+    }
+
+    for(uint Index = 0; Index < EntityCount; ++Index)
+    {
+        entity *Entity = &Entities[Index];
+        int Radius = Entity->LightRadius;
+        if(!Entity->Alive || Radius <= 0)
+        {
+            continue;
+        }
+
+        for(int Dy = -Radius; Dy <= Radius; ++Dy)
+        {
+            for(int Dx = -Radius; Dx <= Radius; ++Dx)
+            {
+                int X = Entity->X + Dx;
+                int Y = Entity->Y + Dy;
+                uint Distance2 = (uint)(Dx*Dx + Dy*Dy);
+                if( Distance2 > (uint)(Radius*Radius) ||
+                    X < Camera.X || Y < Camera.Y ||
+                    X >= Camera.X + VIEW_WIDTH || Y >= Camera.Y + VIEW_HEIGHT)
+                {
+                    continue;
+                }
+
+                uint Level = LIGHT_LEVELS - Distance2*LIGHT_LEVELS/(uint)(Radius*Radius + 1);
+                u32 *Light = &ViewLight[(Y - Camera.Y)*SCREEN_WIDTH + (X - Camera.X)];
+                *Light = AddLight(*Light, ScaleLight(TORCH_LIGHT, Level));
+                if(!Map.Explored[Y*MAP_WIDTH + X])
+                {
+                    Map.Explored[Y*MAP_WIDTH + X] = 1;
+                    MinimapMarkDirty(X, Y);
+                }
+            }
+        }
+    }
+
+    for(uint Y = 0; Y < VIEW_HEIGHT; ++Y)
+    {
+        u8 *Explored = Map.Explored + (Camera.Y + Y)*MAP_WIDTH + Camera.X;
+        for(uint X = 0; X < VIEW_WIDTH; ++X)
+        {
+            u32 Light = ViewLight[Y*SCREEN_WIDTH + X];
+            if(Explored[X])
+            {
+                Light = AddLight(Light, AMBIENT_LIGHT);
+            }
+            ConsoleSetLight(X, Y, Light);
+        }
+    }
+}
+
+int GameIsRunning;
+
+/* Returns the player */
+entity *
+CreateStartingEntities(void)
+{
+    entity *Player = CreateEntity();
+    Player->RenderType = '@';
+    Player->Color = 0xffffff;
+    Player->X = MAP_WIDTH/2;
+    Player->Y = MAP_HEIGHT/2;
+    Player->LightRadius = 9;
+
+    entity *Npc = CreateEntity();
+    Npc->RenderType = 'M';
+    Npc->Color = 0xff0000;
+    Npc->X = MAP_WIDTH/2 - 5;
+    Npc->Y = MAP_HEIGHT/2 - 3;
+
+    SetTile(Player->X, Player->Y, TILE_FLOOR);
+    SetTile(Npc->X, Npc->Y, TILE_FLOOR);
+
+    LogMessage("Welcome to ^3r0gu3^0! Move with the arrow keys, ESC quits.");
+
+    return(Player);
+}
+
+/* Keeps Target in the middle of the screen, away from the map edges */
+void
+CenterCamera(entity *Target)
+{
+    SetCamera(Target->X - VIEW_WIDTH/2, Target->Y - VIEW_HEIGHT/2);
+}
+
+void
+ApplyAction(entity *Player, action Action)
+{
+    switch(Action.Type)
+    {
+        case ACT_MOVE:
+        {
+            if(!MoveEntity(Player, Action.Dx, Action.Dy))
+            {
+                LogMessage("You bump into a ^8wall^0.");
+            }
+            CenterCamera(Player);
+        } break;
+
+        case ACT_ESCAPE:
+        {
+            GameIsRunning = 0;
+        } break;
+
+        default: break;
+    }
+}
+
+/*
+ * Text output
+ */
+
+typedef struct
+text
+{
+    char Data[4096];
+    uint Length;
+} text;
+
+void
+TextAppend(text *Text, char *String)
+{
+    while(*String && Text->Length < sizeof(Text->Data))
+    {
+        Text->Data[Text->Length++] = *String++;
+    }
+}
+
+void
+TextAppendUInt(text *Text, size_t Value)
+{
+    char Digits[32];
+    uint Count = 0;
+
+    do
+    {
+        Digits[Count++] = (char)('0' + (Value % 10));
+        Value /= 10;
+    } while(Value);
+
+    while(Count && Text->Length < sizeof(Text->Data))
+    {
+        Text->Data[Text->Length++] = Digits[--Count];
+    }
+}
+
+/* Appends Value as 8 hex digits */
+void
+TextAppendHex32(text *Text, u32 Value)
+{
+    for(int Shift = 28; Shift >= 0; Shift -= 4)
+    {
+        if(Text->Length < sizeof(Text->Data))
+        {
+            Text->Data[Text->Length++] = "0123456789abcdef"[(Value >> Shift) & 0xf];
+        }
+    }
+}
+
+/* Appends Thousandths/1000 with three decimals */
+void
+TextAppendFixed3(text *Text, size_t Thousandths)
+{
+    size_t Fraction = Thousandths % 1000;
+
+    TextAppendUInt(Text, Thousandths / 1000);
+    TextAppend(Text, ".");
+    TextAppend(Text, (Fraction < 100) ? ((Fraction < 10) ? "00" : "0") : "");
+    TextAppendUInt(Text, Fraction);
+}
+
+void
+TextFlush(text *Text)
+{
+    os_console_write(Text->Data, Text->Length);
+    Text->Length = 0;
+}
+
+/*
+ * Frames
+ *
+ * RenderFrame is the whole render step of the game. It draws into the
+ * window's buffer, or into a caller-owned one after SetRenderTarget, which
+ * is how the headless build renders with no window at all. HashFrame and
+ * DumpFrame cover the BufferWidth x BufferHeight pixels in use.
+ */
+
+/* Pixels has to hold BufferWidth*BufferHeight pixels for the loaded font.
+   Passing 0 goes back to the window's buffer. */
+void
+SetRenderTarget(u32 *Pixels)
+{
+    BackBuffer = Pixels ? Pixels : WindowBackBuffer;
+    ConsoleInvalidate();
+}
+
+void
+RenderFrame(void)
+{
+    DrawMap();
+
+    /* NOTE: Actors that did not move end up composited as before, so
+       only the cells they left and entered get recomposited */
+    LayerClear(LAYER_ACTORS);
+    for(uint Index = 0; Index < EntityCount; ++Index)
+    {
+        if(Entities[Index].Alive)
+        {
+            DrawEntity(&Entities[Index]);
+        }
+    }
+
+    DrawMessageLog(0, VIEW_HEIGHT, SCREEN_WIDTH, MESSAGE_LOG_HEIGHT, 0xc0c0c0, 0x101018);
+    UpdateLighting();
+    UpdateMinimap();
+
+    CompositeLayers();
+    ConsolePresent();
+
+    /* NOTE: BackBuffer only holds the final colors after this */
+    ResolvePalette();
+}
+
+/*
+ * Frame scheduling
+ *
+ * A turn-based game only changes when something happens, so with
+ * EVENT_LOOP on the main loop sleeps in EzWait until there is input, a
+ * timer expires or a running animation needs its next frame, and renders
+ * only if one of those invalidated the frame. Every wakeup that did not
+ * need a render counts as a skipped frame.
+ */
+
+#ifndef EVENT_LOOP
+#define EVENT_LOOP 1
+#endif
+
+#define ANIMATION_FRAME_MICROSECONDS 16667
+
+typedef struct
+frame_schedule
+{
+    int Invalidated;
+    uint Animations;
+    size_t NextAnimationFrame;
+    size_t TimerDeadline; /* 0 when no timer is set */
+
+    uint FramesRendered;
+    uint FramesSkipped;
+} frame_schedule;
+
+frame_schedule FrameSchedule;
+
+void
+InvalidateFrame(void)
+{
+    FrameSchedule.Invalidated = 1;
+}
+
+/* Frames are rendered at about 60 Hz until every BeginAnimation has had
+   its EndAnimation */
+void
+BeginAnimation(void)
+{
+    if(!FrameSchedule.Animations)
+    {
+        FrameSchedule.NextAnimationFrame = os_time_now_microseconds();
+    }
+    FrameSchedule.Animations += 1;
+}
+
+void
+EndAnimation(void)
+{
+    if(FrameSchedule.Animations)
+    {
+        FrameSchedule.Animations -= 1;
+    }
+    InvalidateFrame();
+}
+
+/* Invalidates the frame Microseconds from now. Only the earliest pending
+   timer is kept. */
+void
+SetFrameTimer(size_t Microseconds)
+{
+    size_t Deadline = os_time_now_microseconds() + Microseconds;
+    if(!FrameSchedule.TimerDeadline || Deadline < FrameSchedule.TimerDeadline)
+    {
+        FrameSchedule.TimerDeadline = Deadline;
+    }
+}
+
+/* How long the loop may sleep, in milliseconds, or -1 for "until input" */
+int
+FrameWaitTimeout(void)
+{
+    if(FrameSchedule.Invalidated)
+    {
+        return(0);
+    }
+
+    size_t Deadline = FrameSchedule.TimerDeadline;
+    if(FrameSchedule.Animations &&
+       (!Deadline || FrameSchedule.NextAnimationFrame < Deadline))
+    {
+        Deadline = FrameSchedule.NextAnimationFrame;
+    }
+
+    if(!Deadline)
+    {
+        return(-1);
+    }
+
+    size_t Now = os_time_now_microseconds();
+    if(Deadline <= Now)
+    {
+        return(0);
+    }
+
+    return((int)((Deadline - Now + 999) / 1000));
+}
+
+/* Returns 1 if the frame has to be rendered now */
+int
+ShouldRenderFrame(void)
+{
+    size_t Now = os_time_now_microseconds();
+
+    if(FrameSchedule.TimerDeadline && FrameSchedule.TimerDeadline <= Now)
+    {
+        FrameSchedule.TimerDeadline = 0;
+        InvalidateFrame();
+    }
+
+    if(FrameSchedule.Animations && FrameSchedule.NextAnimationFrame <= Now)
+    {
+        FrameSchedule.NextAnimationFrame = Now + ANIMATION_FRAME_MICROSECONDS;
+        InvalidateFrame();
+    }
+
+    if(!FrameSchedule.Invalidated)
+    {
+        FrameSchedule.FramesSkipped += 1;
+        return(0);
+    }
+
+    FrameSchedule.Invalidated = 0;
+    FrameSchedule.FramesRendered += 1;
+    return(1);
+}
+
+/* FNV-1a over whole pixels */
+u32
+HashPixels(u32 *Pixels, uint Count)
+{
+    u32 Hash = 2166136261u;
+    for(uint Index = 0;
+        Index < Count;
+        ++Index)
+    {
+        Hash = (Hash ^ Pixels[Index])*16777619u;
+    }
+    return(Hash);
+}
+
+u32
+HashFrame(void)
+{
+    return(HashPixels(BackBuffer, BufferWidth*BufferHeight));
+}
+
+typedef enum
+frame_format
+{
+    FRAME_FORMAT_BGRA, /* BackBuffer as is, 4 bytes per pixel, no header */
+    FRAME_FORMAT_PPM,  /* Binary PPM (P6), 3 bytes per pixel */
+} frame_format;
+
+int
+DumpFrame(char *FilePath, frame_format Format)
+{
+    size_t PixelCount = (size_t)BufferWidth*BufferHeight;
+
+    if(Format == FRAME_FORMAT_BGRA)
+    {
+        return(os_file_write(FilePath, BackBuffer, PixelCount*4) == PixelCount*4);
+    }
+
+    text Header = {0};
+    TextAppend(&Header, "P6\n");
+    TextAppendUInt(&Header, BufferWidth);
+    TextAppend(&Header, " ");
+    TextAppendUInt(&Header, BufferHeight);
+    TextAppend(&Header, "\n255\n");
+
+    size_t FileSize = Header.Length + PixelCount*3;
+    u8 *File = (u8 *)os_memory_alloc(FileSize);
+    if(!File)
+    {
+        return(0);
+    }
+
+    u8 *Dest = File;
+    for(uint Index = 0; Index < Header.Length; ++Index)
+    {
+        *Dest++ = (u8)Header.Data[Index];
+    }
+    for(size_t Index = 0; Index < PixelCount; ++Index)
+    {
+        u32 Pixel = BackBuffer[Index];
+        *Dest++ = (u8)(Pixel >> 16);
+        *Dest++ = (u8)(Pixel >> 8);
+        *Dest++ = (u8)(Pixel >> 0);
+    }
+
+    int Result = (os_file_write(FilePath, File, FileSize) == FileSize);
+    os_memory_free(File);
+
+    return(Result);
+}
+
+
+#ifdef R0GU3_BENCHMARK
+
+/*
+ * Benchmarks
+ *
+ * Built by bench.bat; results are written to stdout.
+ */
+
+u32 BenchRandomState = 0x2545f491;
+
+u32
+BenchRandom(void)
+{
+    u32 X = BenchRandomState;
+    X ^= X << 13;
+    X ^= X >> 17;
+    X ^= X << 5;
+    BenchRandomState = X;
+    return(X);
+}
+
+/* The per-pixel loops the blit kernels replaced, kept as a baseline */
+void
+DrawImagePerPixel(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY)
+{
+    if(SrcX >= Image.Width || SrcY >= Image.Height)
+    {
+        return;
+    }
+
+    if(SrcW > Image.Width)
+    {
+        SrcW = Image.Width;
+    }
+
+    if(SrcH > Image.Height)
+    {
+        SrcH = Image.Height;
+    }
+
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        for(uint X = 0; X < SrcW; ++X)
+        {
+            if( (SrcY+Y) < Image.Height &&
+                (SrcX+X) < Image.Width &&
+                (DestY+Y) < SCREEN_HEIGHT*GlyphSize &&
+                (DestX+X) < SCREEN_WIDTH*GlyphSize)
+            {
+                BackBuffer[(DestY+Y)*SCREEN_WIDTH*GlyphSize + (DestX+X)] = 
+                    ((u32 *)Image.Pixels)[(SrcY+Y)*Image.Width + (SrcX+X)];
+            }
+        }
+    }
+}
+
+void
+DrawImageMonoPerPixel(image Image, uint SrcX, uint SrcY, uint SrcW, uint SrcH, uint DestX, uint DestY, u32 Color)
+{
+    if(SrcX >= Image.Width || SrcY >= Image.Height)
+    {
+        return;
+    }
+
+    if(SrcW > Image.Width)
+    {
+        SrcW = Image.Width;
+    }
+
+    if(SrcH > Image.Height)
+    {
+        SrcH = Image.Height;
+    }
+
+    for(uint Y = 0; Y < SrcH; ++Y)
+    {
+        for(uint X = 0; X < SrcW; ++X)
+        {
+            if( (SrcY+Y) < Image.Height &&
+                (SrcX+X) < Image.Width &&
+                (DestY+Y) < SCREEN_HEIGHT*GlyphSize &&
+                (DestX+X) < SCREEN_WIDTH*GlyphSize)
+            {
+                u32 PixelColor = ((u32 *)Image.Pixels)[(SrcY+Y)*Image.Width + (SrcX+X)];
+                if((PixelColor & 0xffffff) == 0xffffff)
+                {
+                    PixelColor = Color;
+                    BackBuffer[(DestY+Y)*SCREEN_WIDTH*GlyphSize + (DestX+X)] = PixelColor;
+                }
+            }
+        }
+    }
+}
+
+#define BENCH_FRAMES 200
+#define BENCH_GLYPHS (SCREEN_WIDTH*SCREEN_HEIGHT)
+
+image BenchFontImage;
+u8 BenchGlyphs[BENCH_GLYPHS];
+
+/* The PNGs BenchPngDecode decodes, the headless build adds more with
+   --png */
+#define MAX_BENCH_PNGS 16
+char *BenchPngs[MAX_BENCH_PNGS] = { "res/font16x16.png" };
+uint BenchPngCount = 1;
+u32 BenchColors[BENCH_GLYPHS];
+
+void
+BenchRandomScreen(void)
+{
+    for(uint Index = 0;
+        Index < BENCH_GLYPHS;
+        ++Index)
+    {
+        BenchGlyphs[Index] = (u8)(BenchRandom() & 0xff);
+        BenchColors[Index] = BenchRandom() & 0xffffff;
+    }
+}
+
+void
+BenchReport(text *Out, char *Name, size_t ElapsedMicroseconds, size_t Count, char *Unit)
+{
+    TextAppend(Out, "  ");
+    TextAppend(Out, Name);
+    TextAppend(Out, ": ");
+    TextAppendFixed3(Out, ElapsedMicroseconds*1000*1000 / Count);
+    TextAppend(Out, Unit);
+    TextAppend(Out, "\n");
+    TextFlush(Out);
+}
+
+/* Draws an 80x50 screen of random glyphs BENCH_FRAMES times with each
+   blit path. Mode 0 is the masked glyph blit, mode 1 the opaque copy and
+   mode 2 the glyph cell with a background, where PerPixel stands for the
+   two pass FillRect + DrawImageMono it replaces. */
+size_t
+BenchBlitScreen(int Mode, int PerPixel)
+{
+    size_t Start = os_time_now_microseconds();
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        for(uint Index = 0; Index < BENCH_GLYPHS; ++Index)
+        {
+            uint SrcX = (BenchGlyphs[Index]%16)*GlyphSize;
+            uint SrcY = (BenchGlyphs[Index]/16)*GlyphSize;
+            uint DestX = (Index%SCREEN_WIDTH)*GlyphSize;
+            uint DestY = (Index/SCREEN_WIDTH)*GlyphSize;
+
+            if(Mode == 2 && PerPixel)
+            {
+                FillRect(DestX, DestY, GlyphSize, GlyphSize, ~BenchColors[Index] & 0xffffff);
+                DrawImageMono(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY, BenchColors[Index]);
+            }
+            else if(Mode == 2)
+            {
+                DrawImageCell(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY,
+                    BenchColors[Index], ~BenchColors[Index] & 0xffffff);
+            }
+            else if(Mode == 0 && PerPixel)
+            {
+                DrawImageMonoPerPixel(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY, BenchColors[Index]);
+            }
+            else if(Mode == 0)
+            {
+                DrawImageMono(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY, BenchColors[Index]);
+            }
+            else if(PerPixel)
+            {
+                DrawImagePerPixel(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY);
+            }
+            else
+            {
+                DrawImage(BenchFontImage, SrcX, SrcY, GlyphSize, GlyphSize, DestX, DestY);
+            }
+        }
+    }
+
+    return(os_time_now_microseconds() - Start);
+}
+
+void
+BenchBlitKernels(text *Out)
+{
+    char *ModeNames[3] = { "DrawImageMono", "DrawImage", "DrawImageCell" };
+
+    BenchRandomScreen();
+
+    for(int Mode = 0; Mode < 3; ++Mode)
+    {
+        TextAppend(Out, ModeNames[Mode]);
+        TextAppend(Out, ", 80x50 random glyphs:\n");
+        TextFlush(Out);
+
+        BenchReport(Out, (Mode == 2) ? "FillRect + DrawImageMono" : "per-pixel loop",
+            BenchBlitScreen(Mode, 1), BENCH_FRAMES*BENCH_GLYPHS, " ns/glyph");
+        u32 ReferenceHash = HashFrame();
+
+        for(int Type = 0; Type < BLIT_KERNEL_COUNT; ++Type)
+        {
+            if(!CpuSupportsBlitKernel((blit_kernel_type)Type))
+            {
+                continue;
+            }
+
+            SetBlitKernel((blit_kernel_type)Type);
+            BenchReport(Out, Blit.Name, BenchBlitScreen(Mode, 0), BENCH_FRAMES*BENCH_GLYPHS, " ns/glyph");
+            if(HashFrame() != ReferenceHash)
+            {
+                TextAppend(Out, "    MISMATCH\n");
+                TextFlush(Out);
+            }
+
+            /* The two pass path on the same kernels, the reference above
+               runs on the fastest ones */
+            if(Mode == 2)
+            {
+                BenchReport(Out, "  FillRect + DrawImageMono", BenchBlitScreen(Mode, 1), BENCH_FRAMES*BENCH_GLYPHS, " ns/glyph");
+            }
+        }
+    }
+
+    InitBlitKernels();
+}
+
+#define BENCH_PANEL_WIDTH 640
+#define BENCH_PANEL_HEIGHT 400
+
+/* Straight alpha blend with a divide per channel, what DrawImageBlend
+   replaces */
+void
+DrawImageBlendPerPixel(image Image, uint DestX, uint DestY)
+{
+    for(uint Y = 0; Y < Image.Height && DestY + Y < BufferHeight; ++Y)
+    {
+        for(uint X = 0; X < Image.Width && DestX + X < BufferWidth; ++X)
+        {
+            u32 S = ((u32 *)Image.Pixels)[Y*Image.Width + X];
+            u32 *D = BackBuffer + (DestY + Y)*BufferWidth + DestX + X;
+            u32 A = S >> 24;
+            u32 Result = 0;
+            for(uint Shift = 0; Shift < 32; Shift += 8)
+            {
+                u32 Sc = (Shift == 24) ? 255 : (S >> Shift) & 0xff;
+                u32 Dc = (*D >> Shift) & 0xff;
+                Result |= ((Sc*A + Dc*(255 - A)) / 255) << Shift;
+            }
+            *D = Result;
+        }
+    }
+}
+
+/* Fills a panel with vertical bands of transparent, translucent and
+   opaque pixels, roughly what a UI window with a border looks like */
+image
+BenchMakePanel(void)
+{
+    image Panel = {0};
+    Panel.Pixels = os_memory_alloc(BENCH_PANEL_WIDTH*BENCH_PANEL_HEIGHT*4);
+    if(!Panel.Pixels)
+    {
+        return(Panel);
+    }
+    Panel.Width = BENCH_PANEL_WIDTH;
+    Panel.Height = BENCH_PANEL_HEIGHT;
+
+    for(uint Y = 0; Y < BENCH_PANEL_HEIGHT; ++Y)
+    {
+        for(uint X = 0; X < BENCH_PANEL_WIDTH; ++X)
+        {
+            u32 Alpha = 0xc0;
+            if(X < 32 || Y < 32 || X >= BENCH_PANEL_WIDTH - 32 || Y >= BENCH_PANEL_HEIGHT - 32)
+            {
+                Alpha = 0;
+            }
+            else if(X < 40 || Y < 40 || X >= BENCH_PANEL_WIDTH - 40 || Y >= BENCH_PANEL_HEIGHT - 40)
+            {
+                Alpha = 0xff;
+            }
+
+            ((u32 *)Panel.Pixels)[Y*BENCH_PANEL_WIDTH + X] =
+                (Alpha << 24) | ((X*255/BENCH_PANEL_WIDTH) << 16) | ((Y*255/BENCH_PANEL_HEIGHT) << 8) | 0x40;
+        }
+    }
+
+    return(Panel);
+}
+
+/* Blends the panel over a 2x2 grid covering an 80x50 screen of random
+   glyphs, BENCH_FRAMES times */
+size_t
+BenchBlendFrames(image Panel, int PerPixel)
+{
+    size_t Elapsed = 0;
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        for(uint Index = 0; Index < BENCH_GLYPHS; ++Index)
+        {
+            RasterizeGlyph(
+                BackBuffer + (Index/SCREEN_WIDTH)*GlyphSize*BufferWidth + (Index%SCREEN_WIDTH)*GlyphSize,
+                BufferWidth, BenchGlyphs[Index], BenchColors[Index], ~BenchColors[Index] & 0xffffff);
+        }
+
+        size_t Start = os_time_now_microseconds();
+        for(uint Y = 0; Y < 2; ++Y)
+        {
+            for(uint X = 0; X < 2; ++X)
+            {
+                if(PerPixel)
+                {
+                    DrawImageBlendPerPixel(Panel, X*BENCH_PANEL_WIDTH, Y*BENCH_PANEL_HEIGHT);
+                }
+                else
+                {
+                    DrawImageBlend(Panel, 0, 0, Panel.Width, Panel.Height, X*BENCH_PANEL_WIDTH, Y*BENCH_PANEL_HEIGHT);
+                }
+            }
+        }
+        Elapsed += os_time_now_microseconds() - Start;
+    }
+
+    return(Elapsed);
+}
+
+/* Times the blend kernels against the per-pixel divide and checks that
+   every kernel matches the scalar one */
+void
+BenchAlphaBlend(text *Out)
+{
+    image Panel = BenchMakePanel();
+    if(!Panel.Pixels)
+    {
+        return;
+    }
+
+    TextAppend(Out, "DrawImageBlend, 4 translucent 640x400 panels:\n");
+    TextFlush(Out);
+
+    BenchReport(Out, "per-pixel divide", BenchBlendFrames(Panel, 1), BENCH_FRAMES*1000*1000, " ms/frame");
+
+    PremultiplyImage(Panel);
+
+    u32 ScalarHash = 0;
+    for(int Type = 0; Type < BLIT_KERNEL_COUNT; ++Type)
+    {
+        if(!CpuSupportsBlitKernel((blit_kernel_type)Type))
+        {
+            continue;
+        }
+
+        SetBlitKernel((blit_kernel_type)Type);
+        BenchReport(Out, Blit.Name, BenchBlendFrames(Panel, 0), BENCH_FRAMES*1000*1000, " ms/frame");
+        if(Type == BLIT_KERNEL_SCALAR)
+        {
+            ScalarHash = HashFrame();
+        }
+        else if(HashFrame() != ScalarHash)
+        {
+            TextAppend(Out, "    MISMATCH\n");
+            TextFlush(Out);
+        }
+    }
+
+    InitBlitKernels();
+    os_memory_free(Panel.Pixels);
+}
+
+/* Times the light pass of ConsolePresent over an 80x50 grid of random
+   cells and lights with every kernel, checking them against scalar */
+void
+BenchLighting(text *Out)
+{
+    static console_cell Cells[BENCH_GLYPHS];
+    static console_cell Light[BENCH_GLYPHS];
+    static console_cell Lit[BENCH_GLYPHS];
+    uint Words = BENCH_GLYPHS*sizeof(console_cell)/4;
+
+    BenchRandomState = 0x2545f491;
+    for(uint Index = 0; Index < BENCH_GLYPHS; ++Index)
+    {
+        Cells[Index].Glyph = BenchRandom() & 0xff;
+        Cells[Index].Fg = BenchRandom() & 0xffffff;
+        Cells[Index].Bg = BenchRandom() & 0xffffff;
+        Light[Index].Glyph = 0xffffffff;
+        Light[Index].Fg = Light[Index].Bg = BenchRandom() | 0xff000000;
+    }
+
+    TextAppend(Out, "Light pass, 80x50 cells:\n");
+    TextFlush(Out);
+
+    u32 ScalarHash = 0;
+    for(int Type = 0; Type < BLIT_KERNEL_COUNT; ++Type)
+    {
+        if(!CpuSupportsBlitKernel((blit_kernel_type)Type))
+        {
+            continue;
+        }
+
+        SetBlitKernel((blit_kernel_type)Type);
+        size_t Start = os_time_now_microseconds();
+        for(uint Frame = 0; Frame < 100*BENCH_FRAMES; ++Frame)
+        {
+            Blit.ModulateRow((u32 *)Lit, (u32 *)Cells, (u32 *)Light, Words);
+        }
+        BenchReport(Out, Blit.Name, os_time_now_microseconds() - Start, 100*BENCH_FRAMES*1000, " us/frame");
+
+        u32 Hash = HashPixels((u32 *)Lit, Words);
+        if(Type == BLIT_KERNEL_SCALAR)
+        {
+            ScalarHash = Hash;
+        }
+        else if(Hash != ScalarHash)
+        {
+            TextAppend(Out, "    MISMATCH\n");
+            TextFlush(Out);
+        }
+    }
+
+    InitBlitKernels();
+}
+
+u32 BenchGlyphRows[256][MAX_GLYPH_SIZE];
+
+/* Rasterizes an 80x50 screen of random glyphs BENCH_FRAMES times, either
+   with the specialized blitters or with RasterizeGlyphRows */
+size_t
+BenchRasterizeScreen(glyph_blitters Blitters, int Generic)
+{
+    uint Pitch = SCREEN_WIDTH*Blitters.Size;
+    size_t Start = os_time_now_microseconds();
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        for(uint Index = 0; Index < BENCH_GLYPHS; ++Index)
+        {
+            u32 *Dest = BackBuffer +
+                (Index/SCREEN_WIDTH)*Blitters.Size*Pitch + (Index%SCREEN_WIDTH)*Blitters.Size;
+            u32 *Rows = BenchGlyphRows[BenchGlyphs[Index]];
+
+            if(Generic)
+            {
+                RasterizeGlyphRows(Dest, Pitch, Rows, Blitters.Size, BenchColors[Index], ~BenchColors[Index]);
+            }
+            else
+            {
+                Blitters.Rasterize(Dest, Pitch, Rows, BenchColors[Index], ~BenchColors[Index]);
+            }
+        }
+    }
+
+    return(os_time_now_microseconds() - Start);
+}
+
+void
+BenchGlyphBlitters(text *Out)
+{
+    BenchRandomScreen();
+
+    TextAppend(Out, "Glyph blitters, 80x50 random glyphs:\n");
+    TextFlush(Out);
+
+    for(uint Index = 0; Index < GLYPH_BLITTER_COUNT; ++Index)
+    {
+        glyph_blitters Blitters = GlyphBlitterTable[Index];
+        uint PixelCount = SCREEN_WIDTH*SCREEN_HEIGHT*Blitters.Size*Blitters.Size;
+        if(!Blitters.Unrolled)
+        {
+            continue;
+        }
+
+        for(uint Glyph = 0; Glyph < 256; ++Glyph)
+        {
+            for(uint Row = 0; Row < Blitters.Size; ++Row)
+            {
+                BenchGlyphRows[Glyph][Row] = BenchRandom() & (u32)((1ull << Blitters.Size) - 1);
+            }
+        }
+
+        TextAppend(Out, "  ");
+        TextAppendUInt(Out, Blitters.Size);
+        TextAppend(Out, "x");
+        TextAppendUInt(Out, Blitters.Size);
+        TextAppend(Out, ":\n");
+
+        BenchReport(Out, "  generic", BenchRasterizeScreen(Blitters, 1), BENCH_FRAMES*BENCH_GLYPHS, " ns/glyph");
+        u32 GenericHash = HashPixels(BackBuffer, PixelCount);
+
+        BenchReport(Out, "  specialized", BenchRasterizeScreen(Blitters, 0), BENCH_FRAMES*BENCH_GLYPHS, " ns/glyph");
+        u32 Hash = HashPixels(BackBuffer, PixelCount);
+
+        TextAppend(Out, (Hash == GenericHash) ? "    identical\n" : "    MISMATCH\n");
+        TextFlush(Out);
+    }
+}
+
+size_t
+BenchPresentRandomFrames(void)
+{
+    size_t Elapsed = 0;
+
+    BenchRandomState = 0x2545f491;
+    ConsoleInvalidate();
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        for(uint Y = 0; Y < SCREEN_HEIGHT; ++Y)
+        {
+            for(uint X = 0; X < SCREEN_WIDTH; ++X)
+            {
+                ConsoleSetCell(X, Y, (int)(BenchRandom() & 0xff),
+                    BenchRandom() & 0xffffff, BenchRandom() & 0xffffff);
+            }
+        }
+
+        size_t Start = os_time_now_microseconds();
+        ConsolePresent();
+        Elapsed += os_time_now_microseconds() - Start;
+    }
+
+    return(Elapsed);
+}
+
+/* Presents BENCH_FRAMES fully dirty consoles of random glyphs with 1..N
+   render threads and checks that every thread count produces the same
+   BackBuffer as the single-threaded path. The sweep bypasses the glyph
+   cache on one thread too, so that it only measures the banding. */
+void
+BenchRenderThreads(text *Out)
+{
+    uint MaxThreads = os_processor_count();
+    if(MaxThreads > MAX_RENDER_THREADS)
+    {
+        MaxThreads = MAX_RENDER_THREADS;
+    }
+
+    TextAppend(Out, "ConsolePresent, 80x50 fully dirty frames:\n");
+    TextFlush(Out);
+
+    SetRenderThreadCount(1);
+    size_t Cached = BenchPresentRandomFrames();
+    u32 SingleThreadedHash = HashFrame();
+    TextAppend(Out, "  1 thread, glyph cache: ");
+    TextAppendFixed3(Out, Cached / BENCH_FRAMES);
+    TextAppend(Out, " ms/frame\n");
+    TextFlush(Out);
+
+    RenderThreads.BypassGlyphCache = 1;
+
+    size_t SingleThreaded = 0;
+    for(uint Threads = 1; Threads <= MaxThreads; ++Threads)
+    {
+        if(SetRenderThreadCount(Threads) != Threads)
+        {
+            break;
+        }
+
+        size_t Elapsed = BenchPresentRandomFrames();
+        u32 Hash = HashFrame();
+        if(Threads == 1)
+        {
+            SingleThreaded = Elapsed;
+        }
+
+        TextAppend(Out, "  ");
+        TextAppendUInt(Out, Threads);
+        TextAppend(Out, (Threads == 1) ? " thread: " : " threads: ");
+        TextAppendFixed3(Out, Elapsed / BENCH_FRAMES);
+        TextAppend(Out, " ms/frame, ");
+        TextAppendFixed3(Out, SingleThreaded*1000 / (Elapsed ? Elapsed : 1));
+        TextAppend(Out, (Hash == SingleThreadedHash) ? "x, identical\n" : "x, MISMATCH\n");
+        TextFlush(Out);
+    }
+
+    RenderThreads.BypassGlyphCache = 0;
+    SetRenderThreadCount(RENDER_THREADS);
+}
+
+/* Walks the camera around a 10x10 cell square, one cell per frame, and
+   returns the time spent scrolling and rendering. With FullRedraw every
+   frame is rasterized from scratch instead of scrolled. */
+size_t
+BenchScrollFrames(int FullRedraw, uint *CellsDrawn)
+{
+    size_t Elapsed = 0;
+    *CellsDrawn = 0;
+
+    Camera.X = 0;
+    Camera.Y = 0;
+    ConsoleInvalidate();
+    RenderFrame();
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        uint Side = (Frame/10) % 4;
+        int Dx = (Side == 0) - (Side == 2);
+        int Dy = (Side == 1) - (Side == 3);
+
+        size_t Start = os_time_now_microseconds();
+        SetCamera(Camera.X + Dx, Camera.Y + Dy);
+        if(FullRedraw)
+        {
+            ConsoleInvalidate();
+        }
+        RenderFrame();
+        Elapsed += os_time_now_microseconds() - Start;
+
+        *CellsDrawn += RenderStats.CellsDrawn;
+    }
+
+    return(Elapsed);
+}
+
+void
+BenchScrolling(text *Out)
+{
+    uint Cells;
+
+    GenerateMap();
+
+    TextAppend(Out, "Scrolling the map one cell per frame:\n");
+    TextFlush(Out);
+
+    size_t Full = BenchScrollFrames(1, &Cells);
+    u32 FullHash = HashFrame();
+    TextAppend(Out, "  full redraw: ");
+    TextAppendFixed3(Out, Full / BENCH_FRAMES);
+    TextAppend(Out, " ms/frame, ");
+    TextAppendUInt(Out, Cells / BENCH_FRAMES);
+    TextAppend(Out, " cells/frame\n");
+
+    size_t Scrolled = BenchScrollFrames(0, &Cells);
+    u32 Hash = HashFrame();
+    TextAppend(Out, "  block move + strip: ");
+    TextAppendFixed3(Out, Scrolled / BENCH_FRAMES);
+    TextAppend(Out, " ms/frame, ");
+    TextAppendUInt(Out, Cells / BENCH_FRAMES);
+    TextAppend(Out, (Hash == FullHash) ? " cells/frame, identical\n" : " cells/frame, MISMATCH\n");
+    TextFlush(Out);
+}
+
+/* Draws BENCH_FRAMES frames with heavy overdraw: a background rect and
+   an image, two full screens of glyph cells and some transparent glyphs
+   on top. Batched goes through the draw commands, otherwise everything
+   is drawn immediately in submission order. */
+size_t
+BenchOverdrawFrames(int Batched)
+{
+    size_t Elapsed = 0;
+
+    BenchRandomState = 0x2545f491;
+
+    for(uint Frame = 0; Frame < BENCH_FRAMES; ++Frame)
+    {
+        size_t Start = os_time_now_microseconds();
+
+        if(Batched)
+        {
+            PushRect(0, 0, BufferWidth, BufferHeight, 0xff202020);
+            PushImage(BenchFontImage, 0, 0, BenchFontImage.Width, BenchFontImage.Height, 4*GlyphSize, 4*GlyphSize);
+        }
+        else
+        {
+            FillRect(0, 0, BufferWidth, BufferHeight, 0xff202020);
+            DrawImage(BenchFontImage, 0, 0, BenchFontImage.Width, BenchFontImage.Height, 4*GlyphSize, 4*GlyphSize);
+        }
+
+        for(uint Pass = 0; Pass < 2; ++Pass)
+        {
+            for(uint Y = 0; Y < SCREEN_HEIGHT; ++Y)
+            {
+                for(uint X = 0; X < SCREEN_WIDTH; ++X)
+                {
+                    int Glyph = (int)(BenchRandom() & 0xff);
+                    u32 Fg = BenchRandom() & 0xffffff;
+                    u32 Bg = BenchRandom() & 0xffffff;
+                    if(Batched)
+                    {
+                        PushGlyphCell(Glyph, X, Y, Fg, Bg);
+                    }
+                    else
+                    {
+                        DrawGlyphCell(Glyph, X, Y, Fg, Bg);
+                    }
+                }
+            }
+        }
+
+        for(uint Index = 0; Index < 100; ++Index)
+        {
+            int Glyph = (int)(BenchRandom() & 0xff);
+            uint X = BenchRandom() % SCREEN_WIDTH;
+            uint Y = BenchRandom() % SCREEN_HEIGHT;
+            u32 Color = BenchRandom() & 0xffffff;
+            if(Batched)
+            {
+                PushGlyph(Glyph, X, Y, Color);
+            }
+            else
+            {
+                DrawChar(Glyph, X, Y, Color);
+            }
+        }
+
+        if(Batched)
+        {
+            FlushDrawCommands();
+        }
+
+        Elapsed += os_time_now_microseconds() - Start;
+    }
+
+    return(Elapsed);
+}
+
+void
+BenchDrawCommands(text *Out)
+{
+    TextAppend(Out, "Overdrawn frames, 2 screens of glyph cells:\n");
+    TextFlush(Out);
+
+    SetRenderThreadCount(1);
+
+    size_t Immediate = BenchOverdrawFrames(0);
+    u32 ImmediateHash = HashFrame();
+    TextAppend(Out, "  immediate: ");
+    TextAppendFixed3(Out, Immediate / BENCH_FRAMES);
+    TextAppend(Out, " ms/frame\n");
+
+    size_t Batched = BenchOverdrawFrames(1);
+    u32 Hash = HashFrame();
+    TextAppend(Out, "  draw commands: ");
+    TextAppendFixed3(Out, Batched / BENCH_FRAMES);
+    TextAppend(Out, " ms/frame, ");
+    TextAppendUInt(Out, RenderStats.CommandsSubmitted);
+    TextAppend(Out, " submitted, ");
+    TextAppendUInt(Out, RenderStats.CommandsCulled);
+    TextAppend(Out, " culled, ");
+    TextAppendUInt(Out, RenderStats.CommandsExecuted);
+    TextAppend(Out, (Hash == ImmediateHash) ? " executed, identical\n" : " executed, MISMATCH\n");
+    TextFlush(Out);
+
+    SetRenderThreadCount(RENDER_THREADS);
+}
+
+/* Walks the player around 40 cell squares, exploring as it goes and
+   opening or closing a door next to it every 16 frames, and returns the
+   time spent bringing the minimap up to date. With Rebuild the minimap is
+   rebuilt from scratch every frame. */
+size_t
+BenchMinimapFrames(int Rebuild, uint *PixelsChanged)
+{
+    size_t Elapsed = 0;
+    *PixelsChanged = 0;
+
+    GenerateMap();
+    EntityCount = 0;
+    entity *Player = CreateStartingEntities();
+    CenterCamera(Player);
+    MinimapInvalidate();
+
+    for(uint Frame = 0; Frame < 4*BENCH_FRAMES; ++Frame)
+    {
+        uint Side = (Frame/40) % 4;
+        MoveEntity(Player, (Side == 0) - (Side == 2), (Side == 1) - (Side == 3));
+        if(Frame % 16 == 0)
+        {
+            int DoorX = Player->X + 2;
+            int DoorY = Player->Y + 2;
+            SetTile(DoorX, DoorY, IsWalkable(DoorX, DoorY) ? TILE_WALL : TILE_FLOOR);
+        }
+        CenterCamera(Player);
+        UpdateLighting();
+
+        /* NOTE: Nothing is presented here, which is what would clear it */
+        Console.FullRedraw = 0;
+
+        size_t Start = os_time_now_microseconds();
+        if(Rebuild)
+        {
+            MinimapInvalidate();
+        }
+        UpdateMinimap();
+        FlushDrawCommands();
+        Elapsed += os_time_now_microseconds() - Start;
+
+        *PixelsChanged += Minimap.PixelsChanged;
+    }
+
+    return(Elapsed);
+}
+
+void
+BenchMinimap(text *Out)
+{
+    uint Pixels;
+
+    TextAppend(Out, "Minimap, player walking and exploring:\n");
+    TextFlush(Out);
+
+    size_t Rebuild = BenchMinimapFrames(1, &Pixels);
+    u32 RebuildHash = HashPixels(MinimapPixels, Minimap.Image.Width*Minimap.Image.Height);
+    TextAppend(Out, "  full rebuild: ");
+    TextAppendFixed3(Out, Rebuild*1000 / (4*BENCH_FRAMES));
+    TextAppend(Out, " us/frame, ");
+    TextAppendUInt(Out, Pixels / (4*BENCH_FRAMES));
+    TextAppend(Out, " pixels/frame\n");
+
+    size_t Incremental = BenchMinimapFrames(0, &Pixels);
+    u32 Hash = HashPixels(MinimapPixels, Minimap.Image.Width*Minimap.Image.Height);
+    TextAppend(Out, "  incremental: ");
+    TextAppendFixed3(Out, Incremental*1000 / (4*BENCH_FRAMES));
+    TextAppend(Out, " us/frame, ");
+    TextAppendUInt(Out, Pixels / (4*BENCH_FRAMES));
+    TextAppend(Out, (Hash == RebuildHash) ? " pixels/frame, identical\n" : " pixels/frame, MISMATCH\n");
+    TextFlush(Out);
+}
+
+/* Decodes every PNG in BenchPngs for about 200 ms each and reports the
+   throughput in MB of decoded pixels per second */
+void
+BenchPngDecode(text *Out)
+{
+    TextAppend(Out, "PNG decoding:\n");
+    TextFlush(Out);
+
+    for(uint Index = 0; Index < BenchPngCount; ++Index)
+    {
+        TextAppend(Out, "  ");
+        TextAppend(Out, BenchPngs[Index]);
+
+        size_t FileSize;
+        void *File = ReadEntireFile(BenchPngs[Index], &FileSize);
+        uint ImageSize = File ? ezimg_png_size(File, (uint)FileSize, EZIMG_FORMAT_BGRA) : 0;
+        void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+        if(!Pixels)
+        {
+            TextAppend(Out, ": could not read\n");
+            TextFlush(Out);
+            if(File)
+            {
+                os_memory_free(File);
+            }
+            continue;
+        }
+
+        uint Width = 0, Height = 0;
+        uint Runs = 0;
+        int Result = EZIMG_OK;
+        size_t Start = os_time_now_microseconds();
+        size_t Elapsed = 0;
+        while(Result == EZIMG_OK && (Runs == 0 || Elapsed < 200*1000))
+        {
+            Result = ezimg_png_load(File, (uint)FileSize, Pixels, ImageSize, EZIMG_FORMAT_BGRA, &Width, &Height);
+            Elapsed = os_time_now_microseconds() - Start;
+            Runs += 1;
+        }
+
+        if(Result != EZIMG_OK)
+        {
+            TextAppend(Out, ": error ");
+            TextAppendUInt(Out, (size_t)Result);
+            TextAppend(Out, "\n");
+        }
+        else
+        {
+            size_t Bytes = (size_t)Width*Height*4;
+            TextAppend(Out, ", ");
+            TextAppendUInt(Out, Width);
+            TextAppend(Out, "x");
+            TextAppendUInt(Out, Height);
+            TextAppend(Out, ": ");
+            TextAppendFixed3(Out, Elapsed / Runs);
+            TextAppend(Out, " ms/image, ");
+            TextAppendFixed3(Out, Bytes*Runs*1000 / (Elapsed ? Elapsed : 1));
+            TextAppend(Out, " MB/s\n");
+        }
+        TextFlush(Out);
+
+        os_memory_free(Pixels);
+        os_memory_free(File);
+    }
+}
+
+typedef struct
+bench_png_format
+{
+    char *Name;
+    int Format;
+    int Swizzle;
+} bench_png_format;
+
+bench_png_format BenchPngFormats[] =
+{
+    { "ARGB + BGRA pass", EZIMG_FORMAT_ARGB, 1 },
+    { "BGRA", EZIMG_FORMAT_BGRA, 0 },
+    { "RGBA", EZIMG_FORMAT_RGBA, 0 },
+    { "premultiplied BGRA", EZIMG_FORMAT_BGRA_PREMULTIPLIED, 0 },
+    { "alpha8", EZIMG_FORMAT_ALPHA8, 0 },
+    { "luma8", EZIMG_FORMAT_LUMA8, 0 },
+    { "mask1", EZIMG_FORMAT_MASK1, 0 },
+};
+
+#define BENCH_PNG_FORMAT_COUNT (sizeof(BenchPngFormats)/sizeof(BenchPngFormats[0]))
+
+/* Decodes the first of BenchPngs to every output format. The first entry
+   is how images used to be loaded, ARGB and then a pass rewriting every
+   pixel to BGRA */
+void
+BenchPngOutputFormats(text *Out)
+{
+    TextAppend(Out, "PNG output formats, ");
+    TextAppend(Out, BenchPngs[0]);
+    TextAppend(Out, ":\n");
+    TextFlush(Out);
+
+    size_t FileSize;
+    void *File = ReadEntireFile(BenchPngs[0], &FileSize);
+    uint ImageSize = File ? ezimg_png_size(File, (uint)FileSize, EZIMG_FORMAT_BGRA) : 0;
+    void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+    if(!Pixels)
+    {
+        TextAppend(Out, "  could not read\n");
+        TextFlush(Out);
+        if(File)
+        {
+            os_memory_free(File);
+        }
+        return;
+    }
+
+    for(uint Index = 0; Index < BENCH_PNG_FORMAT_COUNT; ++Index)
+    {
+        bench_png_format *Format = BenchPngFormats + Index;
+        uint Width = 0, Height = 0;
+        uint Runs = 0;
+        int Result = EZIMG_OK;
+        size_t Start = os_time_now_microseconds();
+        size_t Elapsed = 0;
+        while(Result == EZIMG_OK && (Runs == 0 || Elapsed < 100*1000))
+        {
+            Result = ezimg_png_load(File, (uint)FileSize, Pixels, ImageSize, Format->Format, &Width, &Height);
+            if(Format->Swizzle)
+            {
+                u32 *Pixel = (u32 *)Pixels;
+                for(uint PixelIndex = 0; PixelIndex < Width*Height; ++PixelIndex)
+                {
+                    u32 P = Pixel[PixelIndex];
+                    Pixel[PixelIndex] =
+                        ((P >> 24) & 0xff) |
+                        ((P >>  8) & 0xff00) |
+                        ((P <<  8) & 0xff0000) |
+                        ((P << 24) & 0xff000000);
+                }
+            }
+            Elapsed = os_time_now_microseconds() - Start;
+            Runs += 1;
+        }
+
+        TextAppend(Out, "  ");
+        TextAppend(Out, Format->Name);
+        if(Result != EZIMG_OK)
+        {
+            TextAppend(Out, ": error ");
+            TextAppendUInt(Out, (size_t)Result);
+            TextAppend(Out, "\n");
+        }
+        else
+        {
+            TextAppend(Out, ": ");
+            TextAppendFixed3(Out, Elapsed / Runs);
+            TextAppend(Out, " ms/image\n");
+        }
+        TextFlush(Out);
+    }
+
+    os_memory_free(Pixels);
+    os_memory_free(File);
+}
+
+u8 *
+BenchPutU32BE(u8 *Dest, u32 Value)
+{
+    Dest[0] = (u8)(Value >> 24);
+    Dest[1] = (u8)(Value >> 16);
+    Dest[2] = (u8)(Value >> 8);
+    Dest[3] = (u8)Value;
+    return(Dest + 4);
+}
+
+/* Builds a Width x Height RGB PNG of random bytes, with the rows cycling
+   through the five filter types. The zlib stream is made of stored
+   blocks so inflate costs next to nothing, and the CRCs and the Adler-32
+   are left 0 since ezimg does not check them. */
+u8 *
+BenchMakeRgbPng(uint Width, uint Height, uint *Size)
+{
+    uint RawSize = Height*(1 + Width*3);
+    uint BlockCount = (RawSize + 65534)/65535;
+    uint ZlibSize = 2 + BlockCount*5 + RawSize + 4;
+    *Size = 8 + (12 + 13) + (12 + ZlibSize) + 12;
+
+    u8 *Png = os_memory_alloc(*Size);
+    if(!Png)
+    {
+        return(0);
+    }
+
+    u8 Signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    u8 *Dest = Png;
+    for(uint Index = 0; Index < 8; ++Index)
+    {
+        *Dest++ = Signature[Index];
+    }
+
+    Dest = BenchPutU32BE(Dest, 13);
+    Dest = BenchPutU32BE(Dest, 0x49484452);
+    Dest = BenchPutU32BE(Dest, Width);
+    Dest = BenchPutU32BE(Dest, Height);
+    *Dest++ = 8; /* bit depth */
+    *Dest++ = 2; /* RGB */
+    *Dest++ = 0;
+    *Dest++ = 0;
+    *Dest++ = 0;
+    Dest = BenchPutU32BE(Dest, 0);
+
+    Dest = BenchPutU32BE(Dest, ZlibSize);
+    Dest = BenchPutU32BE(Dest, 0x49444154);
+    *Dest++ = 0x78;
+    *Dest++ = 0x01;
+
+    BenchRandomState = 0x2545f491;
+    uint Written = 0;
+    for(uint Block = 0; Block < BlockCount; ++Block)
+    {
+        uint Length = (RawSize - Written > 65535) ? 65535 : RawSize - Written;
+        *Dest++ = (Block == BlockCount - 1) ? 1 : 0;
+        *Dest++ = (u8)Length;
+        *Dest++ = (u8)(Length >> 8);
+        *Dest++ = (u8)~Length;
+        *Dest++ = (u8)(~Length >> 8);
+
+        for(uint Index = 0; Index < Length; ++Index, ++Written)
+        {
+            uint RowOffset = Written % (1 + Width*3);
+            *Dest++ = RowOffset ? (u8)BenchRandom() : (u8)((Written / (1 + Width*3)) % 5);
+        }
+    }
+    Dest = BenchPutU32BE(Dest, 0);
+    Dest = BenchPutU32BE(Dest, 0);
+
+    Dest = BenchPutU32BE(Dest, 0);
+    Dest = BenchPutU32BE(Dest, 0x49454e44);
+    Dest = BenchPutU32BE(Dest, 0);
+
+    return(Png);
+}
+
+/* Loads RGB PNGs of growing size, the time per pixel should stay flat */
+void
+BenchRgbPngScaling(text *Out)
+{
+    TextAppend(Out, "RGB PNG loading:\n");
+    TextFlush(Out);
+
+    for(uint Side = 256; Side <= 2048; Side *= 2)
+    {
+        uint Size;
+        u8 *Png = BenchMakeRgbPng(Side, Side, &Size);
+        uint ImageSize = Png ? ezimg_png_size(Png, Size, EZIMG_FORMAT_BGRA) : 0;
+        void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+        if(!Pixels)
+        {
+            if(Png)
+            {
+                os_memory_free(Png);
+            }
+            continue;
+        }
+
+        uint Width, Height;
+        size_t Start = os_time_now_microseconds();
+        int Result = ezimg_png_load(Png, Size, Pixels, ImageSize, EZIMG_FORMAT_BGRA, &Width, &Height);
+        size_t Elapsed = os_time_now_microseconds() - Start;
+
+        TextAppend(Out, "  ");
+        TextAppendUInt(Out, Side);
+        TextAppend(Out, "x");
+        TextAppendUInt(Out, Side);
+        if(Result != EZIMG_OK)
+        {
+            TextAppend(Out, ": error ");
+            TextAppendUInt(Out, (size_t)Result);
+            TextAppend(Out, "\n");
+        }
+        else
+        {
+            TextAppend(Out, ": ");
+            TextAppendFixed3(Out, Elapsed);
+            TextAppend(Out, " ms, ");
+            TextAppendFixed3(Out, Elapsed*1000*1000 / ((size_t)Side*Side));
+            TextAppend(Out, " ns/pixel\n");
+        }
+        TextFlush(Out);
+
+        os_memory_free(Pixels);
+        os_memory_free(Png);
+    }
+}
+
+/* Rewrites a PNG made by BenchMakeRgbPng with its zlib stream split
+   into IDAT chunks of ChunkSize bytes, the way most exporters write
+   them */
+u8 *
+BenchSplitIdat(u8 *Png, uint Size, uint ChunkSize, uint *SplitSize)
+{
+    uint ZlibSize = Size - 8 - (12 + 13) - 12 - 12;
+    uint ChunkCount = (ZlibSize + ChunkSize - 1)/ChunkSize;
+    *SplitSize = 8 + (12 + 13) + ChunkCount*12 + ZlibSize + 12;
+
+    u8 *Split = os_memory_alloc(*SplitSize);
+    if(!Split)
+    {
+        return(0);
+    }
+
+    u8 *Dest = Split;
+    for(uint Index = 0; Index < 8 + 12 + 13; ++Index)
+    {
+        *Dest++ = Png[Index];
+    }
+
+    u8 *Zlib = Png + 8 + (12 + 13) + 8;
+    for(uint Offset = 0; Offset < ZlibSize; Offset += ChunkSize)
+    {
+        uint Length = (ZlibSize - Offset < ChunkSize) ? ZlibSize - Offset : ChunkSize;
+        Dest = BenchPutU32BE(Dest, Length);
+        Dest = BenchPutU32BE(Dest, 0x49444154);
+        for(uint Index = 0; Index < Length; ++Index)
+        {
+            *Dest++ = Zlib[Offset + Index];
+        }
+        Dest = BenchPutU32BE(Dest, 0);
+    }
+
+    Dest = BenchPutU32BE(Dest, 0);
+    Dest = BenchPutU32BE(Dest, 0x49454e44);
+    Dest = BenchPutU32BE(Dest, 0);
+
+    return(Split);
+}
+
+/* Loads a 2048x2048 RGB PNG with its data in one IDAT chunk and split in
+   8K ones, which should take the same time */
+void
+BenchPngIdatChunks(text *Out)
+{
+    TextAppend(Out, "PNG IDAT chunks, 2048x2048 RGB:\n");
+    TextFlush(Out);
+
+    uint Size;
+    u8 *Png = BenchMakeRgbPng(2048, 2048, &Size);
+    uint ImageSize = Png ? ezimg_png_size(Png, Size, EZIMG_FORMAT_BGRA) : 0;
+    void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+    if(!Pixels)
+    {
+        if(Png)
+        {
+            os_memory_free(Png);
+        }
+        return;
+    }
+
+    uint ChunkSizes[2] = { 0, 8*1024 };
+    u32 Hash = 0;
+    for(uint Index = 0; Index < 2; ++Index)
+    {
+        uint FileSize = Size;
+        u8 *File = Png;
+        if(ChunkSizes[Index])
+        {
+            File = BenchSplitIdat(Png, Size, ChunkSizes[Index], &FileSize);
+            if(!File)
+            {
+                continue;
+            }
+        }
+
+        uint Width, Height;
+        size_t Start = os_time_now_microseconds();
+        int Result = ezimg_png_load(File, FileSize, Pixels, ImageSize, EZIMG_FORMAT_BGRA, &Width, &Height);
+        size_t Elapsed = os_time_now_microseconds() - Start;
+
+        TextAppend(Out, ChunkSizes[Index] ? "  8K chunks" : "  one chunk");
+        if(Result != EZIMG_OK)
+        {
+            TextAppend(Out, ": error ");
+            TextAppendUInt(Out, (size_t)Result);
+            TextAppend(Out, "\n");
+        }
+        else
+        {
+            u32 PixelHash = HashPixels((u32 *)Pixels, Width*Height);
+            if(Index == 0)
+            {
+                Hash = PixelHash;
+            }
+
+            TextAppend(Out, ": ");
+            TextAppendFixed3(Out, Elapsed);
+            TextAppend(Out, (PixelHash == Hash) ? " ms\n" : " ms MISMATCH\n");
+        }
+        TextFlush(Out);
+
+        if(File != Png)
+        {
+            os_memory_free(File);
+        }
+    }
+
+    os_memory_free(Pixels);
+    os_memory_free(Png);
+}
+
+/* Hashes the rows handed over by the push decoder, in order */
+void
+BenchPngRowCallback(void *User, void *Row, uint Y, uint Width)
+{
+    u32 *Hash = (u32 *)User;
+    *Hash = *Hash*16777619u ^ HashPixels((u32 *)Row, Width) ^ Y;
+}
+
+/* Decodes a 2048x2048 RGB PNG with ezimg_png_load, and with the push
+   decoder fed LOAD_PIECE_SIZE pieces into the whole image and into one
+   row handed to a callback, checking that the pixels match */
+void
+BenchPngPushDecode(text *Out)
+{
+    TextAppend(Out, "PNG push decoding, 2048x2048 RGB:\n");
+    TextFlush(Out);
+
+    uint Size;
+    u8 *Png = BenchMakeRgbPng(2048, 2048, &Size);
+    uint ImageSize = Png ? ezimg_png_size(Png, Size, EZIMG_FORMAT_BGRA) : 0;
+    void *Pixels = ImageSize ? os_memory_alloc(ImageSize) : 0;
+    if(!Pixels)
+    {
+        if(Png)
+        {
+            os_memory_free(Png);
+        }
+        return;
+    }
+
+    uint Width, Height;
+    /* What ezimg_png_load gives, over the whole image and row by row the
+       way the callback sees it */
+    u32 Expected[3] = {0};
+    u32 Hash = 0;
+    char *Names[3] = { "load", "push, whole image", "push, row callback" };
+    for(uint Mode = 0; Mode < 3; ++Mode)
+    {
+        uint Needed = (Mode == 0) ? ImageSize : ezimg_png_decoder_size(Png, Size, EZIMG_FORMAT_BGRA, Mode == 2);
+        int Result = EZIMG_OK;
+        Hash = 0;
+        size_t Start = os_time_now_microseconds();
+        if(Mode == 0)
+        {
+            Result = ezimg_png_load(Png, Size, Pixels, ImageSize, EZIMG_FORMAT_BGRA, &Width, &Height);
+        }
+        else
+        {
+            void *Memory = os_memory_alloc(Needed);
+            ezimg_png_decoder *Decoder = Memory ?
+                ezimg_png_init(Memory, Needed, EZIMG_FORMAT_BGRA, (Mode == 2) ? BenchPngRowCallback : 0, &Hash) : 0;
+            if(!Decoder)
+            {
+                if(Memory)
+                {
+                    os_memory_free(Memory);
+                }
+                continue;
+            }
+
+            for(uint Offset = 0; Offset < Size && Result == EZIMG_OK; Offset += LOAD_PIECE_SIZE)
+            {
+                uint Count = (Size - Offset < LOAD_PIECE_SIZE) ? Size - Offset : LOAD_PIECE_SIZE;
+                Result = ezimg_png_feed(Decoder, Png + Offset, Count);
+            }
+
+            if(Result == EZIMG_OK)
+            {
+                Result = ezimg_png_finish(Decoder, &Width, &Height);
+            }
+
+            if(Mode == 1)
+            {
+                Hash = HashPixels((u32 *)Memory, Width*Height);
+            }
+            os_memory_free(Memory);
+        }
+        size_t Elapsed = os_time_now_microseconds() - Start;
+
+        if(Mode == 0 && Result == EZIMG_OK)
+        {
+            Expected[1] = HashPixels((u32 *)Pixels, Width*Height);
+            for(uint Y = 0; Y < Height; ++Y)
+            {
+                BenchPngRowCallback(Expected + 2, (u32 *)Pixels + Y*Width, Y, Width);
+            }
+        }
+
+        TextAppend(Out, "  ");
+        TextAppend(Out, Names[Mode]);
+        if(Result != EZIMG_OK)
+        {
+            TextAppend(Out, ": error ");
+            TextAppendUInt(Out, (size_t)Result);
+            TextAppend(Out, "\n");
+        }
+        else
+        {
+            TextAppend(Out, ": ");
+            TextAppendFixed3(Out, Elapsed);
+            TextAppend(Out, " ms, ");
+            TextAppendUInt(Out, ((Mode == 0) ? Size + Needed : LOAD_PIECE_SIZE + Needed)/1024);
+            TextAppend(Out, " KB");
+            TextAppend(Out, (Mode == 0 || Hash == Expected[Mode]) ? "\n" : " MISMATCH\n");
+        }
+        TextFlush(Out);
+    }
+
+    os_memory_free(Pixels);
+    os_memory_free(Png);
+}
+
+#define BENCH_UNFILTER_SIDE 1024
+
+u8 BenchFilteredRows[BENCH_UNFILTER_SIDE*(1 + BENCH_UNFILTER_SIDE*4)];
+u8 BenchUnfilteredRows[BENCH_UNFILTER_SIDE*BENCH_UNFILTER_SIDE*4];
+
+/* Unfilters 1024x1024 images of random bytes where every row has the same
+   filter type, with each set of ezimg unfilter kernels, and checks that
+   they all produce the scalar bytes */
+void
+BenchPngUnfilter(text *Out)
+{
+    char *FilterNames[5] = { "none", "sub", "up", "average", "paeth" };
+    int Kernels[2] = { EZIMG_UNFILTER_SCALAR, EZIMG_UNFILTER_SSE2 };
+    char *KernelNames[2] = { "scalar", "sse2" };
+
+    TextAppend(Out, "PNG unfilter, 1024x1024:\n");
+    TextFlush(Out);
+
+    for(uint Bpp = 3; Bpp <= 4; ++Bpp)
+    {
+        uint Size = BENCH_UNFILTER_SIDE*(1 + BENCH_UNFILTER_SIDE*Bpp);
+        for(uint Filter = 0; Filter < 5; ++Filter)
+        {
+            BenchRandomState = 0x2545f491;
+            for(uint Index = 0; Index < Size; ++Index)
+            {
+                BenchFilteredRows[Index] = (Index % (1 + BENCH_UNFILTER_SIDE*Bpp)) ? (u8)BenchRandom() : (u8)Filter;
+            }
+
+            TextAppend(Out, (Bpp == 3) ? "  RGB " : "  RGBA ");
+            TextAppend(Out, FilterNames[Filter]);
+            TextAppend(Out, ":");
+
+            u32 ScalarHash = 0;
+            for(uint Kernel = 0; Kernel < 2; ++Kernel)
+            {
+                if(!ezimg_png_set_unfilter(Kernels[Kernel]))
+                {
+                    continue;
+                }
+
+                size_t Elapsed = 0;
+                for(uint Run = 0; Run < 10; ++Run)
+                {
+                    uint Length = BENCH_UNFILTER_SIDE*Bpp;
+                    size_t Start = os_time_now_microseconds();
+                    for(uint Y = 0; Y < BENCH_UNFILTER_SIDE; ++Y)
+                    {
+                        u8 *Src = BenchFilteredRows + Y*(1 + Length);
+                        u8 *Dest = BenchUnfilteredRows + Y*Length;
+                        ezimg_png_unfilter_row(Dest, Src + 1, Y ? Dest - Length : 0, Length, Bpp, Src[0]);
+                    }
+                    Elapsed += os_time_now_microseconds() - Start;
+                }
+
+                u32 Hash = HashPixels((u32 *)BenchUnfilteredRows, BENCH_UNFILTER_SIDE*BENCH_UNFILTER_SIDE*Bpp/4);
+                if(Kernel == 0)
+                {
+                    ScalarHash = Hash;
+                }
+
+                TextAppend(Out, Kernel ? ", " : " ");
+                TextAppend(Out, KernelNames[Kernel]);
+                TextAppend(Out, " ");
+                TextAppendFixed3(Out, Elapsed / 10);
+                TextAppend(Out, (Hash == ScalarHash) ? " ms" : " ms MISMATCH");
+            }
+            TextAppend(Out, "\n");
+            TextFlush(Out);
+        }
+    }
+
+    ezimg_png_set_unfilter(EZIMG_UNFILTER_AUTO);
+}
+
+void
+RunBenchmarks(void)
+{
+    static text Out;
+
+    BenchFontImage = LoadImagePng("res/font16x16.png", EZIMG_FORMAT_BGRA);
+    if(!BenchFontImage.Pixels)
+    {
+        TextAppend(&Out, "Could not load res/font16x16.png\n");
+        TextFlush(&Out);
+        return;
+    }
+
+    if(!LoadFont("res/font16x16.png"))
+    {
+        return;
+    }
+
+    BenchBlitKernels(&Out);
+    BenchGlyphBlitters(&Out);
+
+    BenchAlphaBlend(&Out);
+    BenchLighting(&Out);
+
+    BenchRenderThreads(&Out);
+    BenchScrolling(&Out);
+    BenchDrawCommands(&Out);
+    BenchMinimap(&Out);
+    BenchPngDecode(&Out);
+    BenchPngOutputFormats(&Out);
+    BenchRgbPngScaling(&Out);
+    BenchPngIdatChunks(&Out);
+    BenchPngPushDecode(&Out);
+    BenchPngUnfilter(&Out);
+}
+
+#endif
+
+#define DEFAULT_FONT_PATH "res/font16x16.png"
+
+#ifdef R0GU3_HEADLESS
+
+/*
+ * Headless driver
+ *
+ * Plays a scripted list of moves with no window and prints the hash of
+ * every frame, along with how many cells each layer composited and the
+ * draw commands submitted/culled/executed. Frame 0 is the starting
+ * position and each move renders one more frame, e.g.
+ *
+ *     build/headless --moves uurr.d --dump 0 --dump 6 --ppm --out build/frame
+ *
+ * prints 7 hashes and writes build/frame0000.ppm and build/frame0006.ppm.
+ * Moves are u, d, l and r; anything else skips a turn. headless_bench
+ * only runs the benchmarks, and takes --png file to add PNGs to the
+ * decoding one (res/bench/make_pngs.py writes the set it is compared on).
+ */
+
+int
+StringsAreEqual(char *A, char *B)
+{
+    while(*A && *A == *B)
+    {
+        ++A;
+        ++B;
+    }
+    return(*A == *B);
+}
+
+uint
+ParseUInt(char *String)
+{
+    uint Value = 0;
+    while(*String >= '0' && *String <= '9')
+    {
+        Value = Value*10 + (uint)(*String++ - '0');
+    }
+    return(Value);
+}
+
+#define MAX_DUMPED_FRAMES 64
+
+int
+main(int ArgCount, char **Args)
+{
+    char *FontPath = DEFAULT_FONT_PATH;
+    char *Moves = "";
+    char *OutPrefix = "frame";
+    frame_format Format = FRAME_FORMAT_BGRA;
+    int PaletteMode = 0;
+    uint Threads = RENDER_THREADS;
+    uint Dumps[MAX_DUMPED_FRAMES];
+    uint DumpCount = 0;
+
+    for(int Index = 1; Index < ArgCount; ++Index)
+    {
+        char *Arg = Args[Index];
+        char *Value = (Index + 1 < ArgCount) ? Args[Index + 1] : 0;
+
+        if(StringsAreEqual(Arg, "--ppm"))
+        {
+            Format = FRAME_FORMAT_PPM;
+        }
+        else if(StringsAreEqual(Arg, "--palette"))
+        {
+            PaletteMode = 1;
+        }
+        else if(Value && StringsAreEqual(Arg, "--font"))
+        {
+            FontPath = Value;
+            ++Index;
+        }
+        else if(Value && StringsAreEqual(Arg, "--moves"))
+        {
+            Moves = Value;
+            ++Index;
+        }
+        else if(Value && StringsAreEqual(Arg, "--out"))
+        {
+            OutPrefix = Value;
+            ++Index;
+        }
+        else if(Value && StringsAreEqual(Arg, "--threads"))
+        {
+            Threads = ParseUInt(Value);
+            ++Index;
+        }
+        else if(Value && StringsAreEqual(Arg, "--dump") && DumpCount < MAX_DUMPED_FRAMES)
+        {
+            Dumps[DumpCount++] = ParseUInt(Value);
+            ++Index;
+        }
+#ifdef R0GU3_BENCHMARK
+        else if(Value && StringsAreEqual(Arg, "--png") && BenchPngCount < MAX_BENCH_PNGS)
+        {
+            BenchPngs[BenchPngCount++] = Value;
+            ++Index;
+        }
+#endif
+    }
+
+    text Out = {0};
+
+    InitBlitKernels();
+    SetRenderThreadCount(Threads);
+
+#ifdef R0GU3_BENCHMARK
+    RunBenchmarks();
+    return(0);
+#endif
+
+    if(!LoadFont(FontPath))
+    {
+        TextAppend(&Out, "Could not load font ");
+        TextAppend(&Out, FontPath);
+        TextAppend(&Out, "\n");
+        TextFlush(&Out);
+        return(1);
+    }
+
+    u32 *Pixels = (u32 *)os_memory_alloc((size_t)BufferWidth*BufferHeight*sizeof(u32));
+    if(!Pixels)
+    {
+        return(1);
+    }
+
+    SetRenderTarget(Pixels);
+    GlyphCacheReset();
+    SetPaletteMode(PaletteMode);
+
+    GenerateMap();
+    entity *Player = CreateStartingEntities();
+    CenterCamera(Player);
+    GameIsRunning = 1;
+
+    for(uint Frame = 0; ; ++Frame)
+    {
+        if(Frame > 0)
+        {
+            char Move = Moves[Frame - 1];
+            action Action = {0};
+            Action.Type = ACT_MOVE;
+            Action.Dx = (Move == 'r') - (Move == 'l');
+            Action.Dy = (Move == 'd') - (Move == 'u');
+            ApplyAction(Player, Action);
+        }
+
+        RenderFrame();
+
+        u32 Hash = HashFrame();
+        TextAppend(&Out, "frame ");
+        TextAppendUInt(&Out, Frame);
+        TextAppend(&Out, " ");
+        TextAppendHex32(&Out, Hash);
+        for(uint Type = 0; Type < LAYER_COUNT; ++Type)
+        {
+            TextAppend(&Out, " ");
+            TextAppend(&Out, LayerNames[Type]);
+            TextAppend(&Out, "=");
+            TextAppendUInt(&Out, Layers[Type].CompositedCells);
+        }
+        TextAppend(&Out, " commands=");
+        TextAppendUInt(&Out, RenderStats.CommandsSubmitted);
+        TextAppend(&Out, "/");
+        TextAppendUInt(&Out, RenderStats.CommandsCulled);
+        TextAppend(&Out, "/");
+        TextAppendUInt(&Out, RenderStats.CommandsExecuted);
+        TextAppend(&Out, "\n");
+
+        for(uint Index = 0; Index < DumpCount; ++Index)
+        {
+            if(Dumps[Index] != Frame)
+            {
+                continue;
+            }
+
+            text Path = {0};
+            TextAppend(&Path, OutPrefix);
+            TextAppend(&Path, (Frame < 1000) ? ((Frame < 100) ? ((Frame < 10) ? "000" : "00") : "0") : "");
+            TextAppendUInt(&Path, Frame);
+            TextAppend(&Path, (Format == FRAME_FORMAT_PPM) ? ".ppm" : ".bgra");
+            Path.Data[(Path.Length < sizeof(Path.Data)) ? Path.Length : sizeof(Path.Data) - 1] = 0;
+
+            if(!DumpFrame(Path.Data, Format))
+            {
+                TextAppend(&Out, "Could not write ");
+                TextAppend(&Out, Path.Data);
+                TextAppend(&Out, "\n");
+            }
+            break;
+        }
+
+        TextFlush(&Out);
+
+        if(!Moves[Frame])
+        {
+            break;
+        }
+    }
+
+    SetRenderTarget(0);
+    os_memory_free(Pixels);
+
+    return(0);
+}
+
+#else
+
+#include <windows.h>
+
+/* Returns the first argument after the program name, or 0 if there is
+   none, e.g. "r0gu3.exe res/font8x8.png" */
+char *
+FirstCommandLineArgument(void)
+{
+    static char Argument[MAX_PATH];
+    char *At = GetCommandLineA();
+
+    char Terminator = ' ';
+    if(*At == '"')
+    {
+        Terminator = '"';
+        ++At;
+    }
+    while(*At && *At != Terminator)
+    {
+        ++At;
+    }
+    if(*At == '"')
+    {
+        ++At;
+    }
+
+    while(*At == ' ' || *At == '\t')
+    {
+        ++At;
+    }
+
+    Terminator = ' ';
+    if(*At == '"')
+    {
+        Terminator = '"';
+        ++At;
+    }
+
+    uint Length = 0;
+    while(*At && *At != Terminator && Length < MAX_PATH - 1)
+    {
+        Argument[Length++] = *At++;
+    }
+    Argument[Length] = 0;
+
+    return(Length ? Argument : 0);
+}
+
+void
+main(void)
+{
+    InitBlitKernels();
+    SetRenderThreadCount(RENDER_THREADS);
+
+#ifdef R0GU3_BENCHMARK
+    RunBenchmarks();
+    ExitProcess(0);
+#endif
+
+    /* The font decides the glyph size, and so the window size */
+    char *FontPath = FirstCommandLineArgument();
+    if(!FontPath || !LoadFont(FontPath))
+    {
+        LoadFont(DEFAULT_FONT_PATH);
+    }
+
+    Ez.Display.Name = "r0gu3";
+    Ez.Display.Width = BufferWidth;
+    Ez.Display.Height = BufferHeight;
+    Ez.Display.Pixels = (void *)BackBuffer;
+    Ez.Display.RenderingType = EZ_RENDERING_SOFTWARE;
+    Ez.Display.PixelFormat = EZ_PIXEL_FORMAT_ARGB;
+
+    if(!EzInitialize(&Ez))
+    {
+        ExitProcess(1);
+    }
+
+    GenerateMap();
+    entity *Player = CreateStartingEntities();
+    CenterCamera(Player);
+
+    GlyphCacheReset();
+    SetPaletteMode(PALETTE_MODE);
+    InvalidateFrame();
+    GameIsRunning = 1;
+    while(GameIsRunning && Ez.Running)
+    {
+        if(EVENT_LOOP)
+        {
+            EzWait(&Ez, FrameWaitTimeout());
+        }
+        else
+        {
+            InvalidateFrame();
+        }
+        EzPull(&Ez);
+
+        /* Input */
+        action Action = {0};
+        if(Ez.Input.Keys[EZ_KEY_UP].Pressed)
+        {
+            Action.Type = ACT_MOVE;
+            Action.Dx = 0;
+            Action.Dy = -1;
+        }
+        else if(Ez.Input.Keys[EZ_KEY_DOWN].Pressed)
         {
             Action.Type = ACT_MOVE;
             Action.Dx = 0;
@@ -360,17 +6366,10 @@ main(void)
         }
 
         /* Logic */
-        switch(Action.Type)
+        if(Action.Type != ACT_NONE)
         {
-            case ACT_MOVE:
-            {
-                MoveEntity(Player, Action.Dx, Action.Dy);
-            } break;
-
-            case ACT_ESCAPE:
-            {
-                GameIsRunning = 0;
-            } break;
+            ApplyAction(Player, Action);
+            InvalidateFrame();
         }
 
         if(!GameIsRunning)
@@ -379,12 +6378,24 @@ main(void)
         }
 
         /* Render */
-        ClearBackBuffer(0x000000);
-        DrawEntity(Player);
-        DrawEntity(Npc);
+        if(ShouldRenderFrame())
+        {
+            RenderFrame();
+            EzPush(&Ez);
+        }
     }
 
     EzClose(&Ez);
 
+    text Out = {0};
+    TextAppend(&Out, "Frames rendered: ");
+    TextAppendUInt(&Out, FrameSchedule.FramesRendered);
+    TextAppend(&Out, ", skipped: ");
+    TextAppendUInt(&Out, FrameSchedule.FramesSkipped);
+    TextAppend(&Out, "\n");
+    TextFlush(&Out);
+
     ExitProcess(0);
 }
+
+#endif
@@ -13,9 +13,27 @@ size_t os_file_size(char *file_path);
 size_t os_file_read(char *file_path, void *dest, size_t num_bytes);
 size_t os_file_write(char *file_path, void *src, size_t num_bytes);
 
+/* Reading a file a piece at a time: os_file_read_next returns how many
+   bytes it read, 0 at the end of the file or on errors */
+void*  os_file_open(char *file_path);
+size_t os_file_read_next(void *file, void *dest, size_t num_bytes);
+void   os_file_close(void *file);
+
+/* Console */
+size_t os_console_write(char *str, size_t num_bytes);
+
 /* Time */
 size_t os_time_now_microseconds(void);
 
+/* Threads */
+typedef void (*os_thread_proc)(void *data);
+int          os_thread_start(os_thread_proc proc, void *data);
+unsigned int os_processor_count(void);
+void*        os_semaphore_create(unsigned int initial_count);
+void         os_semaphore_signal(void *semaphore, unsigned int count);
+void         os_semaphore_wait(void *semaphore);
+void         os_semaphore_destroy(void *semaphore);
+
 /* Libraries */
 typedef void (*os_proc)();
 int     os_lib_load(char *name);
@@ -197,6 +215,70 @@ os_file_write(char *file_path, void *src, size_t num_bytes)
     return(bytes_written);
 }
 
+void*
+os_file_open(char *file_path)
+{
+    HANDLE h_file;
+
+    h_file = CreateFileA(
+        file_path,
+        GENERIC_READ, FILE_SHARE_READ,
+        0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if(h_file == INVALID_HANDLE_VALUE)
+    {
+        return(0);
+    }
+
+    return((void *)h_file);
+}
+
+size_t
+os_file_read_next(void *file, void *dest, size_t num_bytes)
+{
+    DWORD bytes_read_dword;
+    BOOL operation_result;
+
+    operation_result = ReadFile(
+        (HANDLE)file, dest,
+        (DWORD)(num_bytes & 0xffffffff), &bytes_read_dword, 0);
+    if(!operation_result)
+    {
+        return(0);
+    }
+
+    return((size_t)bytes_read_dword);
+}
+
+void
+os_file_close(void *file)
+{
+    CloseHandle((HANDLE)file);
+}
+
+size_t
+os_console_write(char *str, size_t num_bytes)
+{
+    HANDLE h_console;
+    DWORD bytes_written_dword;
+    BOOL operation_result;
+
+    h_console = GetStdHandle(STD_OUTPUT_HANDLE);
+    if(h_console == INVALID_HANDLE_VALUE || h_console == NULL)
+    {
+        return(0);
+    }
+
+    operation_result = WriteFile(
+        h_console, str,
+        (DWORD)(num_bytes & 0xffffffff), &bytes_written_dword, 0);
+    if(!operation_result)
+    {
+        return(0);
+    }
+
+    return((size_t)bytes_written_dword);
+}
+
 size_t
 os_time_now_microseconds(void)
 {
@@ -216,6 +298,109 @@ os_time_now_microseconds(void)
     return(result);
 }
 
+typedef struct
+os_win32_thread
+{
+    int started;
+    os_thread_proc proc;
+    void *data;
+} os_win32_thread;
+
+#define OS_WIN32_MAX_THREADS 64
+os_win32_thread os_win32_threads[OS_WIN32_MAX_THREADS] = {0};
+
+static DWORD WINAPI
+os_win32_thread_entry(LPVOID param)
+{
+    os_win32_thread *thread = (os_win32_thread *)param;
+    thread->proc(thread->data);
+    return(0);
+}
+
+int
+os_thread_start(os_thread_proc proc, void *data)
+{
+    HANDLE h_thread;
+    int i, free_slot;
+
+    free_slot = -1;
+    for(i = 0;
+        i < OS_WIN32_MAX_THREADS;
+        ++i)
+    {
+        if(!os_win32_threads[i].started)
+        {
+            free_slot = i;
+            break;
+        }
+    }
+
+    if(free_slot < 0)
+    {
+        return(0);
+    }
+
+    os_win32_threads[free_slot].started = 1;
+    os_win32_threads[free_slot].proc = proc;
+    os_win32_threads[free_slot].data = data;
+
+    h_thread = CreateThread(
+        0, 0, os_win32_thread_entry,
+        &os_win32_threads[free_slot], 0, 0);
+    if(h_thread == NULL)
+    {
+        os_win32_threads[free_slot].started = 0;
+        return(0);
+    }
+
+    /* Threads run detached until the process exits */
+    CloseHandle(h_thread);
+
+    return(1);
+}
+
+unsigned int
+os_processor_count(void)
+{
+    SYSTEM_INFO system_info;
+
+    GetSystemInfo(&system_info);
+    if(system_info.dwNumberOfProcessors == 0)
+    {
+        return(1);
+    }
+
+    return((unsigned int)system_info.dwNumberOfProcessors);
+}
+
+void*
+os_semaphore_create(unsigned int initial_count)
+{
+    HANDLE h_semaphore;
+
+    h_semaphore = CreateSemaphoreA(0, (LONG)initial_count, 0x7fffffff, 0);
+
+    return((void *)h_semaphore);
+}
+
+void
+os_semaphore_signal(void *semaphore, unsigned int count)
+{
+    ReleaseSemaphore((HANDLE)semaphore, (LONG)count, 0);
+}
+
+void
+os_semaphore_wait(void *semaphore)
+{
+    WaitForSingleObject((HANDLE)semaphore, INFINITE);
+}
+
+void
+os_semaphore_destroy(void *semaphore)
+{
+    CloseHandle((HANDLE)semaphore);
+}
+
 typedef struct
 os_win32_loaded_lib
 {
@@ -306,6 +491,376 @@ os_lib_release(int os_lib)
 
 #endif
 
+#elif defined(OS_IMPLEMENTATION_POSIX)
+
+#ifndef OS_IMPLEMENTED_POSIX
+#define OS_IMPLEMENTED_POSIX
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* NOTE: mmap needs the size back to unmap, so it is kept right before
+   the returned pointer (16 bytes to keep SIMD alignment) */
+void*
+os_memory_alloc(size_t size)
+{
+    void *result;
+
+    result = mmap(
+        0, size + 16,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(result == MAP_FAILED)
+    {
+        return(0);
+    }
+
+    *(size_t *)result = size + 16;
+
+    return((char *)result + 16);
+}
+
+void
+os_memory_free(void *ptr)
+{
+    char *base;
+
+    if(!ptr)
+    {
+        return;
+    }
+
+    base = (char *)ptr - 16;
+    munmap(base, *(size_t *)base);
+}
+
+int
+os_file_exists(char *file_path)
+{
+    struct stat file_stat;
+
+    if(stat(file_path, &file_stat) != 0)
+    {
+        return(0);
+    }
+
+    return(S_ISREG(file_stat.st_mode));
+}
+
+size_t
+os_file_size(char *file_path)
+{
+    struct stat file_stat;
+
+    if(stat(file_path, &file_stat) != 0)
+    {
+        return(0);
+    }
+
+    return((size_t)file_stat.st_size);
+}
+
+size_t
+os_file_read(char *file_path, void *dest, size_t num_bytes)
+{
+    size_t bytes_read;
+    int fd;
+
+    fd = open(file_path, O_RDONLY);
+    if(fd < 0)
+    {
+        return(0);
+    }
+
+    bytes_read = 0;
+    while(bytes_read < num_bytes)
+    {
+        ssize_t result = read(fd, (char *)dest + bytes_read, num_bytes - bytes_read);
+        if(result <= 0)
+        {
+            break;
+        }
+
+        bytes_read += (size_t)result;
+    }
+
+    close(fd);
+
+    return(bytes_read);
+}
+
+size_t
+os_file_write(char *file_path, void *src, size_t num_bytes)
+{
+    size_t bytes_written;
+    int fd;
+
+    fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        return(0);
+    }
+
+    bytes_written = 0;
+    while(bytes_written < num_bytes)
+    {
+        ssize_t result = write(fd, (char *)src + bytes_written, num_bytes - bytes_written);
+        if(result <= 0)
+        {
+            break;
+        }
+
+        bytes_written += (size_t)result;
+    }
+
+    close(fd);
+
+    return(bytes_written);
+}
+
+/* NOTE: The descriptor is kept plus one so that 0 means no file */
+void*
+os_file_open(char *file_path)
+{
+    int fd;
+
+    fd = open(file_path, O_RDONLY);
+    if(fd < 0)
+    {
+        return(0);
+    }
+
+    return((void *)((size_t)fd + 1));
+}
+
+size_t
+os_file_read_next(void *file, void *dest, size_t num_bytes)
+{
+    ssize_t result;
+
+    result = read((int)((size_t)file - 1), dest, num_bytes);
+    if(result < 0)
+    {
+        return(0);
+    }
+
+    return((size_t)result);
+}
+
+void
+os_file_close(void *file)
+{
+    close((int)((size_t)file - 1));
+}
+
+size_t
+os_console_write(char *str, size_t num_bytes)
+{
+    ssize_t result;
+
+    result = write(STDOUT_FILENO, str, num_bytes);
+    if(result < 0)
+    {
+        return(0);
+    }
+
+    return((size_t)result);
+}
+
+size_t
+os_time_now_microseconds(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        return(0);
+    }
+
+    return((size_t)now.tv_sec*1000000 + (size_t)now.tv_nsec/1000);
+}
+
+typedef struct
+os_posix_thread
+{
+    int started;
+    os_thread_proc proc;
+    void *data;
+} os_posix_thread;
+
+#define OS_POSIX_MAX_THREADS 64
+os_posix_thread os_posix_threads[OS_POSIX_MAX_THREADS] = {0};
+
+static void *
+os_posix_thread_entry(void *param)
+{
+    os_posix_thread *thread = (os_posix_thread *)param;
+    thread->proc(thread->data);
+    return(0);
+}
+
+int
+os_thread_start(os_thread_proc proc, void *data)
+{
+    pthread_t thread;
+    int i, free_slot;
+
+    free_slot = -1;
+    for(i = 0;
+        i < OS_POSIX_MAX_THREADS;
+        ++i)
+    {
+        if(!os_posix_threads[i].started)
+        {
+            free_slot = i;
+            break;
+        }
+    }
+
+    if(free_slot < 0)
+    {
+        return(0);
+    }
+
+    os_posix_threads[free_slot].started = 1;
+    os_posix_threads[free_slot].proc = proc;
+    os_posix_threads[free_slot].data = data;
+
+    if(pthread_create(&thread, 0, os_posix_thread_entry, &os_posix_threads[free_slot]) != 0)
+    {
+        os_posix_threads[free_slot].started = 0;
+        return(0);
+    }
+
+    /* Threads run detached until the process exits */
+    pthread_detach(thread);
+
+    return(1);
+}
+
+unsigned int
+os_processor_count(void)
+{
+    long count;
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count <= 0)
+    {
+        return(1);
+    }
+
+    return((unsigned int)count);
+}
+
+void*
+os_semaphore_create(unsigned int initial_count)
+{
+    sem_t *semaphore;
+
+    semaphore = (sem_t *)os_memory_alloc(sizeof(sem_t));
+    if(!semaphore)
+    {
+        return(0);
+    }
+
+    if(sem_init(semaphore, 0, initial_count) != 0)
+    {
+        os_memory_free(semaphore);
+        return(0);
+    }
+
+    return((void *)semaphore);
+}
+
+void
+os_semaphore_signal(void *semaphore, unsigned int count)
+{
+    while(count--)
+    {
+        sem_post((sem_t *)semaphore);
+    }
+}
+
+void
+os_semaphore_wait(void *semaphore)
+{
+    while(sem_wait((sem_t *)semaphore) != 0)
+    {
+        /* Interrupted by a signal, wait again */
+    }
+}
+
+void
+os_semaphore_destroy(void *semaphore)
+{
+    sem_destroy((sem_t *)semaphore);
+    os_memory_free(semaphore);
+}
+
+#define OS_POSIX_MAX_LOADED_LIBS 30
+void *os_posix_loaded_libs[OS_POSIX_MAX_LOADED_LIBS] = {0};
+
+int
+os_lib_load(char *name)
+{
+    void *handle;
+    int i;
+
+    handle = dlopen(name, RTLD_NOW);
+    if(!handle)
+    {
+        return(0);
+    }
+
+    for(i = 1;
+        i <= OS_POSIX_MAX_LOADED_LIBS;
+        ++i)
+    {
+        if(!os_posix_loaded_libs[i - 1])
+        {
+            os_posix_loaded_libs[i - 1] = handle;
+            return(i);
+        }
+    }
+
+    dlclose(handle);
+
+    return(0);
+}
+
+os_proc
+os_proc_get(int os_lib, char *proc_name)
+{
+    if(os_lib <= 0 || os_lib > OS_POSIX_MAX_LOADED_LIBS ||
+       !os_posix_loaded_libs[os_lib - 1])
+    {
+        return((os_proc)0);
+    }
+
+    return((os_proc)dlsym(os_posix_loaded_libs[os_lib - 1], proc_name));
+}
+
+void
+os_lib_release(int os_lib)
+{
+    if(os_lib <= 0 || os_lib > OS_POSIX_MAX_LOADED_LIBS ||
+       !os_posix_loaded_libs[os_lib - 1])
+    {
+        return;
+    }
+
+    dlclose(os_posix_loaded_libs[os_lib - 1]);
+    os_posix_loaded_libs[os_lib - 1] = 0;
+}
+
+#endif
+
 #else
 
 #error "Invalid Operating System"